@@ -0,0 +1,4285 @@
+#include "archive.h"
+#include <sys/ioctl.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+int verbose = 0;
+unsigned char compression = 0; // Codec para los archivos nuevos (-z)
+unsigned char deduplicate = 0; // Compartir bloques repetidos (--dedup)
+
+// CRC32C (Castagnoli). Con SSE4.2 se usa la instruccion crc32 sobre tres
+// flujos intercalados que luego se combinan con una multiplicacion sin
+// acarreo (PCLMUL); sin esas extensiones se usa una tabla slicing-by-8.
+
+#define CRC32C_POLY 0x82F63B78u // Polinomio reflejado
+#define CRC32C_STRIDE 8192      // Tamanno minimo de cada flujo intercalado
+
+unsigned int crc32cTable[8][256];
+int crc32cHasHardware = 0;
+pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+void initCrc32c()
+{
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        unsigned int crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32cTable[0][i] = crc;
+    }
+    for (unsigned int i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            crc32cTable[k][i] = (crc32cTable[k - 1][i] >> 8) ^ crc32cTable[0][crc32cTable[k - 1][i] & 0xFF];
+        }
+    }
+#if defined(__x86_64__)
+    crc32cHasHardware = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+}
+
+unsigned int crc32cSoftware(unsigned int crc, const unsigned char *p, size_t length)
+{
+    // Slicing-by-8: ocho bytes por iteracion con ocho tablas
+    while (length >= 8)
+    {
+        unsigned int low, high;
+        memcpy(&low, p, 4);
+        memcpy(&high, p + 4, 4);
+        low ^= crc;
+        crc = crc32cTable[7][low & 0xFF] ^ crc32cTable[6][(low >> 8) & 0xFF] ^
+              crc32cTable[5][(low >> 16) & 0xFF] ^ crc32cTable[4][low >> 24] ^
+              crc32cTable[3][high & 0xFF] ^ crc32cTable[2][(high >> 8) & 0xFF] ^
+              crc32cTable[1][(high >> 16) & 0xFF] ^ crc32cTable[0][high >> 24];
+        p += 8;
+        length -= 8;
+    }
+    while (length-- > 0)
+    {
+        crc = (crc >> 8) ^ crc32cTable[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+unsigned int crc32cMultiply(unsigned int a, unsigned int b)
+{
+    // Producto modulo el polinomio, en representacion reflejada
+    unsigned int product = 0;
+    for (unsigned int m = 1u << 31; m != 0; m >>= 1)
+    {
+        if (a & m)
+        {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+unsigned int crc32cPowerOfX(unsigned long long n)
+{
+    // x^n modulo el polinomio por cuadrados sucesivos
+    unsigned int result = 1u << 31, square = 1u << 30;
+    while (n > 0)
+    {
+        if (n & 1)
+        {
+            result = crc32cMultiply(result, square);
+        }
+        square = crc32cMultiply(square, square);
+        n >>= 1;
+    }
+    return result;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+__attribute__((target("sse4.2,pclmul"))) unsigned int crc32cShift(unsigned int crc, unsigned int constant)
+{
+    // clmul deja el producto corrido un grado; la constante ya lo compensa
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi32_si128(constant), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul"))) unsigned int crc32cHardware(unsigned int crc, const unsigned char *p, size_t length)
+{
+    if (length >= 3 * CRC32C_STRIDE)
+    {
+        // Tres flujos independientes aprovechan la latencia de la instruccion
+        size_t stride = (length / 3) & ~(size_t)7;
+        unsigned long long crcA = crc, crcB = 0, crcC = 0;
+        const unsigned char *a = p, *b = p + stride, *c = p + 2 * stride;
+        for (size_t i = 0; i < stride; i += 8)
+        {
+            unsigned long long va, vb, vc;
+            memcpy(&va, a + i, 8);
+            memcpy(&vb, b + i, 8);
+            memcpy(&vc, c + i, 8);
+            crcA = _mm_crc32_u64(crcA, va);
+            crcB = _mm_crc32_u64(crcB, vb);
+            crcC = _mm_crc32_u64(crcC, vc);
+        }
+        unsigned int shift = crc32cPowerOfX(8ULL * stride - 33);
+        crc = crc32cShift(crc32cShift(crcA, shift) ^ crcB, shift) ^ crcC;
+        p += 3 * stride;
+        length -= 3 * stride;
+    }
+
+    unsigned long long crc64 = crc;
+    while (length >= 8)
+    {
+        unsigned long long value;
+        memcpy(&value, p, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+        p += 8;
+        length -= 8;
+    }
+    crc = crc64;
+    while (length-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+unsigned int crc32cUpdate(unsigned int crc, const void *data, size_t length)
+{
+    pthread_once(&crc32cOnce, initCrc32c);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc32cHasHardware)
+    {
+        return ~crc32cHardware(crc, data, length);
+    }
+#endif
+    return ~crc32cSoftware(crc, data, length);
+}
+
+unsigned int crc32cCombine(unsigned int crcA, unsigned int crcB, size_t lengthB)
+{
+    // CRC de A seguido de B a partir del CRC de cada parte
+    return crc32cMultiply(crc32cPowerOfX(8ULL * lengthB), crcA) ^ crcB;
+}
+
+unsigned int crc32cZeros(size_t length)
+{
+    // CRC de length bytes en cero, por duplicacion y sin recorrerlos
+    static const char zero = 0;
+    unsigned int crc = 0, power = crc32cUpdate(0, &zero, 1);
+    size_t powerLength = 1;
+    while (length > 0)
+    {
+        if (length & 1)
+        {
+            crc = crc32cCombine(crc, power, powerLength);
+        }
+        power = crc32cCombine(power, power, powerLength);
+        powerLength *= 2;
+        length >>= 1;
+    }
+    return crc;
+}
+
+
+off_t blockOffset(unsigned int block)
+{
+    return HEADER_SIZE + (off_t)block * BLOCK_SIZE;
+}
+
+off_t dirPageOffset(FatTable *fatTable, unsigned int bucket)
+{
+    return blockOffset(fatTable->super.dir_start_block) + (off_t)bucket * DIR_PAGE_SIZE;
+}
+
+unsigned int hashFilename(const char *filename, size_t maxLength)
+{
+    // FNV-1a sobre el nombre (los registros cortos no terminan en '\0' si
+    // ocupan los 12 caracteres)
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < maxLength && filename[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)filename[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+unsigned int bucketForHash(FatTable *fatTable, unsigned int hash)
+{
+    // Hash lineal: las paginas anteriores a la proxima por dividir ya se
+    // dividieron y usan un bit mas del hash. Con una potencia de 2 no hay
+    // ninguna dividida y queda el calculo de siempre.
+    unsigned int buckets = fatTable->super.dir_buckets;
+    unsigned int level = 1u << (31 - __builtin_clz(buckets));
+    unsigned int bucket = hash & (level - 1);
+    if (bucket < buckets - level)
+    {
+        bucket = hash & (2 * level - 1);
+    }
+    return bucket;
+}
+
+unsigned int bucketForEntry(FatTable *fatTable, const FatEntry *entry)
+{
+    unsigned int hash = (entry->flags & FAT_LONG_NAME) ? entry->name.hash : hashFilename(entry->filename, 12);
+    return bucketForHash(fatTable, hash);
+}
+
+DirPage *newDirPage()
+{
+    DirPage *page = calloc(1, sizeof(DirPage));
+    for (unsigned int i = 0; i < DIR_PAGE_ENTRIES; i++)
+    {
+        page->entries[i].is_empty = 1;
+    }
+    return page;
+}
+
+void superBlockChecksum(SuperBlock *super, char checksum[8])
+{
+    // CRC32C del superbloque con el campo checksum en cero, en hexadecimal
+    SuperBlock copy = *super;
+    memset(copy.header.checksum, 0, sizeof(copy.header.checksum));
+    // Sin diario, sin tabla de cadenas o sin huecos de colas se usa el
+    // tamanno anterior, el de los TAR que no los tienen
+    size_t length = offsetof(SuperBlock, journal_start_block);
+    if (super->tail_hole_count > 0)
+    {
+        length = sizeof(SuperBlock);
+    }
+    else if (super->strtab_num_blocks > 0)
+    {
+        length = offsetof(SuperBlock, tail_hole_count);
+    }
+    else if (super->journal_num_blocks > 0)
+    {
+        length = offsetof(SuperBlock, strtab_start_block);
+    }
+    char hex[9];
+    snprintf(hex, sizeof(hex), "%08x", crc32cUpdate(0, &copy, length));
+    memcpy(checksum, hex, 8);
+}
+
+void initializeFatTable(FatTable *fatTable, int fd)
+{
+    memset(fatTable, 0, sizeof(FatTable));
+    fatTable->fd = fd;
+
+    strcpy(fatTable->super.header.magic_number, "ustar"); // Numero magico
+    memcpy(fatTable->super.header.version_number, FORMAT_VERSION, 2);
+    fatTable->super.block_size = BLOCK_SIZE;
+
+    // El directorio empieza con una pagina dentro del primer bloque
+    fatTable->super.dir_buckets = 1;
+    fatTable->super.dir_start_block = 0;
+    fatTable->super.dir_num_blocks = 1;
+    fatTable->super.next_free_block = 1;
+    fatTable->superDirty = 1;
+
+    fatTable->pages = calloc(1, sizeof(DirPage *));
+    fatTable->dirty = calloc(1, 1);
+    fatTable->pageCapacity = 1;
+    fatTable->pages[0] = newDirPage();
+    fatTable->dirty[0] = 1;
+}
+
+// Registro del formato 02, con el tamanno en 32 bits
+typedef struct LegacyFatEntry
+{
+    char filename[12];
+    unsigned int starting_block;
+    unsigned int num_blocks;
+    unsigned int file_size;
+    unsigned char is_empty;
+    unsigned char flags;
+    unsigned short tail_offset;
+} LegacyFatEntry;
+
+#define LEGACY_PAGE_ENTRIES ((DIR_PAGE_SIZE - 2 * sizeof(unsigned int)) / sizeof(LegacyFatEntry))
+
+void upgradeLegacyDirectory(FatTable *fatTable)
+{
+    // Las paginas del formato 02 caben menos registros nuevos: se leen todas
+    // y los registros se insertan de nuevo en memoria. El formato nuevo queda
+    // en disco con la primera operacion que guarde la FAT.
+    unsigned int oldBuckets = fatTable->super.dir_buckets;
+    unsigned int numEntries = 0;
+    LegacyFatEntry *entries = malloc((unsigned long)oldBuckets * LEGACY_PAGE_ENTRIES * sizeof(LegacyFatEntry) + 1);
+    char *page = malloc(DIR_PAGE_SIZE);
+    for (unsigned int i = 0; i < oldBuckets; i++)
+    {
+        if (pread(fatTable->fd, page, DIR_PAGE_SIZE, dirPageOffset(fatTable, i)) != DIR_PAGE_SIZE)
+        {
+            continue; // Pagina nunca escrita
+        }
+        LegacyFatEntry *pageEntries = (LegacyFatEntry *)(page + 2 * sizeof(unsigned int));
+        for (unsigned int j = 0; j < LEGACY_PAGE_ENTRIES; j++)
+        {
+            if (!pageEntries[j].is_empty)
+            {
+                entries[numEntries++] = pageEntries[j];
+            }
+        }
+    }
+    free(page);
+
+    memcpy(fatTable->super.header.version_number, FORMAT_VERSION, 2);
+    fatTable->super.num_entries = 0;
+    fatTable->superDirty = 1;
+    for (unsigned int i = 0; i < oldBuckets; i++)
+    {
+        fatTable->pages[i] = newDirPage();
+        fatTable->dirty[i] = 1;
+    }
+    for (unsigned int i = 0; i < numEntries; i++)
+    {
+        char filename[13];
+        strncpy(filename, entries[i].filename, 12);
+        filename[12] = '\0';
+        FatEntry *entry = addFatEntry(fatTable, filename);
+        entry->starting_block = entries[i].starting_block;
+        entry->num_blocks = entries[i].num_blocks;
+        entry->file_size = entries[i].file_size;
+        entry->flags = entries[i].flags & FAT_LAYOUT_FLAGS;
+        entry->tail_offset = entries[i].tail_offset;
+    }
+    free(entries);
+}
+
+off_t superBlockOffset(unsigned int sequence)
+{
+    return sequence % 2 ? SUPER_COPY_OFFSET : 0;
+}
+
+int readSuperBlock(int fd, off_t offset, SuperBlock *super)
+{
+    // Devuelve 0 si la copia es valida, o el errno que la descarta
+    if (pread(fd, super, sizeof(SuperBlock), offset) != sizeof(SuperBlock) ||
+        strcmp(super->header.magic_number, "ustar") != 0)
+    {
+        return EINVAL;
+    }
+    if ((memcmp(super->header.version_number, FORMAT_VERSION, 2) != 0 &&
+         memcmp(super->header.version_number, PREVIOUS_VERSION, 2) != 0 &&
+         memcmp(super->header.version_number, LEGACY_VERSION, 2) != 0) ||
+        super->block_size != BLOCK_SIZE)
+    {
+        return ENOTSUP;
+    }
+    char checksum[8];
+    superBlockChecksum(super, checksum);
+    if (super->header.checksum[0] != '\0' && memcmp(checksum, super->header.checksum, 8) != 0)
+    {
+        return EBADMSG;
+    }
+    return 0;
+}
+
+int loadFatTableFromFile(FatTable *fatTable, int fd)
+{
+    memset(fatTable, 0, sizeof(FatTable));
+    fatTable->fd = fd;
+
+    // Solo se lee el superbloque, las paginas se cargan bajo demanda. De las
+    // dos copias vale la mas nueva que pase el checksum: una escritura
+    // cortada deja la otra, y el diario vuelve a aplicar lo que falta. La
+    // copia 1 no existe en los formatos anteriores.
+    SuperBlock copies[2];
+    int errors[2];
+    errors[0] = readSuperBlock(fd, 0, &copies[0]);
+    errors[1] = readSuperBlock(fd, SUPER_COPY_OFFSET, &copies[1]);
+    if ((errors[0] == 0 && memcmp(copies[0].header.version_number, FORMAT_VERSION, 2) != 0) ||
+        (errors[1] == 0 && memcmp(copies[1].header.version_number, FORMAT_VERSION, 2) != 0))
+    {
+        errors[1] = EINVAL;
+    }
+    int slot = errors[0] != 0 || (errors[1] == 0 && copies[1].journal_sequence > copies[0].journal_sequence);
+    if (errors[slot] != 0)
+    {
+        errno = errors[0];
+        return -1;
+    }
+    fatTable->super = copies[slot];
+    int legacy = memcmp(fatTable->super.header.version_number, LEGACY_VERSION, 2) == 0;
+    if (memcmp(fatTable->super.header.version_number, FORMAT_VERSION, 2) != 0)
+    {
+        // El primer guardado escribe la copia 0 en el formato nuevo
+        fatTable->singleSuper = 1;
+        memcpy(fatTable->super.header.version_number, FORMAT_VERSION, 2);
+    }
+
+    fatTable->pages = calloc(fatTable->super.dir_buckets, sizeof(DirPage *));
+    fatTable->dirty = calloc(fatTable->super.dir_buckets, 1);
+    fatTable->pageCapacity = fatTable->super.dir_buckets;
+    if (legacy)
+    {
+        upgradeLegacyDirectory(fatTable);
+    }
+    return 0;
+}
+
+DirPage *loadDirPage(FatTable *fatTable, unsigned int bucket)
+{
+    if (fatTable->pages[bucket] == NULL)
+    {
+        DirPage *page = newDirPage();
+        if (pread(fatTable->fd, page, sizeof(DirPage), dirPageOffset(fatTable, bucket)) != sizeof(DirPage))
+        {
+            // Pagina nunca escrita: se toma como vacia
+            free(page);
+            page = newDirPage();
+        }
+        fatTable->pages[bucket] = page;
+    }
+    return fatTable->pages[bucket];
+}
+
+void freeFatTable(FatTable *fatTable)
+{
+    for (unsigned int i = 0; fatTable->pages != NULL && i < fatTable->super.dir_buckets; i++)
+    {
+        free(fatTable->pages[i]);
+    }
+    free(fatTable->pages);
+    free(fatTable->dirty);
+    clearFreeMap(&fatTable->freeMap);
+    for (unsigned int i = 0; i < fatTable->numBlockPages; i++)
+    {
+        free(fatTable->blockPages[i]);
+    }
+    free(fatTable->blockPages);
+    free(fatTable->blockDirty);
+    free(fatTable->dedup.byBlock);
+    free(fatTable->dedup.byHash);
+    for (unsigned int i = 0; i < fatTable->tails.count; i++)
+    {
+        clearFreeMap(&fatTable->tails.blocks[i].runs);
+    }
+    clearFreeMap(&fatTable->tails.space);
+    free(fatTable->tails.blocks);
+    free(fatTable->tails.held);
+    free(fatTable->strings.data);
+    free(fatTable->heldFree);
+    free(fatTable->journal);
+    fatTable->journal = NULL;
+    fatTable->blockPages = NULL;
+    fatTable->blockDirty = NULL;
+    fatTable->numBlockPages = 0;
+    fatTable->pages = NULL;
+    fatTable->dirty = NULL;
+    memset(&fatTable->freeMap, 0, sizeof(FreeMap));
+    memset(&fatTable->strings, 0, sizeof(StringTable));
+}
+
+void journalWrite(FatTable *fatTable, const void *data, unsigned int length, off_t offset)
+{
+    // Agregar un registro a la transaccion en curso
+    unsigned int needed = fatTable->journalLength + sizeof(JournalRecord) + length;
+    if (fatTable->journal == NULL)
+    {
+        needed += sizeof(JournalHeader);
+        fatTable->journalLength = sizeof(JournalHeader);
+    }
+    if (needed > fatTable->journalCapacity)
+    {
+        fatTable->journalCapacity = needed * 2;
+        fatTable->journal = realloc(fatTable->journal, fatTable->journalCapacity);
+    }
+    JournalRecord record = {offset, length, 0};
+    memcpy(fatTable->journal + fatTable->journalLength, &record, sizeof(JournalRecord));
+    memcpy(fatTable->journal + fatTable->journalLength + sizeof(JournalRecord), data, length);
+    fatTable->journalLength += sizeof(JournalRecord) + length;
+    fatTable->journalRecords++;
+}
+
+int compareExtentSize(const Extent *a, const Extent *b)
+{
+    if (a->length != b->length)
+    {
+        return a->length < b->length ? -1 : 1;
+    }
+    if (a->start != b->start)
+    {
+        return a->start < b->start ? -1 : 1;
+    }
+    return 0;
+}
+
+int compareFreeNodes(int tree, const Extent *a, const Extent *b)
+{
+    if (tree == FREE_BY_SIZE)
+    {
+        return compareExtentSize(a, b);
+    }
+    return a->start < b->start ? -1 : a->start > b->start;
+}
+
+unsigned char freeNodeHeight(FreeNode *node, int tree)
+{
+    return node != NULL ? node->height[tree] : 0;
+}
+
+void updateFreeNode(FreeNode *node, int tree)
+{
+    unsigned char left = freeNodeHeight(node->child[tree][0], tree);
+    unsigned char right = freeNodeHeight(node->child[tree][1], tree);
+    node->height[tree] = 1 + (left > right ? left : right);
+    if (tree == FREE_BY_START)
+    {
+        node->maxLength = node->extent.length;
+        for (int side = 0; side < 2; side++)
+        {
+            FreeNode *child = node->child[tree][side];
+            if (child != NULL && child->maxLength > node->maxLength)
+            {
+                node->maxLength = child->maxLength;
+            }
+        }
+    }
+}
+
+FreeNode *rotateFreeNode(FreeNode *node, int tree, int side)
+{
+    // Rotar hacia side: sube el hijo del lado contrario
+    FreeNode *up = node->child[tree][!side];
+    node->child[tree][!side] = up->child[tree][side];
+    up->child[tree][side] = node;
+    updateFreeNode(node, tree);
+    updateFreeNode(up, tree);
+    return up;
+}
+
+FreeNode *balanceFreeNode(FreeNode *node, int tree)
+{
+    updateFreeNode(node, tree);
+    for (int side = 0; side < 2; side++)
+    {
+        FreeNode *tall = node->child[tree][side];
+        if (freeNodeHeight(tall, tree) > freeNodeHeight(node->child[tree][!side], tree) + 1)
+        {
+            if (freeNodeHeight(tall->child[tree][!side], tree) > freeNodeHeight(tall->child[tree][side], tree))
+            {
+                node->child[tree][side] = rotateFreeNode(tall, tree, side);
+            }
+            return rotateFreeNode(node, tree, !side);
+        }
+    }
+    return node;
+}
+
+FreeNode *insertFreeNode(FreeNode *root, FreeNode *node, int tree)
+{
+    if (root == NULL)
+    {
+        node->child[tree][0] = NULL;
+        node->child[tree][1] = NULL;
+        updateFreeNode(node, tree);
+        return node;
+    }
+    int side = compareFreeNodes(tree, &node->extent, &root->extent) > 0;
+    root->child[tree][side] = insertFreeNode(root->child[tree][side], node, tree);
+    return balanceFreeNode(root, tree);
+}
+
+FreeNode *removeFreeNode(FreeNode *root, FreeNode *node, int tree)
+{
+    // node esta en el arbol: se baja comparando hasta encontrarlo
+    int order = compareFreeNodes(tree, &node->extent, &root->extent);
+    if (order != 0)
+    {
+        root->child[tree][order > 0] = removeFreeNode(root->child[tree][order > 0], node, tree);
+        return balanceFreeNode(root, tree);
+    }
+    FreeNode *left = root->child[tree][0];
+    FreeNode *right = root->child[tree][1];
+    if (left == NULL || right == NULL)
+    {
+        return left != NULL ? left : right;
+    }
+    // Lo reemplaza el siguiente en orden
+    FreeNode *next = right;
+    while (next->child[tree][0] != NULL)
+    {
+        next = next->child[tree][0];
+    }
+    next->child[tree][1] = removeFreeNode(right, next, tree);
+    next->child[tree][0] = left;
+    return balanceFreeNode(next, tree);
+}
+
+FreeNode *buildFreeTree(FreeNode **nodes, unsigned int count, int tree)
+{
+    // Arbol balanceado a partir de nodos ya ordenados
+    if (count == 0)
+    {
+        return NULL;
+    }
+    unsigned int middle = count / 2;
+    FreeNode *node = nodes[middle];
+    node->child[tree][0] = buildFreeTree(nodes, middle, tree);
+    node->child[tree][1] = buildFreeTree(nodes + middle + 1, count - middle - 1, tree);
+    updateFreeNode(node, tree);
+    return node;
+}
+
+int compareFreeNodeSize(const void *a, const void *b)
+{
+    return compareExtentSize(&(*(FreeNode *const *)a)->extent, &(*(FreeNode *const *)b)->extent);
+}
+
+void insertFreeExtent(FreeMap *freeMap, Extent extent)
+{
+    FreeNode *node = calloc(1, sizeof(FreeNode));
+    node->extent = extent;
+    freeMap->root[FREE_BY_START] = insertFreeNode(freeMap->root[FREE_BY_START], node, FREE_BY_START);
+    freeMap->root[FREE_BY_SIZE] = insertFreeNode(freeMap->root[FREE_BY_SIZE], node, FREE_BY_SIZE);
+    freeMap->count++;
+    freeMap->dirty = 1;
+}
+
+void removeFreeExtent(FreeMap *freeMap, Extent extent)
+{
+    FreeNode *node = freeMap->root[FREE_BY_START];
+    while (node->extent.start != extent.start)
+    {
+        node = node->child[FREE_BY_START][extent.start > node->extent.start];
+    }
+    freeMap->root[FREE_BY_START] = removeFreeNode(freeMap->root[FREE_BY_START], node, FREE_BY_START);
+    freeMap->root[FREE_BY_SIZE] = removeFreeNode(freeMap->root[FREE_BY_SIZE], node, FREE_BY_SIZE);
+    free(node);
+    freeMap->count--;
+    freeMap->dirty = 1;
+}
+
+Extent *bestFitExtent(FreeMap *freeMap, unsigned int num_blocks)
+{
+    // El hueco mas pequenno de al menos num_blocks (el de menor posicion si empatan)
+    Extent key = {0, num_blocks};
+    FreeNode *found = NULL;
+    for (FreeNode *node = freeMap->root[FREE_BY_SIZE]; node != NULL;)
+    {
+        int fits = compareExtentSize(&node->extent, &key) >= 0;
+        found = fits ? node : found;
+        node = node->child[FREE_BY_SIZE][!fits];
+    }
+    return found != NULL ? &found->extent : NULL;
+}
+
+Extent *freeExtentAfter(FreeMap *freeMap, unsigned int block)
+{
+    // El primer hueco que empieza en block o despues
+    FreeNode *found = NULL;
+    for (FreeNode *node = freeMap->root[FREE_BY_START]; node != NULL;)
+    {
+        int after = node->extent.start >= block;
+        found = after ? node : found;
+        node = node->child[FREE_BY_START][!after];
+    }
+    return found != NULL ? &found->extent : NULL;
+}
+
+Extent *freeExtentBefore(FreeMap *freeMap, unsigned int block)
+{
+    // El ultimo hueco que empieza antes de block
+    FreeNode *found = NULL;
+    for (FreeNode *node = freeMap->root[FREE_BY_START]; node != NULL;)
+    {
+        int before = node->extent.start < block;
+        found = before ? node : found;
+        node = node->child[FREE_BY_START][before];
+    }
+    return found != NULL ? &found->extent : NULL;
+}
+
+Extent *firstFittingExtent(FreeMap *freeMap, unsigned int num_blocks, unsigned int limit)
+{
+    // El hueco de menor posicion donde caben num_blocks, si empieza antes de limit
+    FreeNode *node = freeMap->root[FREE_BY_START];
+    while (node != NULL && node->maxLength >= num_blocks)
+    {
+        FreeNode *left = node->child[FREE_BY_START][0];
+        if (left != NULL && left->maxLength >= num_blocks)
+        {
+            node = left;
+        }
+        else if (node->extent.length >= num_blocks)
+        {
+            return node->extent.start < limit ? &node->extent : NULL;
+        }
+        else
+        {
+            node = node->child[FREE_BY_START][1];
+        }
+    }
+    return NULL;
+}
+
+void freeFreeNodes(FreeNode *node)
+{
+    while (node != NULL)
+    {
+        freeFreeNodes(node->child[FREE_BY_START][0]);
+        FreeNode *right = node->child[FREE_BY_START][1];
+        free(node);
+        node = right;
+    }
+}
+
+void clearFreeMap(FreeMap *freeMap)
+{
+    freeFreeNodes(freeMap->root[FREE_BY_START]);
+    freeMap->root[FREE_BY_START] = NULL;
+    freeMap->root[FREE_BY_SIZE] = NULL;
+    freeMap->count = 0;
+    freeMap->dirty = 1;
+}
+
+unsigned int collectFreeExtents(FreeNode *node, Extent *extents, unsigned int count)
+{
+    // Los huecos en orden de posicion (la forma en disco)
+    while (node != NULL)
+    {
+        count = collectFreeExtents(node->child[FREE_BY_START][0], extents, count);
+        extents[count++] = node->extent;
+        node = node->child[FREE_BY_START][1];
+    }
+    return count;
+}
+
+int readFreeMap(FatTable *fatTable)
+{
+    // Devuelve -1 si el mapa en disco esta truncado o no es una lista de
+    // huecos ordenada dentro del TAR
+    FreeMap *freeMap = &fatTable->freeMap;
+    unsigned int count = fatTable->super.fmap_count;
+    freeMap->loaded = 1;
+    if (count == 0)
+    {
+        return 0;
+    }
+    size_t length = (size_t)count * sizeof(Extent);
+    Extent *extents = malloc(length);
+    FreeNode **nodes = malloc(count * sizeof(FreeNode *));
+    int valid = (unsigned long long)count * sizeof(Extent) <= (unsigned long long)fatTable->super.fmap_num_blocks * BLOCK_SIZE &&
+                pread(fatTable->fd, extents, length, blockOffset(fatTable->super.fmap_start_block)) == (ssize_t)length;
+    for (unsigned int i = 0; valid && i < count; i++)
+    {
+        unsigned int previousEnd = i > 0 ? extents[i - 1].start + extents[i - 1].length : 0;
+        valid = extents[i].length > 0 && extents[i].start >= previousEnd && extents[i].start < fatTable->super.next_free_block &&
+                extents[i].length <= fatTable->super.next_free_block - extents[i].start;
+    }
+    if (!valid)
+    {
+        free(nodes);
+        free(extents);
+        return -1;
+    }
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+        nodes[i] = calloc(1, sizeof(FreeNode));
+        nodes[i]->extent = extents[i];
+    }
+    freeMap->root[FREE_BY_START] = buildFreeTree(nodes, count, FREE_BY_START);
+    qsort(nodes, count, sizeof(FreeNode *), compareFreeNodeSize);
+    freeMap->root[FREE_BY_SIZE] = buildFreeTree(nodes, count, FREE_BY_SIZE);
+    freeMap->count = count;
+    free(nodes);
+    free(extents);
+    return 0;
+}
+
+FreeMap *loadFreeMap(FatTable *fatTable)
+{
+    FreeMap *freeMap = &fatTable->freeMap;
+    if (!freeMap->loaded && readFreeMap(fatTable) != 0)
+    {
+        // Las aperturas para escribir ya lo revisaron: aqui solo se lee, y
+        // sin huecos conocidos nada se puede reutilizar por error
+        printf("ERROR: el mapa de espacio libre del TAR esta danado.\n");
+    }
+    return freeMap;
+}
+
+unsigned int blockTableCapacity(FatTable *fatTable)
+{
+    return fatTable->super.btab_num_blocks * BLOCK_INFO_PER_BLOCK;
+}
+
+BlockInfo *loadBlockInfo(FatTable *fatTable, unsigned int block)
+{
+    unsigned int page = block / BLOCK_INFO_PER_PAGE;
+    if (page >= fatTable->numBlockPages)
+    {
+        unsigned int count = fatTable->numBlockPages * 2 > page + 1 ? fatTable->numBlockPages * 2 : page + 1;
+        fatTable->blockPages = realloc(fatTable->blockPages, count * sizeof(BlockInfo *));
+        fatTable->blockDirty = realloc(fatTable->blockDirty, count);
+        memset(&fatTable->blockPages[fatTable->numBlockPages], 0, (count - fatTable->numBlockPages) * sizeof(BlockInfo *));
+        memset(&fatTable->blockDirty[fatTable->numBlockPages], 0, count - fatTable->numBlockPages);
+        fatTable->numBlockPages = count;
+    }
+    if (fatTable->blockPages[page] == NULL)
+    {
+        // Las paginas fuera de la tabla reservada empiezan en cero
+        fatTable->blockPages[page] = calloc(1, DIR_PAGE_SIZE);
+        if (block < blockTableCapacity(fatTable))
+        {
+            pread(fatTable->fd, fatTable->blockPages[page], DIR_PAGE_SIZE,
+                  blockOffset(fatTable->super.btab_start_block) + (off_t)page * DIR_PAGE_SIZE);
+        }
+    }
+    return &fatTable->blockPages[page][block % BLOCK_INFO_PER_PAGE];
+}
+
+void setBlockInfo(FatTable *fatTable, unsigned int block, unsigned int crc, unsigned int length)
+{
+    BlockInfo *info = loadBlockInfo(fatTable, block);
+    if (info->crc != crc || info->length != length)
+    {
+        info->crc = crc;
+        info->length = length;
+        fatTable->blockDirty[block / BLOCK_INFO_PER_PAGE] = 1;
+    }
+}
+
+unsigned int allocateBlocks(FatTable *fatTable, unsigned int num_blocks)
+{
+    if (num_blocks == 0)
+    {
+        return 0;
+    }
+
+    // Mejor ajuste: el hueco mas pequenno donde cabe el archivo
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    Extent *fit = bestFitExtent(freeMap, num_blocks);
+    if (fit != NULL)
+    {
+        Extent hole = *fit;
+        removeFreeExtent(freeMap, hole);
+        if (hole.length > num_blocks)
+        {
+            Extent rest = {hole.start + num_blocks, hole.length - num_blocks};
+            insertFreeExtent(freeMap, rest);
+        }
+        return hole.start;
+    }
+
+    // Si el ultimo hueco toca el final del TAR se aprovecha y se extiende
+    unsigned int starting_block = fatTable->super.next_free_block;
+    Extent *last = freeExtentBefore(freeMap, fatTable->super.next_free_block);
+    if (last != NULL && last->start + last->length == fatTable->super.next_free_block)
+    {
+        starting_block = last->start;
+        removeFreeExtent(freeMap, *last);
+    }
+
+    // Los bloques nuevos se toman del final del TAR
+    fatTable->super.next_free_block = starting_block + num_blocks;
+    fatTable->superDirty = 1;
+    return starting_block;
+}
+
+int extendBlocks(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks, unsigned int new_blocks)
+{
+    // Crecer en su lugar si lo que sigue a la extension esta libre
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    unsigned int end = starting_block + num_blocks;
+    unsigned int extra = new_blocks - num_blocks;
+    Extent *next = freeExtentAfter(freeMap, end);
+    if (next != NULL && next->start == end)
+    {
+        Extent hole = *next;
+        if (hole.length >= extra)
+        {
+            removeFreeExtent(freeMap, hole);
+            if (hole.length > extra)
+            {
+                Extent rest = {end + extra, hole.length - extra};
+                insertFreeExtent(freeMap, rest);
+            }
+            return 1;
+        }
+        if (hole.start + hole.length != fatTable->super.next_free_block)
+        {
+            return 0;
+        }
+        // El hueco llega al final del TAR: se toma y se sigue creciendo
+        removeFreeExtent(freeMap, hole);
+    }
+    else if (end != fatTable->super.next_free_block)
+    {
+        return 0;
+    }
+    fatTable->super.next_free_block = end + extra;
+    fatTable->superDirty = 1;
+    return 1;
+}
+
+int reserveBlocksAt(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks)
+{
+    // Tomar una posicion concreta dentro de un hueco (compactacion incremental)
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    Extent *containing = freeExtentBefore(freeMap, starting_block + 1);
+    if (containing == NULL || containing->start + containing->length < starting_block + num_blocks)
+    {
+        return -1;
+    }
+    Extent hole = *containing;
+    removeFreeExtent(freeMap, hole);
+    if (hole.start < starting_block)
+    {
+        Extent before = {hole.start, starting_block - hole.start};
+        insertFreeExtent(freeMap, before);
+    }
+    if (starting_block + num_blocks < hole.start + hole.length)
+    {
+        Extent after = {starting_block + num_blocks, hole.start + hole.length - starting_block - num_blocks};
+        insertFreeExtent(freeMap, after);
+    }
+    return 0;
+}
+
+unsigned int reserveFreshBlocks(FatTable *fatTable, unsigned int num_blocks)
+{
+    // Bloques que se pueden escribir sin pasar por el diario: al final del TAR
+    // y nunca antes del final de la FAT confirmada, que sigue usando lo
+    // liberado en la transaccion en curso aunque eso haya acortado el TAR
+    unsigned int start = fatTable->super.next_free_block;
+    if (start < fatTable->diskEnd)
+    {
+        Extent gap = {start, fatTable->diskEnd - start};
+        insertFreeExtent(loadFreeMap(fatTable), gap);
+        start = fatTable->diskEnd;
+    }
+    fatTable->super.next_free_block = start + num_blocks;
+    fatTable->superDirty = 1;
+    return start;
+}
+
+void releaseBlocks(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks)
+{
+    if (num_blocks == 0)
+    {
+        return;
+    }
+    if (fatTable->lazySave)
+    {
+        // La FAT en disco todavia apunta a estos bloques: no se reutilizan
+        // hasta que se guarde la FAT que ya no los usa
+        if (fatTable->numHeldFree == fatTable->heldFreeCapacity)
+        {
+            fatTable->heldFreeCapacity = fatTable->heldFreeCapacity ? fatTable->heldFreeCapacity * 2 : 64;
+            fatTable->heldFree = realloc(fatTable->heldFree, fatTable->heldFreeCapacity * sizeof(Extent));
+        }
+        Extent held = {starting_block, num_blocks};
+        fatTable->heldFree[fatTable->numHeldFree++] = held;
+        return;
+    }
+
+    // Los bloques libres dejan de tener un CRC valido
+    for (unsigned int i = 0; i < num_blocks; i++)
+    {
+        setBlockInfo(fatTable, starting_block + i, 0, 0);
+    }
+
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    Extent extent = {starting_block, num_blocks};
+
+    // Unir con los huecos vecinos
+    Extent *next = freeExtentAfter(freeMap, starting_block);
+    if (next != NULL && next->start == extent.start + extent.length)
+    {
+        extent.length += next->length;
+        removeFreeExtent(freeMap, *next);
+    }
+    Extent *previous = freeExtentBefore(freeMap, starting_block);
+    if (previous != NULL && previous->start + previous->length == extent.start)
+    {
+        Extent hole = *previous;
+        removeFreeExtent(freeMap, hole);
+        extent.start = hole.start;
+        extent.length += hole.length;
+    }
+
+    if (extent.start + extent.length == fatTable->super.next_free_block)
+    {
+        // Hueco al final: el TAR se recorta al guardar
+        fatTable->super.next_free_block = extent.start;
+        fatTable->superDirty = 1;
+    }
+    else
+    {
+        insertFreeExtent(freeMap, extent);
+    }
+}
+
+void saveFreeMap(FatTable *fatTable)
+{
+    FreeMap *freeMap = &fatTable->freeMap;
+    if (!freeMap->loaded || !freeMap->dirty)
+    {
+        return;
+    }
+
+    // El mapa al final del TAR se devuelve si no quedan huecos o si el unico
+    // esta justo antes: al liberarlo ese hueco llega al final y se recorta.
+    // En otro lugar dejaria un hueco nuevo (-p lo saca de en medio).
+    unsigned int fmapEnd = fatTable->super.fmap_start_block + fatTable->super.fmap_num_blocks;
+    Extent *last = freeMap->count == 1 ? freeExtentAfter(freeMap, 0) : NULL;
+    if (fatTable->super.fmap_num_blocks > 0 && fmapEnd == fatTable->super.next_free_block &&
+        (freeMap->count == 0 || (last != NULL && last->start + last->length == fatTable->super.fmap_start_block)))
+    {
+        releaseBlocks(fatTable, fatTable->super.fmap_start_block, fatTable->super.fmap_num_blocks);
+        fatTable->super.fmap_start_block = 0;
+        fatTable->super.fmap_num_blocks = 0;
+    }
+
+    // Reservar espacio para el mapa al final del TAR: en un hueco ocuparia
+    // justo el espacio que registra. Reubicarlo cambia el propio mapa, por
+    // eso se deja holgura y se repite hasta que quepa.
+    while (1)
+    {
+        unsigned int needed = ((freeMap->count + 2) * sizeof(Extent) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (freeMap->count == 0 || needed <= fatTable->super.fmap_num_blocks)
+        {
+            break;
+        }
+        Extent old = {fatTable->super.fmap_start_block, fatTable->super.fmap_num_blocks};
+        fatTable->super.fmap_start_block = reserveFreshBlocks(fatTable, needed);
+        fatTable->super.fmap_num_blocks = needed;
+        releaseBlocks(fatTable, old.start, old.length);
+    }
+
+    if (freeMap->count > 0)
+    {
+        Extent *extents = malloc(freeMap->count * sizeof(Extent));
+        collectFreeExtents(freeMap->root[FREE_BY_START], extents, 0);
+        journalWrite(fatTable, extents, freeMap->count * sizeof(Extent), blockOffset(fatTable->super.fmap_start_block));
+        free(extents);
+    }
+    fatTable->super.fmap_count = freeMap->count;
+    fatTable->superDirty = 1;
+    freeMap->dirty = 0;
+}
+
+#define FP_PRIME1 0x9E3779B185EBCA87ULL
+#define FP_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+unsigned long long fingerprintRound(unsigned long long acc, unsigned long long input)
+{
+    acc += input * FP_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * FP_PRIME1;
+}
+
+unsigned long long fingerprintBlock(const char *data, unsigned int length)
+{
+    // Cuatro acumuladores independientes de 64 bits; una coincidencia se
+    // confirma comparando el contenido, asi que basta con que sea rapida
+    unsigned long long acc[4] = {FP_PRIME1 + FP_PRIME2, FP_PRIME2, 0, -FP_PRIME1};
+    unsigned int i = 0;
+    for (; i + 32 <= length; i += 32)
+    {
+        for (int lane = 0; lane < 4; lane++)
+        {
+            unsigned long long word;
+            memcpy(&word, data + i + 8 * lane, 8);
+            acc[lane] = fingerprintRound(acc[lane], word);
+        }
+    }
+    unsigned long long hash = length;
+    for (int lane = 0; lane < 4; lane++)
+    {
+        hash = fingerprintRound(hash ^ acc[lane], lane);
+    }
+    for (; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * FP_PRIME1;
+    }
+    hash ^= hash >> 29;
+    hash *= FP_PRIME2;
+    return hash ^ (hash >> 32);
+}
+
+int compareDedupHash(const void *a, const void *b)
+{
+    const DedupEntry *x = a, *y = b;
+    if (x->hash != y->hash)
+    {
+        return x->hash < y->hash ? -1 : 1;
+    }
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+unsigned int lowerBoundByBlock(DedupIndex *index, unsigned int block)
+{
+    unsigned int low = 0, high = index->count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (index->byBlock[mid].block < block)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+unsigned int lowerBoundByHash(DedupIndex *index, DedupEntry *key)
+{
+    unsigned int low = 0, high = index->count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (compareDedupHash(&index->byHash[mid], key) < 0)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void insertDedupEntry(DedupIndex *index, DedupEntry entry)
+{
+    if (index->count == index->capacity)
+    {
+        index->capacity = index->capacity ? index->capacity * 2 : 64;
+        index->byBlock = realloc(index->byBlock, index->capacity * sizeof(DedupEntry));
+        index->byHash = realloc(index->byHash, index->capacity * sizeof(DedupEntry));
+    }
+
+    unsigned int i = lowerBoundByBlock(index, entry.block);
+    memmove(&index->byBlock[i + 1], &index->byBlock[i], (index->count - i) * sizeof(DedupEntry));
+    index->byBlock[i] = entry;
+
+    i = lowerBoundByHash(index, &entry);
+    memmove(&index->byHash[i + 1], &index->byHash[i], (index->count - i) * sizeof(DedupEntry));
+    index->byHash[i] = entry;
+
+    index->count++;
+    index->dirty = 1;
+}
+
+void removeDedupEntry(DedupIndex *index, DedupEntry entry)
+{
+    unsigned int i = lowerBoundByBlock(index, entry.block);
+    memmove(&index->byBlock[i], &index->byBlock[i + 1], (index->count - i - 1) * sizeof(DedupEntry));
+
+    i = lowerBoundByHash(index, &entry);
+    memmove(&index->byHash[i], &index->byHash[i + 1], (index->count - i - 1) * sizeof(DedupEntry));
+
+    index->count--;
+    index->dirty = 1;
+}
+
+DedupEntry *findDedupBlock(DedupIndex *index, unsigned int block)
+{
+    unsigned int i = lowerBoundByBlock(index, block);
+    return i < index->count && index->byBlock[i].block == block ? &index->byBlock[i] : NULL;
+}
+
+DedupEntry *findDuplicateBlock(DedupIndex *index, int tarFd, unsigned long long hash, const char *data, unsigned int length, char *scratch)
+{
+    // Varios bloques pueden compartir huella: se comparan hasta encontrar uno igual
+    DedupEntry key = {hash, 0, 0};
+    for (unsigned int i = lowerBoundByHash(index, &key); i < index->count && index->byHash[i].hash == hash; i++)
+    {
+        if (pread(tarFd, scratch, length, blockOffset(index->byHash[i].block)) == length &&
+            memcmp(scratch, data, length) == 0)
+        {
+            return findDedupBlock(index, index->byHash[i].block);
+        }
+    }
+    return NULL;
+}
+
+int unrefDedupBlock(DedupIndex *index, unsigned int block)
+{
+    // Devuelve 1 si el bloque quedo sin referencias y se puede liberar
+    DedupEntry *entry = findDedupBlock(index, block);
+    if (entry == NULL)
+    {
+        return 0;
+    }
+    index->dirty = 1;
+    if (--entry->refs > 0)
+    {
+        return 0;
+    }
+    removeDedupEntry(index, *entry);
+    return 1;
+}
+
+DedupIndex *loadDedupIndex(FatTable *fatTable)
+{
+    DedupIndex *index = &fatTable->dedup;
+    if (index->loaded)
+    {
+        return index;
+    }
+
+    index->count = fatTable->super.dedup_count;
+    index->capacity = index->count > 64 ? index->count : 64;
+    index->byBlock = malloc(index->capacity * sizeof(DedupEntry));
+    index->byHash = malloc(index->capacity * sizeof(DedupEntry));
+    if (index->count > 0)
+    {
+        // En disco se guarda ordenado por bloque
+        pread(fatTable->fd, index->byBlock, index->count * sizeof(DedupEntry), blockOffset(fatTable->super.dedup_start_block));
+        memcpy(index->byHash, index->byBlock, index->count * sizeof(DedupEntry));
+        qsort(index->byHash, index->count, sizeof(DedupEntry), compareDedupHash);
+    }
+    index->loaded = 1;
+    return index;
+}
+
+void saveDedupIndex(FatTable *fatTable)
+{
+    DedupIndex *index = &fatTable->dedup;
+    if (!index->loaded || !index->dirty)
+    {
+        return;
+    }
+
+    // El indice se reescribe completo en cada guardado: ocupa solo los
+    // bloques que necesitan sus bytes y se reubica cuando crece o se achica
+    unsigned int needed = (index->count * sizeof(DedupEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed != fatTable->super.dedup_num_blocks)
+    {
+        Extent old = {fatTable->super.dedup_start_block, fatTable->super.dedup_num_blocks};
+        fatTable->super.dedup_start_block = needed > 0 ? allocateBlocks(fatTable, needed) : 0;
+        fatTable->super.dedup_num_blocks = needed;
+        releaseBlocks(fatTable, old.start, old.length);
+    }
+
+    if (index->count > 0)
+    {
+        journalWrite(fatTable, index->byBlock, index->count * sizeof(DedupEntry), blockOffset(fatTable->super.dedup_start_block));
+    }
+    fatTable->super.dedup_count = index->count;
+    fatTable->superDirty = 1;
+    index->dirty = 0;
+}
+
+unsigned int lowerBoundTail(TailMap *tails, unsigned int block)
+{
+    unsigned int low = 0, high = tails->count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (tails->blocks[mid].tail.block < block)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+TailSpace *findTailSpace(TailMap *tails, unsigned int block)
+{
+    unsigned int i = lowerBoundTail(tails, block);
+    return i < tails->count && tails->blocks[i].tail.block == block ? &tails->blocks[i] : NULL;
+}
+
+void unindexTailSpace(TailMap *tails, TailSpace *space)
+{
+    // Sacar el bloque del indice por tamanno antes de cambiar sus espacios
+    Extent *indexed = freeExtentAfter(&tails->space, space->tail.block);
+    if (indexed != NULL && indexed->start == space->tail.block)
+    {
+        removeFreeExtent(&tails->space, *indexed);
+    }
+}
+
+void indexTailSpace(TailMap *tails, TailSpace *space)
+{
+    // El espacio libre mas grande del bloque es maxLength de la raiz
+    FreeNode *root = space->runs.root[FREE_BY_START];
+    if (!space->retired && root != NULL)
+    {
+        Extent key = {space->tail.block, root->maxLength};
+        insertFreeExtent(&tails->space, key);
+    }
+}
+
+TailSpace *insertTailSpace(TailMap *tails, TailBlock tail)
+{
+    // Agregar un bloque al arreglo ordenado, con el espacio libre del final
+    if (tails->count == tails->capacity)
+    {
+        tails->capacity = tails->capacity ? tails->capacity * 2 : 64;
+        tails->blocks = realloc(tails->blocks, tails->capacity * sizeof(TailSpace));
+    }
+    unsigned int i = lowerBoundTail(tails, tail.block);
+    memmove(&tails->blocks[i + 1], &tails->blocks[i], (tails->count - i) * sizeof(TailSpace));
+    tails->count++;
+    TailSpace *space = &tails->blocks[i];
+    memset(space, 0, sizeof(TailSpace));
+    space->tail = tail;
+    if (tail.fill < BLOCK_SIZE)
+    {
+        Extent end = {tail.fill, BLOCK_SIZE - tail.fill};
+        insertFreeExtent(&space->runs, end);
+    }
+    return space;
+}
+
+void addTailRun(TailSpace *space, unsigned int offset, unsigned int length)
+{
+    // Devolver un espacio al bloque uniendolo con sus vecinos
+    Extent run = {offset, length};
+    Extent *next = freeExtentAfter(&space->runs, offset);
+    if (next != NULL && next->start == offset + length)
+    {
+        run.length += next->length;
+        removeFreeExtent(&space->runs, *next);
+    }
+    Extent *previous = freeExtentBefore(&space->runs, offset);
+    if (previous != NULL && previous->start + previous->length == offset)
+    {
+        Extent hole = *previous;
+        removeFreeExtent(&space->runs, hole);
+        run.start = hole.start;
+        run.length += hole.length;
+    }
+    insertFreeExtent(&space->runs, run);
+    if (run.start + run.length == BLOCK_SIZE)
+    {
+        space->tail.fill = run.start;
+    }
+}
+
+TailMap *loadTailMap(FatTable *fatTable)
+{
+    TailMap *tails = &fatTable->tails;
+    if (tails->loaded)
+    {
+        return tails;
+    }
+
+    // Los registros de los bloques y despues los huecos interiores
+    unsigned int count = fatTable->super.tail_count, numHoles = fatTable->super.tail_hole_count;
+    TailBlock *blocks = malloc((count + 1) * sizeof(TailBlock));
+    TailHole *holes = malloc((numHoles + 1) * sizeof(TailHole));
+    off_t base = blockOffset(fatTable->super.tail_start_block);
+    if ((unsigned long long)count * sizeof(TailBlock) + (unsigned long long)numHoles * sizeof(TailHole) > (unsigned long long)fatTable->super.tail_num_blocks * BLOCK_SIZE ||
+        pread(fatTable->fd, blocks, count * sizeof(TailBlock), base) != (ssize_t)(count * sizeof(TailBlock)) ||
+        pread(fatTable->fd, holes, numHoles * sizeof(TailHole), base + count * sizeof(TailBlock)) != (ssize_t)(numHoles * sizeof(TailHole)))
+    {
+        count = 0;
+        numHoles = 0;
+    }
+
+    tails->capacity = count > 64 ? count : 64;
+    tails->blocks = malloc(tails->capacity * sizeof(TailSpace));
+    for (unsigned int i = 0; i < count; i++)
+    {
+        // Un archivo que fallo en un TAR anterior pudo dejar bytes sin CRC
+        // despues de los demas: son espacio libre
+        TailBlock tail = blocks[i];
+        unsigned int covered = loadBlockInfo(fatTable, tail.block)->length;
+        covered = (covered + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+        if (covered > 0 && covered < tail.fill)
+        {
+            tail.fill = covered;
+        }
+        tail.fill = tail.fill < BLOCK_SIZE ? tail.fill : BLOCK_SIZE;
+        insertTailSpace(tails, tail);
+    }
+    for (unsigned int i = 0; i < numHoles; i++)
+    {
+        TailSpace *space = findTailSpace(tails, holes[i].block);
+        if (space != NULL && holes[i].length > 0 && holes[i].offset + holes[i].length <= space->tail.fill)
+        {
+            addTailRun(space, holes[i].offset, holes[i].length);
+        }
+    }
+    for (unsigned int i = 0; i < tails->count; i++)
+    {
+        indexTailSpace(tails, &tails->blocks[i]);
+    }
+    free(blocks);
+    free(holes);
+    tails->loaded = 1;
+    return tails;
+}
+
+unsigned int reserveTail(FatTable *fatTable, unsigned int size, unsigned int *offset)
+{
+    // Mejor ajuste: el bloque cuyo espacio libre mas grande es el menor que
+    // alcanza y, dentro de el, el menor espacio donde cabe; si ninguno
+    // alcanza se abre otro bloque
+    TailMap *tails = loadTailMap(fatTable);
+    unsigned int aligned = (size + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+    Extent *best = bestFitExtent(&tails->space, aligned);
+    TailSpace *space;
+    if (best != NULL)
+    {
+        space = findTailSpace(tails, best->start);
+    }
+    else
+    {
+        TailBlock tail = {allocateBlocks(fatTable, 1), 0, 0};
+        space = insertTailSpace(tails, tail);
+    }
+    unindexTailSpace(tails, space);
+
+    Extent run = *bestFitExtent(&space->runs, aligned);
+    removeFreeExtent(&space->runs, run);
+    if (run.length > aligned)
+    {
+        Extent rest = {run.start + aligned, run.length - aligned};
+        insertFreeExtent(&space->runs, rest);
+    }
+    if (run.start + run.length == BLOCK_SIZE)
+    {
+        space->tail.fill = run.start + aligned;
+    }
+    space->tail.members++;
+    indexTailSpace(tails, space);
+    tails->dirty = 1;
+    *offset = run.start;
+    return space->tail.block;
+}
+
+void applyTailChecksum(FatTable *fatTable, unsigned int block, unsigned int offset, unsigned int length, unsigned int oldCrc, unsigned int newCrc)
+{
+    // El CRC de un bloque de colas cubre sus primeros info.length bytes con
+    // los espacios libres en cero. Como el CRC es lineal, cambiar los bytes
+    // de [offset, offset + length) (de oldCrc a newCrc) se aplica sin releer
+    // el bloque, en cualquier orden
+    BlockInfo info = *loadBlockInfo(fatTable, block);
+    if (offset + length > info.length)
+    {
+        unsigned int extra = offset + length - info.length;
+        info.crc = crc32cCombine(info.crc, crc32cZeros(extra), extra);
+        info.length = offset + length;
+    }
+    info.crc ^= crc32cCombine(oldCrc ^ newCrc, 0, info.length - offset - length);
+    setBlockInfo(fatTable, block, info.crc, info.length);
+}
+
+void releaseTail(FatTable *fatTable, unsigned int block, unsigned int offset, unsigned int size, int live)
+{
+    // live: el archivo ya esta en el CRC del bloque, que pasa a contar su
+    // espacio como ceros. El espacio se reutiliza despues de guardar la FAT
+    // (la FAT en disco todavia lo usa).
+    TailMap *tails = loadTailMap(fatTable);
+    TailSpace *space = findTailSpace(tails, block);
+    if (space == NULL)
+    {
+        return;
+    }
+    unsigned int aligned = (size + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+    if (live)
+    {
+        char *data = malloc(aligned + 1);
+        if (pread(fatTable->fd, data, aligned, blockOffset(block) + offset) == aligned)
+        {
+            applyTailChecksum(fatTable, block, offset, aligned, crc32cUpdate(0, data, aligned), crc32cZeros(aligned));
+        }
+        free(data);
+    }
+    if (space->tail.members > 0)
+    {
+        space->tail.members--;
+    }
+    if (tails->numHeld == tails->heldCapacity)
+    {
+        tails->heldCapacity = tails->heldCapacity ? tails->heldCapacity * 2 : 64;
+        tails->held = realloc(tails->held, tails->heldCapacity * sizeof(TailHole));
+    }
+    TailHole hole = {block, offset, aligned};
+    tails->held[tails->numHeld++] = hole;
+    tails->dirty = 1;
+}
+
+int storeTailMember(FatTable *fatTable, FatEntry *entry, const char *data, unsigned int length)
+{
+    // Guardar en un bloque de colas un archivo pequenno que ya esta en memoria
+    static const char zeros[TAIL_ALIGN];
+    unsigned int offset;
+    unsigned int block = reserveTail(fatTable, length, &offset);
+    unsigned int aligned = (length + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+    off_t base = blockOffset(block) + offset;
+    if (pwrite(fatTable->fd, data, length, base) != length ||
+        pwrite(fatTable->fd, zeros, aligned - length, base + length) != (ssize_t)(aligned - length))
+    {
+        releaseTail(fatTable, block, offset, length, 0);
+        return -1;
+    }
+    unsigned int crc = crc32cCombine(crc32cUpdate(0, data, length), crc32cZeros(aligned - length), aligned - length);
+    applyTailChecksum(fatTable, block, offset, aligned, crc32cZeros(aligned), crc);
+    entry->starting_block = block;
+    entry->num_blocks = 0;
+    entry->tail_offset = offset / TAIL_ALIGN;
+    entry->flags |= FAT_TAIL;
+    return 0;
+}
+
+void settleTailSpace(FatTable *fatTable)
+{
+    // Lo liberado desde el ultimo guardado vuelve a los espacios libres y
+    // los bloques que quedaron sin archivos se liberan
+    TailMap *tails = loadTailMap(fatTable);
+    for (unsigned int i = 0; i < tails->numHeld; i++)
+    {
+        TailSpace *space = findTailSpace(tails, tails->held[i].block);
+        if (space != NULL)
+        {
+            unindexTailSpace(tails, space);
+            addTailRun(space, tails->held[i].offset, tails->held[i].length);
+            indexTailSpace(tails, space);
+        }
+    }
+    tails->numHeld = 0;
+
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < tails->count; i++)
+    {
+        TailSpace *space = &tails->blocks[i];
+        if (space->tail.members > 0)
+        {
+            tails->blocks[kept++] = *space;
+            continue;
+        }
+        unindexTailSpace(tails, space);
+        clearFreeMap(&space->runs);
+        releaseBlocks(fatTable, space->tail.block, 1);
+        tails->dirty = 1;
+    }
+    tails->count = kept;
+}
+
+void retireTailBlock(FatTable *fatTable, unsigned int block, int retired)
+{
+    // Un bloque retirado no recibe archivos nuevos (-p lo esta vaciando)
+    TailMap *tails = loadTailMap(fatTable);
+    TailSpace *space = findTailSpace(tails, block);
+    if (space != NULL)
+    {
+        unindexTailSpace(tails, space);
+        space->retired = retired;
+        indexTailSpace(tails, space);
+    }
+}
+
+void moveTailBlock(FatTable *fatTable, unsigned int from, unsigned int to)
+{
+    // El bloque de colas from paso a to (-p); to no es un bloque de colas
+    TailMap *tails = loadTailMap(fatTable);
+    TailSpace *space = findTailSpace(tails, from);
+    if (space == NULL || from == to)
+    {
+        return;
+    }
+    unindexTailSpace(tails, space);
+    unsigned int i = space - tails->blocks;
+    space->tail.block = to;
+    if ((i > 0 && tails->blocks[i - 1].tail.block > to) || (i + 1 < tails->count && tails->blocks[i + 1].tail.block < to))
+    {
+        // Cambio de lugar en el arreglo ordenado
+        TailSpace moved = *space;
+        memmove(&tails->blocks[i], &tails->blocks[i + 1], (tails->count - i - 1) * sizeof(TailSpace));
+        tails->count--;
+        i = lowerBoundTail(tails, to);
+        memmove(&tails->blocks[i + 1], &tails->blocks[i], (tails->count - i) * sizeof(TailSpace));
+        tails->blocks[i] = moved;
+        tails->count++;
+    }
+    indexTailSpace(tails, &tails->blocks[i]);
+    for (unsigned int j = 0; j < tails->numHeld; j++)
+    {
+        if (tails->held[j].block == from)
+        {
+            tails->held[j].block = to;
+        }
+    }
+    tails->dirty = 1;
+}
+
+void maskTailHoles(TailMap *tails, unsigned int block, char *data, unsigned int length)
+{
+    // Poner en cero los espacios libres de un bloque de colas, como los
+    // cuenta su CRC (no hace nada con otros bloques)
+    TailSpace *space = findTailSpace(tails, block);
+    if (space == NULL)
+    {
+        return;
+    }
+    for (Extent *run = freeExtentAfter(&space->runs, 0); run != NULL && run->start < length; run = freeExtentAfter(&space->runs, run->start + 1))
+    {
+        memset(data + run->start, 0, (run->start + run->length < length ? run->start + run->length : length) - run->start);
+    }
+    for (unsigned int i = 0; i < tails->numHeld; i++)
+    {
+        TailHole *hole = &tails->held[i];
+        if (hole->block == block && hole->offset < length)
+        {
+            memset(data + hole->offset, 0, (hole->offset + hole->length < length ? hole->offset + hole->length : length) - hole->offset);
+        }
+    }
+}
+
+void saveTailMap(FatTable *fatTable)
+{
+    TailMap *tails = &fatTable->tails;
+    if (!tails->loaded || !tails->dirty)
+    {
+        return;
+    }
+    settleTailSpace(fatTable);
+
+    // Los huecos interiores son los espacios libres que no llegan al final
+    unsigned int numHoles = 0;
+    for (unsigned int i = 0; i < tails->count; i++)
+    {
+        numHoles += tails->blocks[i].runs.count - (tails->blocks[i].tail.fill < BLOCK_SIZE);
+    }
+    size_t length = tails->count * sizeof(TailBlock) + numHoles * sizeof(TailHole);
+    unsigned int needed = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > fatTable->super.tail_num_blocks)
+    {
+        Extent old = {fatTable->super.tail_start_block, fatTable->super.tail_num_blocks};
+        needed *= 2;
+        fatTable->super.tail_start_block = allocateBlocks(fatTable, needed);
+        fatTable->super.tail_num_blocks = needed;
+        releaseBlocks(fatTable, old.start, old.length);
+    }
+
+    if (length > 0)
+    {
+        char *data = malloc(length);
+        TailBlock *blocks = (TailBlock *)data;
+        TailHole *holes = (TailHole *)(data + tails->count * sizeof(TailBlock));
+        unsigned int numWritten = 0;
+        for (unsigned int i = 0; i < tails->count; i++)
+        {
+            TailSpace *space = &tails->blocks[i];
+            blocks[i] = space->tail;
+            for (Extent *run = freeExtentAfter(&space->runs, 0); run != NULL && run->start < space->tail.fill; run = freeExtentAfter(&space->runs, run->start + 1))
+            {
+                TailHole hole = {space->tail.block, run->start, run->length};
+                holes[numWritten++] = hole;
+            }
+        }
+        journalWrite(fatTable, data, length, blockOffset(fatTable->super.tail_start_block));
+        free(data);
+    }
+    fatTable->super.tail_count = tails->count;
+    fatTable->super.tail_hole_count = numHoles;
+    fatTable->superDirty = 1;
+    tails->dirty = 0;
+}
+
+StringTable *loadStringTable(FatTable *fatTable)
+{
+    StringTable *strings = &fatTable->strings;
+    if (strings->loaded)
+    {
+        return strings;
+    }
+
+    unsigned long long length = 0;
+    off_t base = blockOffset(fatTable->super.strtab_start_block);
+    if (fatTable->super.strtab_num_blocks == 0 ||
+        pread(fatTable->fd, &length, sizeof(length), base) != sizeof(length) ||
+        sizeof(length) + length > (unsigned long long)fatTable->super.strtab_num_blocks * BLOCK_SIZE)
+    {
+        length = 0;
+    }
+    strings->capacity = length > 4096 ? length : 4096;
+    strings->data = malloc(strings->capacity);
+    if (length > 0 && pread(fatTable->fd, strings->data, length, base + sizeof(length)) != (ssize_t)length)
+    {
+        length = 0;
+    }
+    strings->length = length;
+    strings->saved = length;
+    strings->loaded = 1;
+    return strings;
+}
+
+unsigned int addLongName(FatTable *fatTable, const char *name, size_t length)
+{
+    StringTable *strings = loadStringTable(fatTable);
+    if (strings->length + length + 1 > strings->capacity)
+    {
+        strings->capacity = (strings->length + length + 1) * 2;
+        strings->data = realloc(strings->data, strings->capacity);
+    }
+    unsigned int offset = strings->length;
+    memcpy(strings->data + offset, name, length + 1);
+    strings->length += length + 1;
+    return offset;
+}
+
+const char *fatEntryName(FatTable *fatTable, const FatEntry *entry, char shortName[13])
+{
+    if (entry->flags & FAT_LONG_NAME)
+    {
+        StringTable *strings = loadStringTable(fatTable);
+        if ((unsigned long long)entry->name.offset + entry->name.length < strings->length)
+        {
+            return strings->data + entry->name.offset;
+        }
+        shortName[0] = '\0'; // Tabla de cadenas danada
+        return shortName;
+    }
+    memcpy(shortName, entry->filename, 12);
+    shortName[12] = '\0';
+    return shortName;
+}
+
+void saveStringTable(FatTable *fatTable)
+{
+    // Solo se agregan nombres: basta con escribir lo nuevo y el largo
+    StringTable *strings = &fatTable->strings;
+    if (!strings->loaded || strings->length == strings->saved)
+    {
+        return;
+    }
+
+    unsigned int needed = (sizeof(strings->length) + strings->length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > fatTable->super.strtab_num_blocks)
+    {
+        Extent old = {fatTable->super.strtab_start_block, fatTable->super.strtab_num_blocks};
+        needed *= 2;
+        fatTable->super.strtab_start_block = allocateBlocks(fatTable, needed);
+        fatTable->super.strtab_num_blocks = needed;
+        releaseBlocks(fatTable, old.start, old.length);
+        strings->saved = 0;
+    }
+
+    off_t base = blockOffset(fatTable->super.strtab_start_block);
+    journalWrite(fatTable, strings->data + strings->saved, strings->length - strings->saved,
+                 base + sizeof(strings->length) + strings->saved);
+    journalWrite(fatTable, &strings->length, sizeof(strings->length), base);
+    strings->saved = strings->length;
+    fatTable->superDirty = 1;
+}
+
+void compactStringTable(FatTable *fatTable)
+{
+    // Copiar solo los nombres de los registros ocupados; la tabla se vuelve
+    // a escribir completa
+    StringTable *strings = loadStringTable(fatTable);
+    char *data = malloc(strings->capacity);
+    unsigned long long length = 0;
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
+    {
+        if (!(entry->flags & FAT_LONG_NAME))
+        {
+            continue;
+        }
+        memcpy(data + length, strings->data + entry->name.offset, entry->name.length + 1);
+        entry->name.offset = length;
+        length += entry->name.length + 1;
+        markFatEntryDirty(fatTable, entry);
+    }
+    free(strings->data);
+    strings->data = data;
+    strings->length = length;
+    strings->saved = 0;
+}
+
+unsigned int blockLength(unsigned long long size, unsigned int block)
+{
+    // Bytes del bloque block en un archivo de size bytes
+    unsigned long long start = (unsigned long long)block * BLOCK_SIZE;
+    return size - start < BLOCK_SIZE ? size - start : BLOCK_SIZE;
+}
+
+unsigned int dedupListSize(unsigned long long file_size)
+{
+    return (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE * sizeof(unsigned int);
+}
+
+off_t dedupListOffset(const FatEntry *entry)
+{
+    // Una lista corta va en un bloque de colas (FAT_DEDUP | FAT_TAIL); una
+    // larga ocupa la extension del archivo
+    return blockOffset(entry->starting_block) + ((entry->flags & FAT_TAIL) ? entry->tail_offset * TAIL_ALIGN : 0);
+}
+
+unsigned int tailMemberSize(const FatEntry *entry)
+{
+    // Bytes que ocupa en su bloque de colas: los datos o la lista de bloques
+    return (entry->flags & FAT_DEDUP) ? dedupListSize(entry->file_size) : entry->file_size;
+}
+
+void releaseMemberBlocks(FatTable *fatTable, FatEntry *entry)
+{
+    unsigned long long start = statStart();
+    if (entry->flags & FAT_DEDUP)
+    {
+        // Cada bloque de datos se libera cuando ningun archivo lo usa
+        unsigned int numData = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        unsigned int *list = malloc(dedupListSize(entry->file_size) + sizeof(unsigned int));
+        DedupIndex *index = loadDedupIndex(fatTable);
+        if (pread(fatTable->fd, list, dedupListSize(entry->file_size), dedupListOffset(entry)) == (ssize_t)dedupListSize(entry->file_size))
+        {
+            for (unsigned int i = 0; i < numData; i++)
+            {
+                if (unrefDedupBlock(index, list[i]))
+                {
+                    releaseBlocks(fatTable, list[i], 1);
+                }
+            }
+        }
+        free(list);
+    }
+    if (entry->flags & FAT_TAIL)
+    {
+        releaseTail(fatTable, entry->starting_block, entry->tail_offset * TAIL_ALIGN, tailMemberSize(entry), 1);
+    }
+    else
+    {
+        releaseBlocks(fatTable, entry->starting_block, entry->num_blocks);
+    }
+    statEnd(STAT_ALLOCATE, start);
+}
+
+int reserveBlockTable(FatTable *fatTable)
+{
+    // La tabla debe cubrir todos los bloques hasta el final del TAR
+    if (fatTable->super.next_free_block <= blockTableCapacity(fatTable))
+    {
+        return 0;
+    }
+
+    // Cargar lo que ya existe antes de mover la tabla
+    unsigned int oldCapacity = blockTableCapacity(fatTable);
+    for (unsigned int block = 0; block < oldCapacity; block += BLOCK_INFO_PER_PAGE)
+    {
+        loadBlockInfo(fatTable, block);
+    }
+
+    // Nueva extension con holgura al final del TAR, llena de ceros antes de
+    // usarla. Esos bloques no los usa la FAT que esta en disco, por eso se
+    // pueden escribir sin pasar por el diario.
+    Extent old = {fatTable->super.btab_start_block, fatTable->super.btab_num_blocks};
+    unsigned int needed = (fatTable->super.next_free_block * 2 + BLOCK_INFO_PER_BLOCK - 1) / BLOCK_INFO_PER_BLOCK;
+    fatTable->super.btab_start_block = reserveFreshBlocks(fatTable, needed);
+    fatTable->super.btab_num_blocks = needed;
+    char *zeros = calloc(1, BLOCK_SIZE);
+    for (unsigned int i = 0; i < needed; i++)
+    {
+        pwrite(fatTable->fd, zeros, BLOCK_SIZE, blockOffset(fatTable->super.btab_start_block + i));
+    }
+    free(zeros);
+
+    for (unsigned int i = 0; i < fatTable->numBlockPages; i++)
+    {
+        if (fatTable->blockPages[i] != NULL)
+        {
+            fatTable->blockDirty[i] = 1;
+        }
+    }
+    releaseBlocks(fatTable, old.start, old.length);
+    return 1;
+}
+
+void saveBlockTable(FatTable *fatTable)
+{
+    unsigned int capacityPages = blockTableCapacity(fatTable) / BLOCK_INFO_PER_PAGE;
+    for (unsigned int i = 0; i < fatTable->numBlockPages && i < capacityPages; i++)
+    {
+        if (fatTable->blockDirty[i])
+        {
+            journalWrite(fatTable, fatTable->blockPages[i], DIR_PAGE_SIZE,
+                         blockOffset(fatTable->super.btab_start_block) + (off_t)i * DIR_PAGE_SIZE);
+            fatTable->blockDirty[i] = 0;
+        }
+    }
+}
+
+void reserveJournal(FatTable *fatTable)
+{
+    // La extension del diario no se mueve una vez reservada
+    if (fatTable->super.journal_num_blocks == 0)
+    {
+        fatTable->super.journal_start_block = allocateBlocks(fatTable, JOURNAL_BLOCKS);
+        fatTable->super.journal_num_blocks = JOURNAL_BLOCKS;
+        fatTable->journalHead = 0;
+        fatTable->journalMoved = 1;
+        fatTable->superDirty = 1;
+    }
+}
+
+int growJournal(FatTable *fatTable)
+{
+    // Una transaccion mas grande que el diario lo mueve a uno mas grande al
+    // final del TAR, que la FAT en disco no usa; el anterior queda libre en
+    // la misma transaccion. Devuelve 1 si hay que volver a guardar el mapa.
+    unsigned long journalBytes = (unsigned long)fatTable->super.journal_num_blocks * BLOCK_SIZE;
+    unsigned int txnLength = fatTable->journalLength + sizeof(JournalRecord) + sizeof(SuperBlock);
+    if (txnLength <= journalBytes)
+    {
+        return 0;
+    }
+    Extent old = {fatTable->super.journal_start_block, fatTable->super.journal_num_blocks};
+    unsigned int needed = (txnLength + BLOCK_SIZE - 1) / BLOCK_SIZE * 2;
+    fatTable->super.journal_start_block = reserveFreshBlocks(fatTable, needed);
+    fatTable->super.journal_num_blocks = needed;
+    fatTable->journalHead = 0;
+    fatTable->journalMoved = 1;
+    fatTable->superDirty = 1;
+    releaseBlocks(fatTable, old.start, old.length);
+    return 1;
+}
+
+int shrinkJournal(FatTable *fatTable)
+{
+    // Un diario que crecio por una transaccion grande vuelve a JOURNAL_BLOCKS.
+    // Solo se llama justo despues de confirmar, cuando lo que esta en el mapa
+    // libre ya esta libre en la FAT en disco: el diario nuevo puede ir al
+    // mejor hueco y escribirse directo. Sin hueco se achica en su lugar y la
+    // proxima transaccion vuelve al inicio del diario, asi que commitJournal
+    // sincroniza antes lo aplicado. Devuelve 1 si lo achico.
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    if (fatTable->super.journal_num_blocks <= JOURNAL_BLOCKS ||
+        (freeMap->count + 2UL) * sizeof(Extent) * 2 > JOURNAL_BLOCKS * BLOCK_SIZE)
+    {
+        return 0; // Un mapa libre tan grande volveria a agrandarlo
+    }
+    Extent old = {fatTable->super.journal_start_block, fatTable->super.journal_num_blocks};
+    if (bestFitExtent(freeMap, JOURNAL_BLOCKS) != NULL)
+    {
+        fatTable->super.journal_start_block = allocateBlocks(fatTable, JOURNAL_BLOCKS);
+        fatTable->journalHead = 0;
+        fatTable->journalMoved = 1;
+        releaseBlocks(fatTable, old.start, old.length);
+    }
+    else
+    {
+        releaseBlocks(fatTable, old.start + JOURNAL_BLOCKS, old.length - JOURNAL_BLOCKS);
+        fatTable->journalHead = JOURNAL_BLOCKS * BLOCK_SIZE;
+    }
+    fatTable->super.journal_num_blocks = JOURNAL_BLOCKS;
+    fatTable->superDirty = 1;
+    return 1;
+}
+
+void applyJournal(int fd, const char *records, unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        JournalRecord record;
+        memcpy(&record, records, sizeof(JournalRecord));
+        pwrite(fd, records + sizeof(JournalRecord), record.length, record.offset);
+        records += sizeof(JournalRecord) + record.length;
+    }
+}
+
+void syncArchive(int fd)
+{
+    statCall(CALL_FDATASYNC, 0);
+    fdatasync(fd);
+}
+
+void commitJournal(FatTable *fatTable)
+{
+    // growJournal ya dejo espacio para toda la transaccion
+    unsigned long long start = statStart();
+    unsigned long journalBytes = (unsigned long)fatTable->super.journal_num_blocks * BLOCK_SIZE;
+    unsigned int txnLength = fatTable->journalLength + sizeof(JournalRecord) + sizeof(SuperBlock);
+    if (fatTable->journalHead + txnLength > journalBytes)
+    {
+        // Volver al inicio del diario: lo que se va a sobrescribir ya debe
+        // estar aplicado en disco
+        syncArchive(fatTable->fd);
+        fatTable->journalHead = 0;
+    }
+
+    // El superbloque va de ultimo e indica donde quedo esta transaccion. Se
+    // escribe en la copia de su paridad; la primera vez que un TAR de un
+    // formato anterior se guarda, en la copia 0, para que no quede vieja
+    if (fatTable->singleSuper && fatTable->journalSequence % 2)
+    {
+        fatTable->journalSequence++;
+    }
+    fatTable->super.journal_sequence = fatTable->journalSequence;
+    fatTable->super.journal_offset = fatTable->journalHead;
+    superBlockChecksum(&fatTable->super, fatTable->super.header.checksum);
+    journalWrite(fatTable, &fatTable->super, sizeof(SuperBlock), superBlockOffset(fatTable->journalSequence));
+
+    JournalHeader *header = (JournalHeader *)fatTable->journal;
+    const char *records = fatTable->journal + sizeof(JournalHeader);
+    memcpy(header->magic, JOURNAL_MAGIC, 4);
+    header->sequence = fatTable->journalSequence;
+    header->records = fatTable->journalRecords;
+    header->length = fatTable->journalLength - sizeof(JournalHeader);
+    header->crc = crc32cUpdate(0, records, header->length);
+    header->reserved = 0;
+    pwrite(fatTable->fd, fatTable->journal, fatTable->journalLength,
+           blockOffset(fatTable->super.journal_start_block) + fatTable->journalHead);
+
+    // Unica sincronizacion de la operacion: cubre los datos y la transaccion
+    syncArchive(fatTable->fd);
+    if (fatTable->journalMoved)
+    {
+        // El diario anterior no tiene esta transaccion: el superbloque que
+        // apunta al nuevo llega a disco antes que cualquier otro registro
+        pwrite(fatTable->fd, &fatTable->super, sizeof(SuperBlock), superBlockOffset(fatTable->journalSequence));
+        syncArchive(fatTable->fd);
+        fatTable->journalMoved = 0;
+    }
+    applyJournal(fatTable->fd, records, fatTable->journalRecords);
+    fatTable->singleSuper = 0;
+    fatTable->diskEnd = fatTable->super.next_free_block;
+    fatTable->journalHead += fatTable->journalLength;
+    fatTable->journalSequence++;
+    fatTable->journalLength = sizeof(JournalHeader);
+    fatTable->journalRecords = 0;
+    statEnd(STAT_JOURNAL_COMMIT, start);
+}
+
+int readJournalTransaction(int fd, SuperBlock *super, unsigned int position, unsigned int sequence, char **buffer)
+{
+    // Devuelve la cantidad de registros de una transaccion completa, o -1
+    unsigned long journalBytes = (unsigned long)super->journal_num_blocks * BLOCK_SIZE;
+    off_t base = blockOffset(super->journal_start_block);
+    JournalHeader header;
+    if (position + sizeof(JournalHeader) > journalBytes ||
+        pread(fd, &header, sizeof(JournalHeader), base + position) != sizeof(JournalHeader) ||
+        memcmp(header.magic, JOURNAL_MAGIC, 4) != 0 || header.sequence != sequence ||
+        position + sizeof(JournalHeader) + header.length > journalBytes)
+    {
+        return -1;
+    }
+    *buffer = realloc(*buffer, header.length);
+    if (pread(fd, *buffer, header.length, base + position + sizeof(JournalHeader)) != header.length ||
+        crc32cUpdate(0, *buffer, header.length) != header.crc)
+    {
+        return -1;
+    }
+    return header.records;
+}
+
+int findJournalTransaction(int fd, SuperBlock *super, unsigned int *position, unsigned int sequence, char **buffer)
+{
+    // La transaccion sigue a la anterior o, si no cabia, esta al inicio del diario
+    int count = readJournalTransaction(fd, super, *position, sequence, buffer);
+    if (count < 0 && *position != 0)
+    {
+        count = readJournalTransaction(fd, super, 0, sequence, buffer);
+        if (count >= 0)
+        {
+            *position = 0;
+        }
+    }
+    return count;
+}
+
+int replayJournal(FatTable *fatTable, char *tarFilename)
+{
+    SuperBlock super = fatTable->super;
+    unsigned int position = super.journal_offset;
+    unsigned int sequence = super.journal_sequence;
+    char *records = NULL;
+    char *current = NULL;
+    int writeFd = -1;
+    int changed = 0;
+
+    while (super.journal_num_blocks > 0)
+    {
+        int count = findJournalTransaction(fatTable->fd, &super, &position, sequence, &records);
+        if (count < 0 && (sequence == super.journal_sequence || fatTable->singleSuper))
+        {
+            // La transaccion del superbloque (ya aplicada: commitJournal
+            // sincroniza antes de volver al inicio) pudo quedar debajo de la
+            // siguiente, y el primer guardado del formato 04 salta a un
+            // numero par para escribir la copia 0
+            count = findJournalTransaction(fatTable->fd, &super, &position, sequence + 1, &records);
+            sequence += count >= 0;
+        }
+        if (count < 0)
+        {
+            break;
+        }
+
+        // Reescribir solo lo que no llego a su lugar
+        const char *p = records;
+        unsigned int length = 0;
+        for (int i = 0; i < count; i++)
+        {
+            JournalRecord record;
+            memcpy(&record, p, sizeof(JournalRecord));
+            current = realloc(current, record.length);
+            if (pread(fatTable->fd, current, record.length, record.offset) != record.length ||
+                memcmp(current, p + sizeof(JournalRecord), record.length) != 0)
+            {
+                if (writeFd < 0)
+                {
+                    writeFd = (fcntl(fatTable->fd, F_GETFL) & O_ACCMODE) == O_RDONLY ? open(tarFilename, O_RDWR) : dup(fatTable->fd);
+                    if (writeFd < 0)
+                    {
+                        errno = EROFS;
+                        free(records);
+                        free(current);
+                        return -1;
+                    }
+                }
+                pwrite(writeFd, p + sizeof(JournalRecord), record.length, record.offset);
+                changed = 1;
+            }
+            p += sizeof(JournalRecord) + record.length;
+            length += sizeof(JournalRecord) + record.length;
+        }
+        position += sizeof(JournalHeader) + length;
+        sequence++;
+    }
+    free(records);
+    free(current);
+
+    if (changed)
+    {
+        if (verbose == 2)
+        {
+            printf("Transacciones recuperadas del diario hasta la %u.\n", sequence - 1);
+        }
+        syncArchive(writeFd);
+        close(writeFd);
+        freeFatTable(fatTable);
+        if (loadFatTableFromFile(fatTable, fatTable->fd) != 0)
+        {
+            return -1;
+        }
+    }
+    fatTable->journalHead = position;
+    fatTable->journalSequence = sequence;
+    return 0;
+}
+
+void saveFatTableToFile(FatTable *fatTable)
+{
+    if (fatTable->lazySave)
+    {
+        return; // Queda marcado en memoria hasta flushFatTable
+    }
+
+    // Reservar el diario, el indice, la tabla de bloques y el mapa libre puede
+    // mover el final del TAR
+    unsigned long long start = statStart();
+    reserveJournal(fatTable);
+    do
+    {
+        do
+        {
+            saveDedupIndex(fatTable);
+            saveTailMap(fatTable);
+            saveStringTable(fatTable);
+            reserveBlockTable(fatTable);
+            saveFreeMap(fatTable);
+        } while (fatTable->super.next_free_block > blockTableCapacity(fatTable));
+        saveBlockTable(fatTable);
+
+        for (unsigned int i = 0; i < fatTable->super.dir_buckets; i++)
+        {
+            if (fatTable->dirty[i])
+            {
+                journalWrite(fatTable, fatTable->pages[i], sizeof(DirPage), dirPageOffset(fatTable, i));
+                fatTable->dirty[i] = 0;
+            }
+        }
+    } while (growJournal(fatTable));
+
+    if (fatTable->superDirty || fatTable->journalRecords > 0)
+    {
+        commitJournal(fatTable);
+        fatTable->superDirty = 0;
+
+        // Recortar el espacio libre que quedo al final del TAR
+        struct stat st;
+        off_t end = blockOffset(fatTable->super.next_free_block);
+        if (fstat(fatTable->fd, &st) == 0 && st.st_size > end)
+        {
+            ftruncate(fatTable->fd, end);
+        }
+    }
+    statEnd(STAT_FAT_SAVE, start);
+
+    // El diario que agrando esta transaccion vuelve a su tamanno con otra
+    // transaccion pequenna, y el TAR no queda mas grande despues de -u
+    if (shrinkJournal(fatTable))
+    {
+        saveFatTableToFile(fatTable);
+    }
+}
+
+
+FatEntry *findFatEntry(FatTable *fatTable, const char *filename)
+{
+    size_t length = strlen(filename);
+    unsigned int hash = hashFilename(filename, length);
+    DirPage *page = loadDirPage(fatTable, bucketForHash(fatTable, hash));
+    for (unsigned int i = 0; i < DIR_PAGE_ENTRIES; i++)
+    {
+        FatEntry *entry = &page->entries[i];
+        if (entry->is_empty)
+        {
+            continue;
+        }
+        if (length <= 12)
+        {
+            if (!(entry->flags & FAT_LONG_NAME) && strncmp(entry->filename, filename, 12) == 0)
+            {
+                return entry;
+            }
+        }
+        else if ((entry->flags & FAT_LONG_NAME) && entry->name.hash == hash && entry->name.length == length)
+        {
+            // La huella descarta casi todos los registros sin leer la tabla
+            StringTable *strings = loadStringTable(fatTable);
+            if ((unsigned long long)entry->name.offset + length < strings->length &&
+                memcmp(strings->data + entry->name.offset, filename, length) == 0)
+            {
+                return entry;
+            }
+        }
+    }
+    return NULL;
+}
+
+FatEntry *nextFatEntry(FatTable *fatTable, unsigned int *bucket, unsigned int *slot)
+{
+    // Recorre el directorio pagina por pagina
+    while (*bucket < fatTable->super.dir_buckets)
+    {
+        DirPage *page = loadDirPage(fatTable, *bucket);
+        while (page->count > 0 && *slot < DIR_PAGE_ENTRIES)
+        {
+            FatEntry *entry = &page->entries[(*slot)++];
+            if (!entry->is_empty)
+            {
+                return entry;
+            }
+        }
+        (*bucket)++;
+        *slot = 0;
+    }
+    return NULL;
+}
+
+void growDirectoryPages(FatTable *fatTable, unsigned int capacity)
+{
+    // Los arreglos en memoria crecen al doble hasta alcanzar la capacidad
+    unsigned int oldCapacity = fatTable->pageCapacity;
+    if (capacity <= oldCapacity)
+    {
+        return;
+    }
+    while (fatTable->pageCapacity < capacity)
+    {
+        fatTable->pageCapacity *= 2;
+    }
+    fatTable->pages = realloc(fatTable->pages, fatTable->pageCapacity * sizeof(DirPage *));
+    fatTable->dirty = realloc(fatTable->dirty, fatTable->pageCapacity);
+    memset(fatTable->pages + oldCapacity, 0, (fatTable->pageCapacity - oldCapacity) * sizeof(DirPage *));
+    memset(fatTable->dirty + oldCapacity, 0, fatTable->pageCapacity - oldCapacity);
+}
+
+void moveDirectoryExtent(FatTable *fatTable, unsigned int numBlocks)
+{
+    // Las paginas se copian directo a la nueva extension: esos bloques no los
+    // usa la FAT en disco. Las paginas modificadas pasan despues por el diario
+    // en su nueva posicion, junto con el superbloque que apunta a ella.
+    Extent old = {fatTable->super.dir_start_block, fatTable->super.dir_num_blocks};
+    unsigned int start = allocateBlocks(fatTable, numBlocks);
+    copyFileRange(fatTable->fd, blockOffset(old.start), fatTable->fd, blockOffset(start),
+                  (off_t)fatTable->super.dir_buckets * DIR_PAGE_SIZE, NULL);
+    fatTable->super.dir_start_block = start;
+    fatTable->super.dir_num_blocks = numBlocks;
+    fatTable->superDirty = 1;
+    releaseBlocks(fatTable, old.start, old.length);
+}
+
+void splitDirectoryPage(FatTable *fatTable)
+{
+    // Hash lineal: el directorio crece una pagina dividiendo la siguiente en
+    // orden, de modo que la transaccion solo lleva esas dos paginas
+    unsigned int buckets = fatTable->super.dir_buckets;
+    unsigned int split = buckets - (1u << (31 - __builtin_clz(buckets)));
+    growDirectoryPages(fatTable, buckets + 1);
+    DirPage *old = loadDirPage(fatTable, split);
+    DirPage *page = newDirPage();
+    fatTable->pages[buckets] = page;
+    fatTable->super.dir_buckets = buckets + 1;
+    fatTable->dirty[split] = 1;
+    fatTable->dirty[buckets] = 1;
+    fatTable->superDirty = 1;
+
+    // Los registros que ahora caen en la pagina nueva se mudan a ella
+    for (unsigned int i = 0; i < DIR_PAGE_ENTRIES; i++)
+    {
+        FatEntry *entry = &old->entries[i];
+        if (!entry->is_empty && bucketForEntry(fatTable, entry) == buckets)
+        {
+            page->entries[page->count++] = *entry;
+            memset(entry, 0, sizeof(FatEntry));
+            entry->is_empty = 1;
+            old->count--;
+        }
+    }
+}
+
+int insertDirEntry(FatTable *fatTable, const FatEntry *entry)
+{
+    // Copia un registro en su pagina; 0 si la pagina esta llena
+    unsigned int bucket = bucketForEntry(fatTable, entry);
+    DirPage *page = loadDirPage(fatTable, bucket);
+    if (page->count == DIR_PAGE_ENTRIES)
+    {
+        return 0;
+    }
+    for (unsigned int i = 0; i < DIR_PAGE_ENTRIES; i++)
+    {
+        if (page->entries[i].is_empty)
+        {
+            page->entries[i] = *entry;
+            page->count++;
+            fatTable->dirty[bucket] = 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void resizeDirectory(FatTable *fatTable, unsigned int newBuckets)
+{
+    // Reconstruye el directorio completo con newBuckets paginas, o con mas si
+    // alguna se llena. Todas las paginas van a la misma transaccion, que el
+    // diario amplia si hace falta (growJournal); solo lo usa -p.
+    unsigned int oldBuckets = fatTable->super.dir_buckets;
+    DirPage **oldPages = fatTable->pages;
+
+    for (unsigned int i = 0; i < oldBuckets; i++)
+    {
+        loadDirPage(fatTable, i);
+    }
+
+    newBuckets = newBuckets > 0 ? newBuckets : 1;
+    fatTable->pages = calloc(newBuckets, sizeof(DirPage *));
+    free(fatTable->dirty);
+    fatTable->dirty = malloc(newBuckets);
+    memset(fatTable->dirty, 1, newBuckets);
+    fatTable->pageCapacity = newBuckets;
+    fatTable->super.dir_buckets = newBuckets;
+    fatTable->superDirty = 1;
+    for (unsigned int i = 0; i < newBuckets; i++)
+    {
+        fatTable->pages[i] = newDirPage();
+    }
+
+    // Redistribuir los registros; si una pagina se llena se divide la
+    // siguiente hasta que la del registro tenga lugar
+    for (unsigned int i = 0; i < oldBuckets; i++)
+    {
+        for (unsigned int j = 0; j < DIR_PAGE_ENTRIES; j++)
+        {
+            FatEntry *entry = &oldPages[i]->entries[j];
+            while (!entry->is_empty && !insertDirEntry(fatTable, entry))
+            {
+                splitDirectoryPage(fatTable);
+            }
+        }
+        free(oldPages[i]);
+    }
+    free(oldPages);
+
+    // Si las paginas no caben en el espacio actual se reubica el directorio
+    unsigned int neededBlocks = (fatTable->super.dir_buckets + DIR_PAGES_PER_BLOCK - 1) / DIR_PAGES_PER_BLOCK;
+    if (neededBlocks > fatTable->super.dir_num_blocks)
+    {
+        Extent old = {fatTable->super.dir_start_block, fatTable->super.dir_num_blocks};
+        fatTable->super.dir_start_block = allocateBlocks(fatTable, neededBlocks);
+        fatTable->super.dir_num_blocks = neededBlocks;
+        releaseBlocks(fatTable, old.start, old.length);
+    }
+    else if (neededBlocks < fatTable->super.dir_num_blocks)
+    {
+        // Devolver los bloques que sobran al reducir el directorio
+        releaseBlocks(fatTable, fatTable->super.dir_start_block + neededBlocks, fatTable->super.dir_num_blocks - neededBlocks);
+        fatTable->super.dir_num_blocks = neededBlocks;
+    }
+}
+
+FatEntry *addFatEntry(FatTable *fatTable, const char *filename)
+{
+    size_t length = strlen(filename);
+    unsigned int hash = hashFilename(filename, length);
+    while (1)
+    {
+        unsigned int bucket = bucketForHash(fatTable, hash);
+        DirPage *page = loadDirPage(fatTable, bucket);
+        unsigned long capacity = (unsigned long)fatTable->super.dir_buckets * DIR_PAGE_ENTRIES;
+
+        if (page->count < DIR_PAGE_ENTRIES && (fatTable->super.num_entries + 1) * 100UL <= capacity * DIR_MAX_LOAD)
+        {
+            for (unsigned int i = 0; i < DIR_PAGE_ENTRIES; i++)
+            {
+                if (page->entries[i].is_empty)
+                {
+                    FatEntry *entry = &page->entries[i];
+                    memset(entry, 0, sizeof(FatEntry));
+                    if (length <= 12)
+                    {
+                        memcpy(entry->filename, filename, length);
+                    }
+                    else
+                    {
+                        entry->flags = FAT_LONG_NAME;
+                        entry->name.hash = hash;
+                        entry->name.offset = addLongName(fatTable, filename, length);
+                        entry->name.length = length;
+                    }
+                    page->count++;
+                    fatTable->super.num_entries++;
+                    fatTable->dirty[bucket] = 1;
+                    fatTable->superDirty = 1;
+                    return entry;
+                }
+            }
+        }
+
+        // La extension del directorio se duplica cuando se llena; las paginas
+        // que ya tiene se copian una sola vez y no pasan por el diario
+        if ((unsigned long)fatTable->super.dir_buckets + 1 > (unsigned long)fatTable->super.dir_num_blocks * DIR_PAGES_PER_BLOCK)
+        {
+            if (verbose == 2)
+            {
+                printf("Ampliando el directorio a %u bloques...\n", fatTable->super.dir_num_blocks * 2);
+            }
+            moveDirectoryExtent(fatTable, fatTable->super.dir_num_blocks * 2);
+        }
+        splitDirectoryPage(fatTable);
+    }
+}
+
+void markFatEntryDirty(FatTable *fatTable, FatEntry *entry)
+{
+    fatTable->dirty[bucketForEntry(fatTable, entry)] = 1;
+}
+
+void removeFatEntry(FatTable *fatTable, FatEntry *entry)
+{
+    unsigned int bucket = bucketForEntry(fatTable, entry);
+    memset(entry, 0, sizeof(FatEntry));
+    entry->is_empty = 1;
+    fatTable->pages[bucket]->count--;
+    fatTable->super.num_entries--;
+    fatTable->dirty[bucket] = 1;
+    fatTable->superDirty = 1;
+}
+
+int openArchive(char *tarFilename, int flags, FatTable *fatTable)
+{
+    // Sin mensajes: el error queda en errno
+    int fd = open(tarFilename, flags);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    unsigned long long start = statStart();
+    int loaded = loadFatTableFromFile(fatTable, fd);
+    statEnd(STAT_FAT_LOAD, start);
+    if (loaded == 0)
+    {
+        start = statStart();
+        loaded = replayJournal(fatTable, tarFilename);
+        statEnd(STAT_JOURNAL_REPLAY, start);
+    }
+    // Quien escribe reserva bloques: un mapa libre danado se rechaza aqui y
+    // no cuando ya se reservaron bloques en uso
+    if (loaded == 0 && (flags & O_ACCMODE) != O_RDONLY && readFreeMap(fatTable) != 0)
+    {
+        errno = ENODATA;
+        loaded = -1;
+    }
+    fatTable->diskEnd = fatTable->super.next_free_block;
+    if (loaded != 0)
+    {
+        int error = errno;
+        freeFatTable(fatTable);
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+unsigned char keepArchivesOpen = 0; // openTar y closeTar usan la cache (--serve)
+CachedArchive *archiveCache = NULL;
+unsigned int numCachedArchives = 0;
+unsigned long long cacheClock = 0;
+
+void releaseHeldBlocks(FatTable *fatTable)
+{
+    unsigned char lazySave = fatTable->lazySave;
+    fatTable->lazySave = 0;
+    for (unsigned int i = 0; i < fatTable->numHeldFree; i++)
+    {
+        releaseBlocks(fatTable, fatTable->heldFree[i].start, fatTable->heldFree[i].length);
+    }
+    fatTable->numHeldFree = 0;
+    fatTable->lazySave = lazySave;
+}
+
+void flushFatTable(FatTable *fatTable)
+{
+    // Lo retenido pasa al mapa libre en la misma transaccion que deja de
+    // usarlo: el guardado solo escribe por el diario, asi que esos bloques no
+    // se tocan antes de confirmarla
+    releaseHeldBlocks(fatTable);
+    unsigned char lazySave = fatTable->lazySave;
+    fatTable->lazySave = 0;
+    saveFatTableToFile(fatTable);
+    fatTable->lazySave = lazySave;
+}
+
+void flushCachedArchive(CachedArchive *cached)
+{
+    flushFatTable(&cached->fatTable);
+    cached->modified = 0;
+}
+
+void flushCachedArchives()
+{
+    for (unsigned int i = 0; i < numCachedArchives; i++)
+    {
+        if (archiveCache[i].modified)
+        {
+            flushCachedArchive(&archiveCache[i]);
+        }
+    }
+}
+
+void dropCachedArchive(unsigned int i, int save)
+{
+    CachedArchive *cached = &archiveCache[i];
+    if (save && cached->modified)
+    {
+        flushCachedArchive(cached);
+    }
+    close(cached->fatTable.fd);
+    freeFatTable(&cached->fatTable);
+    archiveCache[i] = archiveCache[--numCachedArchives];
+}
+
+CachedArchive *findCachedArchive(char *tarFilename)
+{
+    struct stat st;
+    for (unsigned int i = 0; stat(tarFilename, &st) == 0 && i < numCachedArchives; i++)
+    {
+        if (archiveCache[i].device == st.st_dev && archiveCache[i].inode == st.st_ino)
+        {
+            return &archiveCache[i];
+        }
+    }
+    return NULL;
+}
+
+int syncCachedArchive(char *tarFilename)
+{
+    // Escribir ya la FAT en memoria del TAR (--commit, o antes de leerlo con libtar)
+    CachedArchive *cached = findCachedArchive(tarFilename);
+    if (cached == NULL)
+    {
+        return -1;
+    }
+    flushCachedArchive(cached);
+    return 0;
+}
+
+void reuseCachedBlocks(char *tarFilename)
+{
+    // En un lote (--batch) lo liberado se reutiliza antes de guardar la FAT:
+    // si el lote se interrumpe, los archivos que borraba pueden quedar con
+    // bloques corruptos (el CRC lo detecta), pero no los demas
+    CachedArchive *cached = findCachedArchive(tarFilename);
+    if (cached != NULL)
+    {
+        releaseHeldBlocks(&cached->fatTable);
+    }
+}
+
+void forgetCachedArchive(char *tarFilename, int save)
+{
+    // Sacar el TAR de la cache: se va a reemplazar (-c, sin guardar) o a
+    // modificar sin la cache (-p, guardando antes)
+    CachedArchive *cached = findCachedArchive(tarFilename);
+    if (cached != NULL)
+    {
+        dropCachedArchive(cached - archiveCache, save);
+    }
+}
+
+int hasUnsavedArchives()
+{
+    for (unsigned int i = 0; i < numCachedArchives; i++)
+    {
+        if (archiveCache[i].modified)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void closeCachedArchives()
+{
+    while (numCachedArchives > 0)
+    {
+        dropCachedArchive(numCachedArchives - 1, 1);
+    }
+    free(archiveCache);
+    archiveCache = NULL;
+}
+
+int checkoutCachedArchive(char *tarFilename, int flags, FatTable *fatTable)
+{
+    // Devuelve 0 si la FAT salio de la cache (o entro a ella), -1 si no se pudo
+    struct stat st;
+    if (stat(tarFilename, &st) != 0)
+    {
+        return -1;
+    }
+    CachedArchive *cached = findCachedArchive(tarFilename);
+    if (cached == NULL)
+    {
+        // Se abre para escritura aunque la operacion solo lea: la siguiente puede escribir
+        FatTable loaded;
+        if (openArchive(tarFilename, O_RDWR, &loaded) != 0)
+        {
+            return -1;
+        }
+        if (numCachedArchives == MAX_CACHED_ARCHIVES)
+        {
+            unsigned int oldest = 0;
+            for (unsigned int i = 1; i < numCachedArchives; i++)
+            {
+                oldest = archiveCache[i].lastUse < archiveCache[oldest].lastUse ? i : oldest;
+            }
+            dropCachedArchive(oldest, 1);
+        }
+        archiveCache = realloc(archiveCache, (numCachedArchives + 1) * sizeof(CachedArchive));
+        cached = &archiveCache[numCachedArchives++];
+        memset(cached, 0, sizeof(CachedArchive));
+        cached->device = st.st_dev;
+        cached->inode = st.st_ino;
+        cached->fatTable = loaded;
+        cached->fatTable.lazySave = 1;
+    }
+    cached->lastUse = ++cacheClock;
+    cached->modified |= (flags & O_ACCMODE) != O_RDONLY;
+    *fatTable = cached->fatTable;
+    return 0;
+}
+
+int checkinCachedArchive(FatTable *fatTable)
+{
+    for (unsigned int i = 0; i < numCachedArchives; i++)
+    {
+        if (archiveCache[i].fatTable.fd == fatTable->fd)
+        {
+            archiveCache[i].fatTable = *fatTable;
+            archiveCache[i].fatTable.lazySave = 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int openTar(char *tarFilename, int flags, FatTable *fatTable)
+{
+    if (keepArchivesOpen && checkoutCachedArchive(tarFilename, flags, fatTable) == 0)
+    {
+        return 0;
+    }
+    if (openArchive(tarFilename, flags, fatTable) == 0)
+    {
+        return 0;
+    }
+    switch (errno)
+    {
+    case EINVAL:
+        printf("ERROR: el archivo no es un TAR valido.\n");
+        break;
+    case ENOTSUP:
+        printf("ERROR: version del formato TAR no soportada.\n");
+        break;
+    case EBADMSG:
+        printf("ERROR: el superbloque del TAR esta corrupto.\n");
+        break;
+    case EROFS:
+        printf("ERROR: el TAR tiene transacciones pendientes y no se puede escribir.\n");
+        break;
+    case ENODATA:
+        printf("ERROR: el mapa de espacio libre del TAR esta truncado o danado.\n");
+        break;
+    default:
+        printf("ERROR: No se encontro el archivo %s.\n", tarFilename);
+    }
+    return -1;
+}
+
+void closeTar(FatTable *fatTable)
+{
+    if (keepArchivesOpen && checkinCachedArchive(fatTable) == 0)
+    {
+        return;
+    }
+    close(fatTable->fd);
+    freeFatTable(fatTable);
+}
+
+int isCopyFallbackError(int error)
+{
+    return error == EXDEV || error == ENOSYS || error == EOPNOTSUPP || error == EINVAL || error == ENODEV || error == EBADF;
+}
+
+off_t copyFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer)
+{
+    // Motor de copia: copy_file_range, sendfile, mmap y por ultimo un buffer.
+    // Cada metodo que falla se descarta solo para esta copia.
+    // sendfile usa la posicion de outFd, que no debe compartirse entre hilos.
+    int useCopyFileRange = 1, useSendfile = 1, useMmap = 1;
+    char *ownBuffer = NULL;
+    off_t copied = 0;
+
+    // Con --io uring la copia completa va por el anillo del hilo
+    IoRing *ring = ioBackend == IO_URING ? threadIoRing() : NULL;
+    if (ring != NULL)
+    {
+        copied = ioRingCopy(ring, inFd, inOffset, outFd, outOffset, length, NULL, 0);
+        if (copied >= 0 || !isCopyFallbackError(errno))
+        {
+            return copied;
+        }
+        copied = 0;
+    }
+
+    while (copied < length)
+    {
+        off_t remaining = length - copied;
+        size_t chunk = remaining < COPY_CHUNK ? remaining : COPY_CHUNK;
+        ssize_t n;
+
+        if (useCopyFileRange)
+        {
+            loff_t in = inOffset + copied, out = outOffset + copied;
+            n = copy_file_range(inFd, &in, outFd, &out, chunk, 0);
+            statCall(CALL_COPY_FILE_RANGE, n);
+            if (n >= 0 || !isCopyFallbackError(errno))
+            {
+                goto advance;
+            }
+            useCopyFileRange = 0;
+        }
+
+        if (useSendfile)
+        {
+            off_t in = inOffset + copied;
+            if (lseek(outFd, outOffset + copied, SEEK_SET) >= 0)
+            {
+                n = sendfile(outFd, inFd, &in, chunk);
+                statCall(CALL_SENDFILE, n);
+                if (n >= 0 || !isCopyFallbackError(errno))
+                {
+                    goto advance;
+                }
+            }
+            useSendfile = 0;
+        }
+
+        if (useMmap)
+        {
+            // Mapear el origen y escribir directo desde las paginas mapeadas
+            long pageSize = sysconf(_SC_PAGESIZE);
+            off_t mapStart = (inOffset + copied) & ~((off_t)pageSize - 1);
+            size_t delta = inOffset + copied - mapStart;
+            void *map = mmap(NULL, chunk + delta, PROT_READ, MAP_SHARED, inFd, mapStart);
+            if (map != MAP_FAILED)
+            {
+                struct stat st;
+                // Leer mas alla del final de un mapeo produce SIGBUS
+                if (fstat(inFd, &st) == 0 && inOffset + copied + (off_t)chunk > st.st_size)
+                {
+                    chunk = st.st_size > inOffset + copied ? st.st_size - (inOffset + copied) : 0;
+                }
+                n = chunk > 0 ? pwrite(outFd, (char *)map + delta, chunk, outOffset + copied) : 0;
+                statCall(CALL_PWRITE, n);
+                munmap(map, chunk + delta);
+                goto advance;
+            }
+            useMmap = 0;
+        }
+
+        // Respaldo: pread/pwrite con buffer
+        if (buffer == NULL)
+        {
+            buffer = ownBuffer = malloc(BLOCK_SIZE);
+        }
+        if (chunk > BLOCK_SIZE)
+        {
+            chunk = BLOCK_SIZE;
+        }
+        n = pread(inFd, buffer, chunk, inOffset + copied);
+        statCall(CALL_PREAD, n);
+        if (n > 0)
+        {
+            n = pwrite(outFd, buffer, n, outOffset + copied);
+            statCall(CALL_PWRITE, n);
+        }
+
+    advance:
+        if (n < 0)
+        {
+            free(ownBuffer);
+            return -1;
+        }
+        if (n == 0)
+        {
+            break; // Fin del archivo de origen
+        }
+        copied += n;
+    }
+
+    free(ownBuffer);
+    return copied;
+}
+
+// FICLONERANGE de <linux/fs.h>, que no se incluye porque define su propio BLOCK_SIZE
+typedef struct CloneRange
+{
+    long long src_fd;
+    unsigned long long src_offset;
+    unsigned long long src_length;
+    unsigned long long dest_offset;
+} CloneRange;
+
+#define FICLONE_RANGE _IOW(0x94, 13, CloneRange)
+
+off_t cloneFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer)
+{
+    // Entre dos TAR: reflink (FICLONERANGE) de la parte alineada a bloques del
+    // sistema de archivos, que comparte los datos sin copiarlos. El resto, y
+    // los sistemas de archivos sin reflinks, van por el motor de copia.
+    struct stat st;
+    off_t cloned = 0;
+    if (fstat(inFd, &st) == 0 && st.st_blksize > 0 && inOffset < st.st_size)
+    {
+        off_t available = st.st_size - inOffset < length ? st.st_size - inOffset : length;
+        CloneRange range = {inFd, inOffset, available / st.st_blksize * st.st_blksize, outOffset};
+        if (range.src_length > 0 && (inOffset | outOffset) % st.st_blksize == 0 &&
+            ioctl(outFd, FICLONE_RANGE, &range) == 0)
+        {
+            cloned = range.src_length;
+            statCall(CALL_FICLONERANGE, cloned);
+        }
+    }
+    if (cloned == length)
+    {
+        return cloned;
+    }
+    off_t copied = copyFileRange(inFd, inOffset + cloned, outFd, outOffset + cloned, length - cloned, buffer);
+    return copied < 0 ? -1 : cloned + copied;
+}
+
+ssize_t readFully(int fd, void *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = read(fd, (char *)buffer + done, length - done);
+        if (n <= 0)
+        {
+            return n < 0 ? -1 : (ssize_t)done;
+        }
+        done += n;
+    }
+    return done;
+}
+
+ssize_t writeFully(int fd, const void *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = write(fd, (const char *)buffer + done, length - done);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+
+void startExtentCrc(ExtentCrc *check, BlockInfo *blocks, unsigned int numBlocks)
+{
+    // Calcular: blocks debe empezar en cero
+    memset(check, 0, sizeof(ExtentCrc));
+    check->blocks = blocks;
+    check->numBlocks = numBlocks;
+    check->corrupt = -1;
+}
+
+int loadExtentCrc(ExtentCrc *check, int fd, SuperBlock *super, unsigned int firstBlock, unsigned int numBlocks)
+{
+    // Revisar: los CRC guardados de la extension; fuera de la tabla no hay que revisar
+    startExtentCrc(check, calloc(numBlocks + 1, sizeof(BlockInfo)), numBlocks);
+    check->verify = 1;
+    check->fd = fd;
+    check->firstBlock = firstBlock;
+    unsigned int capacity = super->btab_num_blocks * BLOCK_INFO_PER_BLOCK;
+    unsigned int count = firstBlock >= capacity ? 0 : capacity - firstBlock < numBlocks ? capacity - firstBlock : numBlocks;
+    off_t tableOffset = blockOffset(super->btab_start_block) + (off_t)firstBlock * sizeof(BlockInfo);
+    if (count > 0 && pread(fd, check->blocks, count * sizeof(BlockInfo), tableOffset) != (ssize_t)(count * sizeof(BlockInfo)))
+    {
+        check->corrupt = firstBlock;
+        return -1;
+    }
+    return 0;
+}
+
+int completeExtentBlock(ExtentCrc *check)
+{
+    // Leer lo que falta del bloque en curso (lo que ninguna copia trajo) y compararlo
+    if (check->seen == 0)
+    {
+        return 0;
+    }
+    BlockInfo *expected = &check->blocks[check->block];
+    if (check->seen < expected->length)
+    {
+        if (check->scratch == NULL)
+        {
+            check->scratch = malloc(BLOCK_SIZE);
+        }
+        unsigned int missing = expected->length - check->seen;
+        if (pread(check->fd, check->scratch, missing, blockOffset(check->firstBlock + check->block) + check->seen) != missing)
+        {
+            check->corrupt = check->firstBlock + check->block;
+            return -1;
+        }
+        check->crc = crc32cUpdate(check->crc, check->scratch, missing);
+    }
+    check->seen = 0;
+    if (check->crc != expected->crc)
+    {
+        check->corrupt = check->firstBlock + check->block;
+        return -1;
+    }
+    return 0;
+}
+
+int checksumBytes(ExtentCrc *check, unsigned long long position, const char *data, size_t length)
+{
+    // position es relativa al inicio de la extension. Devuelve -1 si un
+    // bloque que se completa con estos datos no coincide (no escribirlos)
+    unsigned long long start = statStart();
+    int result = 0;
+    while (length > 0 && result == 0)
+    {
+        unsigned int block = position / BLOCK_SIZE;
+        unsigned int offset = position % BLOCK_SIZE;
+        size_t piece = length < BLOCK_SIZE - offset ? length : BLOCK_SIZE - offset;
+        if (block >= check->numBlocks)
+        {
+            break;
+        }
+        BlockInfo *info = &check->blocks[block];
+        if (!check->verify)
+        {
+            info->crc = crc32cUpdate(offset == 0 ? 0 : info->crc, data, piece);
+            info->length = offset == 0 ? piece : info->length + piece;
+        }
+        else if (offset < info->length)
+        {
+            // Lo que queda despues de los bytes usados del bloque no tiene CRC
+            unsigned int counted = piece < info->length - offset ? piece : info->length - offset;
+            if (offset == 0 && counted == info->length)
+            {
+                // El trozo trae el bloque completo: se revisa sin estado
+                if (crc32cUpdate(0, data, counted) != info->crc)
+                {
+                    check->corrupt = check->firstBlock + block;
+                    result = -1;
+                }
+            }
+            else
+            {
+                if (check->seen > 0 && (check->block != block || check->seen > offset))
+                {
+                    result = completeExtentBlock(check);
+                }
+                if (result == 0 && check->seen == 0)
+                {
+                    check->block = block;
+                    check->crc = 0;
+                }
+                if (result == 0 && offset > check->seen)
+                {
+                    // Bytes del bloque que la copia no trae (relleno entre partes)
+                    if (check->scratch == NULL)
+                    {
+                        check->scratch = malloc(BLOCK_SIZE);
+                    }
+                    unsigned int gap = offset - check->seen;
+                    if (pread(check->fd, check->scratch, gap, blockOffset(check->firstBlock + block) + check->seen) != gap)
+                    {
+                        check->corrupt = check->firstBlock + block;
+                        result = -1;
+                    }
+                    check->crc = crc32cUpdate(check->crc, check->scratch, gap);
+                    check->seen = offset;
+                }
+                if (result == 0)
+                {
+                    check->crc = crc32cUpdate(check->crc, data, counted);
+                    check->seen += counted;
+                    if (check->seen == info->length)
+                    {
+                        result = completeExtentBlock(check);
+                    }
+                }
+            }
+        }
+        position += piece;
+        data += piece;
+        length -= piece;
+    }
+    statEnd(STAT_CHECKSUM, start);
+    return result;
+}
+
+int finishExtentCrc(ExtentCrc *check)
+{
+    // Devuelve el primer bloque corrupto o -1; al revisar libera los CRC esperados
+    if (check->verify)
+    {
+        if (check->corrupt < 0)
+        {
+            completeExtentBlock(check);
+        }
+        free(check->blocks);
+        check->blocks = NULL;
+    }
+    free(check->scratch);
+    check->scratch = NULL;
+    return check->corrupt;
+}
+
+int copyCheckedPiece(int inFd, off_t inOffset, int outFd, off_t outOffset, const char *data, size_t length, int *useCopyFileRange)
+{
+    // Escribe length bytes ya revisados. Si data es un mapeo de inFd las
+    // paginas estan en cache y copy_file_range las copia sin pasar por el
+    // proceso (o con un reflink); si no, o si falla, pwrite desde data
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = -1;
+        if (useCopyFileRange != NULL && *useCopyFileRange)
+        {
+            loff_t in = inOffset + done, out = outOffset + done;
+            n = copy_file_range(inFd, &in, outFd, &out, length - done, 0);
+            statCall(CALL_COPY_FILE_RANGE, n);
+            if (n < 0 && isCopyFallbackError(errno))
+            {
+                *useCopyFileRange = 0;
+            }
+        }
+        if (useCopyFileRange == NULL || !*useCopyFileRange)
+        {
+            n = pwrite(outFd, data + done, length - done, outOffset + done);
+            statCall(CALL_PWRITE, n);
+        }
+        if (n <= 0)
+        {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+off_t copyExtentRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer, ExtentCrc *check, unsigned long long position)
+{
+    // Copia que pasa los datos por checksumBytes (position es la del primer
+    // byte dentro de la extension del TAR). copy_file_range no deja ver los
+    // datos: se mapea el origen, el CRC sale de las paginas mapeadas y cada
+    // bloque ya revisado lo copia el kernel desde esas mismas paginas en
+    // cache (o con pwrite si no se puede). Sin mapeo se usa el anillo o un
+    // buffer. Un bloque corrupto no se escribe y la copia termina con EBADMSG.
+    off_t copied = 0;
+    IoRing *ring = ioBackend == IO_URING && position % BLOCK_SIZE == 0 ? threadIoRing() : NULL;
+    if (ring != NULL)
+    {
+        copied = ioRingCopy(ring, inFd, inOffset, outFd, outOffset, length, check, position);
+        if (copied >= 0 || !isCopyFallbackError(errno))
+        {
+            return copied;
+        }
+        copied = 0;
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    char *ownBuffer = NULL;
+    int useMmap = 1, useCopyFileRange = 1;
+    struct stat st;
+    if (fstat(inFd, &st) != 0)
+    {
+        return -1;
+    }
+    while (copied < length && inOffset + copied < st.st_size)
+    {
+        // Leer mas alla del final de un mapeo produce SIGBUS
+        off_t remaining = length - copied < st.st_size - (inOffset + copied) ? length - copied : st.st_size - (inOffset + copied);
+        size_t chunk = remaining < COPY_CHUNK ? remaining : COPY_CHUNK;
+        char *data = NULL;
+        void *map = MAP_FAILED;
+        size_t delta = 0;
+        if (useMmap)
+        {
+            off_t mapStart = (inOffset + copied) & ~((off_t)pageSize - 1);
+            delta = inOffset + copied - mapStart;
+            map = mmap(NULL, chunk + delta, PROT_READ, MAP_SHARED, inFd, mapStart);
+            useMmap = map != MAP_FAILED;
+            data = useMmap ? (char *)map + delta : NULL;
+        }
+        if (!useMmap)
+        {
+            // Respaldo: pread con buffer, un bloque de la extension a la vez
+            if (buffer == NULL)
+            {
+                buffer = ownBuffer = malloc(BLOCK_SIZE);
+            }
+            unsigned int offset = (position + copied) % BLOCK_SIZE;
+            chunk = chunk < BLOCK_SIZE - offset ? chunk : BLOCK_SIZE - offset;
+            ssize_t n = pread(inFd, buffer, chunk, inOffset + copied);
+            statCall(CALL_PREAD, n);
+            if (n <= 0)
+            {
+                break;
+            }
+            chunk = n;
+            data = buffer;
+        }
+
+        // Por bloques de la extension: cada uno se revisa antes de escribirlo
+        size_t done = 0;
+        int failed = 0;
+        while (done < chunk && !failed)
+        {
+            unsigned int offset = (position + copied + done) % BLOCK_SIZE;
+            size_t piece = chunk - done < BLOCK_SIZE - offset ? chunk - done : BLOCK_SIZE - offset;
+            if (checksumBytes(check, position + copied + done, data + done, piece) != 0)
+            {
+                errno = EBADMSG;
+                failed = 1;
+                break;
+            }
+            if (copyCheckedPiece(inFd, inOffset + copied + done, outFd, outOffset + copied + done, data + done, piece,
+                                 map != MAP_FAILED ? &useCopyFileRange : NULL) != 0)
+            {
+                failed = 1;
+                break;
+            }
+            done += piece;
+        }
+        if (map != MAP_FAILED)
+        {
+            munmap(map, chunk + delta);
+        }
+        if (failed)
+        {
+            free(ownBuffer);
+            return -1;
+        }
+        copied += chunk;
+    }
+    free(ownBuffer);
+    return copied;
+}
+
+int verifyExtent(int fd, SuperBlock *super, unsigned int starting_block, unsigned int num_blocks, char *buffer)
+{
+    // Devuelve el primer bloque corrupto de la extension o -1 si todo coincide
+    unsigned int capacity = super->btab_num_blocks * BLOCK_INFO_PER_BLOCK;
+    if (starting_block >= capacity)
+    {
+        return -1;
+    }
+    if (num_blocks > capacity - starting_block)
+    {
+        num_blocks = capacity - starting_block;
+    }
+    unsigned long long start = statStart();
+    BlockInfo *blocks = malloc((num_blocks + 1) * sizeof(BlockInfo));
+    off_t tableOffset = blockOffset(super->btab_start_block) + (off_t)starting_block * sizeof(BlockInfo);
+    int corrupt = -1;
+    if (pread(fd, blocks, num_blocks * sizeof(BlockInfo), tableOffset) != (ssize_t)(num_blocks * sizeof(BlockInfo)))
+    {
+        corrupt = starting_block;
+    }
+    for (unsigned int i = 0; corrupt < 0 && i < num_blocks; i++)
+    {
+        if (blocks[i].length == 0)
+        {
+            continue;
+        }
+        if (blocks[i].length > BLOCK_SIZE ||
+            pread(fd, buffer, blocks[i].length, blockOffset(starting_block + i)) != blocks[i].length ||
+            crc32cUpdate(0, buffer, blocks[i].length) != blocks[i].crc)
+        {
+            corrupt = starting_block + i;
+        }
+    }
+    free(blocks);
+    statEnd(STAT_CHECKSUM, start);
+    return corrupt;
+}
+
+int createEmptyTar(char *tarFilename)
+{
+    int fd = open(tarFilename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // Superbloque y directorio vacio
+    FatTable fatTable;
+    initializeFatTable(&fatTable, fd);
+    saveFatTableToFile(&fatTable);
+
+    closeTar(&fatTable);
+    return 0;
+}
+
+// Compresion por bloques. Cada bloque de BLOCK_SIZE se comprime por
+// separado y el inicio de la extension guarda un mapa con la posicion de
+// cada bloque (num_bloques + 1 desplazamientos de 64 bits), de modo que
+// cualquier bloque se ubica en O(1). Un bloque que no se reduce se guarda
+// tal cual: su tamanno guardado es igual al original.
+
+#define LZ_HASH_BITS 14
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+unsigned int lzRead32(const unsigned char *p)
+{
+    unsigned int value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+unsigned char *lzWriteLength(unsigned char *op, unsigned int length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = length;
+    return op;
+}
+
+int lzCompress(const unsigned char *src, int srcLength, unsigned char *dst, int dstCapacity)
+{
+    // Formato de secuencias estilo LZ4: token, literales, distancia, largo
+    unsigned int table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+    unsigned char *op = dst;
+    unsigned char *opLimit = dst + dstCapacity;
+    int ip = 0, anchor = 0;
+
+    while (ip < srcLength - LZ_MATCH_LIMIT)
+    {
+        unsigned int sequence = lzRead32(src + ip);
+        unsigned int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        int candidate = (int)table[hash] - 1;
+        table[hash] = ip + 1;
+        if (candidate < 0 || ip - candidate > 65535 || lzRead32(src + candidate) != sequence)
+        {
+            ip++;
+            continue;
+        }
+
+        int matchLength = LZ_MIN_MATCH;
+        while (ip + matchLength < srcLength - LZ_LAST_LITERALS && src[candidate + matchLength] == src[ip + matchLength])
+        {
+            matchLength++;
+        }
+
+        // Peor caso de la secuencia: token + largos extendidos + literales + distancia
+        int literals = ip - anchor;
+        if (op + 1 + literals / 255 + 1 + literals + 2 + matchLength / 255 + 1 > opLimit)
+        {
+            return 0;
+        }
+        unsigned char *token = op++;
+        *token = (literals >= 15 ? 15 : literals) << 4;
+        if (literals >= 15)
+        {
+            op = lzWriteLength(op, literals - 15);
+        }
+        memcpy(op, src + anchor, literals);
+        op += literals;
+        unsigned int distance = ip - candidate;
+        *op++ = distance & 0xFF;
+        *op++ = distance >> 8;
+        unsigned int extra = matchLength - LZ_MIN_MATCH;
+        *token |= extra >= 15 ? 15 : extra;
+        if (extra >= 15)
+        {
+            op = lzWriteLength(op, extra - 15);
+        }
+
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    // Ultima secuencia: solo literales
+    int literals = srcLength - anchor;
+    if (op + 1 + literals / 255 + 1 + literals > opLimit)
+    {
+        return 0;
+    }
+    *op++ = (literals >= 15 ? 15 : literals) << 4;
+    if (literals >= 15)
+    {
+        op = lzWriteLength(op, literals - 15);
+    }
+    memcpy(op, src + anchor, literals);
+    op += literals;
+    return op - dst;
+}
+
+int lzDecompress(const unsigned char *src, int srcLength, unsigned char *dst, int dstLength)
+{
+    int ip = 0, op = 0;
+    while (ip < srcLength)
+    {
+        unsigned int token = src[ip++];
+        unsigned int literals = token >> 4;
+        if (literals == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= srcLength)
+                {
+                    return -1;
+                }
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (ip + (int)literals > srcLength || op + (int)literals > dstLength)
+        {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == srcLength)
+        {
+            break; // Ultima secuencia
+        }
+
+        if (ip + 2 > srcLength)
+        {
+            return -1;
+        }
+        int distance = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        unsigned int matchLength = token & 15;
+        if (matchLength == 15)
+        {
+            unsigned char b;
+            do
+            {
+                if (ip >= srcLength)
+                {
+                    return -1;
+                }
+                b = src[ip++];
+                matchLength += b;
+            } while (b == 255);
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (distance == 0 || distance > op || op + (int)matchLength > dstLength)
+        {
+            return -1;
+        }
+        // Copia byte a byte: la coincidencia puede traslaparse consigo misma
+        for (unsigned int i = 0; i < matchLength; i++, op++)
+        {
+            dst[op] = dst[op - distance];
+        }
+    }
+    return op;
+}
+
+int compressBlock(unsigned char codec, const char *src, int srcLength, char *dst, int dstCapacity)
+{
+    // Devuelve 0 si el bloque no se reduce (se guarda sin comprimir)
+#ifdef HAVE_ZSTD
+    if (codec == FAT_ZSTD)
+    {
+        size_t n = ZSTD_compress(dst, dstCapacity, src, srcLength, 1);
+        return ZSTD_isError(n) ? 0 : (int)n;
+    }
+#endif
+    if (codec == FAT_LZ)
+    {
+        return lzCompress((const unsigned char *)src, srcLength, (unsigned char *)dst, dstCapacity);
+    }
+    return 0;
+}
+
+int decompressBlock(unsigned char codec, const char *src, int srcLength, char *dst, int dstLength)
+{
+#ifdef HAVE_ZSTD
+    if (codec == FAT_ZSTD)
+    {
+        size_t n = ZSTD_decompress(dst, dstLength, src, srcLength);
+        return !ZSTD_isError(n) && (int)n == dstLength ? 0 : -1;
+    }
+#endif
+    if (codec == FAT_LZ)
+    {
+        return lzDecompress((const unsigned char *)src, srcLength, (unsigned char *)dst, dstLength) == dstLength ? 0 : -1;
+    }
+    return -1;
+}
+
+unsigned int blockMapSize(unsigned long long file_size)
+{
+    return ((file_size + BLOCK_SIZE - 1) / BLOCK_SIZE + 1) * sizeof(unsigned long long);
+}
+
+
+pthread_t *startWorkers(void *(*worker)(void *), void *pool, int jobs)
+{
+    pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_create(&threads[i], NULL, worker, pool);
+    }
+    return threads;
+}
+
+void joinWorkers(pthread_t *threads, int jobs)
+{
+    for (int i = 0; i < jobs; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+void runWorkers(void *(*worker)(void *), void *pool, int jobs, unsigned int numJobs)
+{
+    if (jobs <= 1 || numJobs <= 1)
+    {
+        worker(pool);
+        return;
+    }
+    if ((unsigned int)jobs > numJobs)
+    {
+        jobs = numJobs;
+    }
+    joinWorkers(startWorkers(worker, pool, jobs), jobs);
+}
+
+void initIngestPool(IngestPool *pool, char *tarFilename, FatTable *fatTable)
+{
+    memset(pool, 0, sizeof(IngestPool));
+    pool->tarFilename = tarFilename;
+    pool->fatTable = fatTable;
+    pool->planning = 1;
+    pthread_mutex_init(&pool->dedupLock, NULL);
+    pthread_mutex_init(&pool->queueLock, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+}
+
+IngestJob *ingestJobAt(IngestPool *pool, unsigned int i)
+{
+    return &pool->chunks[i / INGEST_CHUNK][i % INGEST_CHUNK];
+}
+
+IngestJob *reserveIngestJob(IngestPool *pool)
+{
+    // Lugar para el siguiente trabajo; los hilos no lo ven hasta publicarlo
+    if (pool->numJobs / INGEST_CHUNK == pool->numChunks)
+    {
+        pthread_mutex_lock(&pool->queueLock);
+        pool->chunks = realloc(pool->chunks, (pool->numChunks + 1) * sizeof(IngestJob *));
+        pool->chunks[pool->numChunks++] = malloc(INGEST_CHUNK * sizeof(IngestJob));
+        pthread_mutex_unlock(&pool->queueLock);
+    }
+    return ingestJobAt(pool, pool->numJobs);
+}
+
+void publishIngestJob(IngestPool *pool)
+{
+    pthread_mutex_lock(&pool->queueLock);
+    pool->numJobs++;
+    pthread_cond_signal(&pool->jobReady);
+    pthread_mutex_unlock(&pool->queueLock);
+}
+
+void closeIngestPool(IngestPool *pool)
+{
+    // No hay mas trabajos: los hilos terminan al vaciar la lista
+    pthread_mutex_lock(&pool->queueLock);
+    pool->planning = 0;
+    pthread_cond_broadcast(&pool->jobReady);
+    pthread_mutex_unlock(&pool->queueLock);
+}
+
+void freeIngestPool(IngestPool *pool)
+{
+    for (unsigned int i = 0; i < pool->numChunks; i++)
+    {
+        free(pool->chunks[i]);
+    }
+    free(pool->chunks);
+    pthread_cond_destroy(&pool->jobReady);
+    pthread_mutex_destroy(&pool->queueLock);
+    pthread_mutex_destroy(&pool->dedupLock);
+}
+
+void planMemberLayout(FatTable *fatTable, FatEntry *entry, IngestJob *job, unsigned char flags)
+{
+    // Los archivos comprimidos reservan el peor caso (mapa + datos sin
+    // comprimir); lo que sobre se devuelve al terminar la copia
+    job->flags = job->file_size > 0 ? flags : 0;
+    if (job->regions != NULL && !(flags & (FAT_COMPRESSED | FAT_DEDUP)))
+    {
+        // Archivo con huecos: solo se reservan el mapa y las regiones con datos
+        job->flags = FAT_SPARSE;
+    }
+    else if (job->file_size > 0 && job->file_size < BLOCK_SIZE)
+    {
+        // Los archivos de menos de un bloque se guardan juntos en bloques de
+        // colas (sin deduplicar: no llenan ningun bloque compartido)
+        job->flags = FAT_TAIL;
+    }
+    else if ((flags & FAT_DEDUP) && dedupListSize(job->file_size) < BLOCK_SIZE)
+    {
+        // La lista de bloques compartidos va en un bloque de colas
+        job->flags |= FAT_TAIL;
+    }
+    unsigned long long stored = job->file_size + ((job->flags & FAT_COMPRESSED) ? blockMapSize(job->file_size) : 0);
+    if (job->flags & FAT_SPARSE)
+    {
+        stored = sparseDataStart(job->num_regions);
+        if (job->num_regions > 0)
+        {
+            stored = job->regions[job->num_regions - 1].position + job->regions[job->num_regions - 1].length;
+        }
+    }
+    job->num_blocks = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (job->flags & FAT_DEDUP)
+    {
+        // Solo la lista de bloques: los datos nuevos se reservan al copiarlos
+        job->num_blocks = (dedupListSize(job->file_size) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    job->used_blocks = job->num_blocks;
+    job->stored_size = (job->flags & FAT_SPARSE) ? stored : job->file_size;
+    job->tail_offset = 0;
+    unsigned long long start = statStart();
+    if (job->flags & FAT_TAIL)
+    {
+        job->num_blocks = 0;
+        job->used_blocks = 0;
+        job->starting_block = reserveTail(fatTable, (job->flags & FAT_DEDUP) ? dedupListSize(job->file_size) : job->file_size, &job->tail_offset);
+    }
+    else
+    {
+        job->starting_block = allocateBlocks(fatTable, job->num_blocks);
+    }
+    statEnd(STAT_ALLOCATE, start);
+
+    entry->starting_block = job->starting_block;
+    entry->num_blocks = job->num_blocks;
+    entry->file_size = job->file_size;
+    entry->flags = job->flags | (entry->flags & FAT_LONG_NAME);
+    entry->tail_offset = job->tail_offset / TAIL_ALIGN;
+}
+
+int planFileForTar(char *filename, const struct stat *st, FatTable *fatTable, IngestJob *job)
+{
+    memset(job, 0, sizeof(IngestJob));
+    job->filename = filename;
+
+    const char *name = memberName(filename);
+    size_t length = strlen(name);
+    if (length == 0 || length > MAX_NAME_LENGTH)
+    {
+        printf("ERROR: nombre invalido para guardar en el TAR: %s\n", filename);
+        return -1;
+    }
+    if (length > 12 && loadStringTable(fatTable)->length + length + 1 > 0xffffffffULL)
+    {
+        printf("ERROR: la tabla de nombres del TAR esta llena, no se agrego %s\n", filename);
+        return -1;
+    }
+
+    if (findFatEntry(fatTable, name) != NULL)
+    {
+        printf("ERROR: El archivo %s ya existe dentro del TAR.\n", name);
+        return -1;
+    }
+
+    // Reservar la extension y registrar el archivo en el FAT
+    job->file_size = st->st_size;
+    if (!compression && !deduplicate)
+    {
+        int fd = open(filename, O_RDONLY);
+        int count = fd >= 0 ? findSparseRegions(fd, job->file_size, &job->regions) : -1;
+        job->num_regions = count > 0 ? count : 0;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    planMemberLayout(fatTable, addFatEntry(fatTable, name), job, compression | (deduplicate ? FAT_DEDUP : 0));
+    return 0;
+}
+
+void undoIngestJob(FatTable *fatTable, IngestJob *job)
+{
+    // Devolver las referencias a bloques compartidos que se alcanzaron a tomar
+    for (unsigned int i = 0; i < job->list_count; i++)
+    {
+        if (unrefDedupBlock(loadDedupIndex(fatTable), job->list[i]))
+        {
+            releaseBlocks(fatTable, job->list[i], 1);
+        }
+    }
+    if (job->flags & FAT_TAIL)
+    {
+        releaseTail(fatTable, job->starting_block, job->tail_offset, (job->flags & FAT_DEDUP) ? dedupListSize(job->file_size) : job->file_size, 0);
+        return;
+    }
+    releaseBlocks(fatTable, job->starting_block, job->num_blocks);
+}
+
+void addTailChecksum(FatTable *fatTable, IngestJob *job)
+{
+    // El espacio del archivo contaba como ceros en el CRC del bloque
+    unsigned int aligned = job->blocks[0].length;
+    applyTailChecksum(fatTable, job->starting_block, job->tail_offset, aligned, crc32cZeros(aligned), job->blocks[0].crc);
+}
+
+void finishIngestJob(FatTable *fatTable, IngestJob *job)
+{
+    FatEntry *entry = findFatEntry(fatTable, memberName(job->filename));
+    if (job->failed)
+    {
+        // Deshacer la reserva del archivo que no se pudo copiar
+        undoIngestJob(fatTable, job);
+        removeFatEntry(fatTable, entry);
+    }
+    else if (job->used_blocks < job->num_blocks)
+    {
+        // Devolver lo que ahorro la compresion
+        releaseBlocks(fatTable, job->starting_block + job->used_blocks, job->num_blocks - job->used_blocks);
+        entry->num_blocks = job->used_blocks;
+        markFatEntryDirty(fatTable, entry);
+    }
+    for (unsigned int i = 0; !job->failed && i < job->used_blocks; i++)
+    {
+        setBlockInfo(fatTable, job->starting_block + i, job->blocks[i].crc, job->blocks[i].length);
+    }
+    if (!job->failed && (job->flags & FAT_TAIL))
+    {
+        addTailChecksum(fatTable, job);
+    }
+    // Bloques de datos nuevos de un archivo deduplicado (van despues de los
+    // de la lista, o del CRC de la lista si esta en un bloque de colas)
+    unsigned int listBlocks = (job->flags & FAT_TAIL) ? 1 : job->used_blocks;
+    for (unsigned int i = 0; !job->failed && i < job->list_count; i++)
+    {
+        BlockInfo *info = &job->blocks[listBlocks + i];
+        if (info->length > 0)
+        {
+            setBlockInfo(fatTable, job->list[i], info->crc, info->length);
+        }
+    }
+    free(job->blocks);
+    free(job->list);
+    free(job->regions);
+    job->blocks = NULL;
+    job->list = NULL;
+    job->regions = NULL;
+}
+
+int writeCompressedMember(IngestJob *job, int sourceFd, int tarFd, char *buffer)
+{
+    unsigned int numBlocks = (job->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int mapSize = blockMapSize(job->file_size);
+    unsigned long long *blockMap = malloc(mapSize);
+    off_t base = blockOffset(job->starting_block);
+    unsigned long long position = mapSize;
+    char *compressed = buffer + BLOCK_SIZE;
+    job->blocks = calloc(job->num_blocks + 1, sizeof(BlockInfo));
+    ExtentCrc check;
+    startExtentCrc(&check, job->blocks, job->num_blocks);
+
+    for (unsigned int i = 0; i < numBlocks; i++)
+    {
+        unsigned int rawLength = blockLength(job->file_size, i);
+        if (readFully(sourceFd, buffer, rawLength) != (ssize_t)rawLength)
+        {
+            free(blockMap);
+            return -1;
+        }
+
+        int length = compressBlock(job->flags, buffer, rawLength, compressed, rawLength - 1);
+        char *data = length > 0 ? compressed : buffer;
+        if (length <= 0)
+        {
+            length = rawLength;
+        }
+        if (pwrite(tarFd, data, length, base + position) != length)
+        {
+            free(blockMap);
+            return -1;
+        }
+        checksumBytes(&check, position, data, length);
+        blockMap[i] = position;
+        position += length;
+    }
+    blockMap[numBlocks] = position;
+
+    int result = pwrite(tarFd, blockMap, mapSize, base) == (ssize_t)mapSize ? 0 : -1;
+
+    // El mapa se escribe al final pero va al inicio: su CRC se antepone al
+    // de los datos que comparten el ultimo bloque del mapa
+    for (unsigned int b = 0; (unsigned long long)b * BLOCK_SIZE < mapSize; b++)
+    {
+        unsigned int length = mapSize - (unsigned long long)b * BLOCK_SIZE < BLOCK_SIZE ? mapSize - (unsigned long long)b * BLOCK_SIZE : BLOCK_SIZE;
+        unsigned int crc = crc32cUpdate(0, (char *)blockMap + (unsigned long long)b * BLOCK_SIZE, length);
+        job->blocks[b].crc = crc32cCombine(crc, job->blocks[b].crc, job->blocks[b].length);
+        job->blocks[b].length += length;
+    }
+    finishExtentCrc(&check);
+    free(blockMap);
+    job->used_blocks = (position + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    job->stored_size = position;
+    return result;
+}
+
+int writeDedupMember(IngestPool *pool, IngestJob *job, int sourceFd, int tarFd, char *buffer)
+{
+    unsigned int numData = (job->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int listSize = dedupListSize(job->file_size);
+    // Una lista en un bloque de colas tiene un solo CRC, que se combina al terminar
+    unsigned int listBlocks = (job->flags & FAT_TAIL) ? 1 : (listSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    char *scratch = buffer + BLOCK_SIZE;
+    job->list = malloc(listSize + sizeof(unsigned int));
+    job->blocks = calloc(listBlocks + numData + 1, sizeof(BlockInfo));
+
+    for (unsigned int i = 0; i < numData; i++)
+    {
+        unsigned int length = blockLength(job->file_size, i);
+        if (readFully(sourceFd, buffer, length) != (ssize_t)length)
+        {
+            return -1;
+        }
+
+        // Buscar el contenido en el indice; si no esta se reserva un bloque nuevo
+        unsigned long long hash = fingerprintBlock(buffer, length);
+        DedupIndex *index = &pool->fatTable->dedup;
+        pthread_mutex_lock(&pool->dedupLock);
+        DedupEntry *existing = findDuplicateBlock(index, tarFd, hash, buffer, length, scratch);
+        if (existing != NULL)
+        {
+            existing->refs++;
+            index->dirty = 1;
+            job->list[i] = existing->block;
+        }
+        else
+        {
+            DedupEntry entry = {hash, allocateBlocks(pool->fatTable, 1), 1};
+            insertDedupEntry(index, entry);
+            job->list[i] = entry.block;
+        }
+        job->list_count++;
+        pthread_mutex_unlock(&pool->dedupLock);
+
+        // Solo se escriben los bloques nuevos; el CRC sale del buffer que ya se tiene
+        if (existing == NULL)
+        {
+            if (pwrite(tarFd, buffer, length, blockOffset(job->list[i])) != length)
+            {
+                return -1;
+            }
+            job->blocks[listBlocks + i].crc = crc32cUpdate(0, buffer, length);
+            job->blocks[listBlocks + i].length = length;
+        }
+    }
+
+    // La lista ocupa un multiplo de TAIL_ALIGN: en un bloque de colas no necesita relleno
+    if (pwrite(tarFd, job->list, listSize, blockOffset(job->starting_block) + job->tail_offset) != (ssize_t)listSize)
+    {
+        return -1;
+    }
+    job->stored_size = listSize;
+    if (job->flags & FAT_TAIL)
+    {
+        job->blocks[0].crc = crc32cUpdate(0, (char *)job->list, listSize);
+        job->blocks[0].length = listSize;
+        return 0;
+    }
+    ExtentCrc check;
+    startExtentCrc(&check, job->blocks, listBlocks);
+    checksumBytes(&check, 0, (char *)job->list, listSize);
+    finishExtentCrc(&check);
+    return 0;
+}
+
+int writeSparseMember(IngestJob *job, int sourceFd, int tarFd, char *buffer)
+{
+    // El mapa de regiones y despues solo los bytes con datos
+    unsigned long long mapSize = sparseDataStart(job->num_regions);
+    unsigned long long count = job->num_regions;
+    char *map = calloc(1, mapSize);
+    memcpy(map, &count, sizeof(count));
+    memcpy(map + sizeof(count), job->regions, count * sizeof(SparseRegion));
+    off_t base = blockOffset(job->starting_block);
+    job->blocks = calloc(job->num_blocks + 1, sizeof(BlockInfo));
+    ExtentCrc check;
+    startExtentCrc(&check, job->blocks, job->num_blocks);
+    int result = pwrite(tarFd, map, mapSize, base) == (ssize_t)mapSize ? 0 : -1;
+    checksumBytes(&check, 0, map, mapSize);
+    free(map);
+    for (unsigned int i = 0; result == 0 && i < job->num_regions; i++)
+    {
+        SparseRegion *region = &job->regions[i];
+        if (copyExtentRange(sourceFd, region->offset, tarFd, base + region->position, region->length, buffer, &check, region->position) != (off_t)region->length)
+        {
+            result = -1;
+        }
+    }
+    finishExtentCrc(&check);
+    return result;
+}
+
+int writeTailMember(IngestJob *job, int sourceFd, int tarFd, char *buffer)
+{
+    // Copiar al bloque de colas por el buffer, rellenado con ceros hasta la alineacion
+    off_t base = blockOffset(job->starting_block) + job->tail_offset;
+    unsigned int aligned = (job->file_size + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+    if (readFully(sourceFd, buffer, job->file_size) != (ssize_t)job->file_size)
+    {
+        return -1;
+    }
+    memset(buffer + job->file_size, 0, aligned - job->file_size);
+    if (pwrite(tarFd, buffer, aligned, base) != aligned)
+    {
+        return -1;
+    }
+
+    // CRC de la parte propia; al terminar se combina con el del bloque
+    job->blocks = malloc(sizeof(BlockInfo));
+    job->blocks[0].crc = crc32cUpdate(0, buffer, aligned);
+    job->blocks[0].length = aligned;
+    return 0;
+}
+
+int writePlainMember(IngestJob *job, int sourceFd, int tarFd, char *buffer)
+{
+    // CRC de cada bloque con los datos que pasan por la copia, sin releerlos
+    job->blocks = calloc(job->num_blocks + 1, sizeof(BlockInfo));
+    ExtentCrc check;
+    startExtentCrc(&check, job->blocks, job->num_blocks);
+    off_t copied = copyExtentRange(sourceFd, 0, tarFd, blockOffset(job->starting_block), job->file_size, buffer, &check, 0);
+    finishExtentCrc(&check);
+    return copied == (off_t)job->file_size ? 0 : -1;
+}
+
+void writeFileToTar(IngestPool *pool, IngestJob *job, int tarFd, char *buffer)
+{
+    unsigned long long start = statStart();
+    int sourceFd = open(job->filename, O_RDONLY);
+    if (sourceFd < 0)
+    {
+        snprintf(job->message, sizeof(job->message), "ERROR: No se encontro el archivo %s\n", job->filename);
+        job->failed = 1;
+        return;
+    }
+
+    // Copiar el archivo a su extension; el CRC de cada bloque se calcula al copiar
+    posix_fadvise(sourceFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (job->flags & FAT_DEDUP)
+    {
+        if (writeDedupMember(pool, job, sourceFd, tarFd, buffer) != 0)
+        {
+            snprintf(job->message, sizeof(job->message), "ERROR: no se pudo copiar completo el archivo %s\n", job->filename);
+            job->failed = 1;
+        }
+    }
+    else if (job->flags & FAT_TAIL)
+    {
+        if (writeTailMember(job, sourceFd, tarFd, buffer) != 0)
+        {
+            snprintf(job->message, sizeof(job->message), "ERROR: no se pudo copiar completo el archivo %s\n", job->filename);
+            job->failed = 1;
+        }
+    }
+    else if (job->flags & FAT_SPARSE)
+    {
+        if (writeSparseMember(job, sourceFd, tarFd, buffer) != 0)
+        {
+            snprintf(job->message, sizeof(job->message), "ERROR: no se pudo copiar completo el archivo %s\n", job->filename);
+            job->failed = 1;
+        }
+    }
+    else if (job->flags & FAT_COMPRESSED)
+    {
+        if (writeCompressedMember(job, sourceFd, tarFd, buffer) != 0)
+        {
+            snprintf(job->message, sizeof(job->message), "ERROR: no se pudo copiar completo el archivo %s\n", job->filename);
+            job->failed = 1;
+        }
+    }
+    else if (writePlainMember(job, sourceFd, tarFd, buffer) != 0)
+    {
+        snprintf(job->message, sizeof(job->message), "ERROR: no se pudo copiar completo el archivo %s\n", job->filename);
+        job->failed = 1;
+    }
+    // El origen no se vuelve a leer: no ensuciar la cache de paginas
+    posix_fadvise(sourceFd, 0, 0, POSIX_FADV_DONTNEED);
+    close(sourceFd);
+    statEnd(STAT_COPY, start);
+
+    if (job->failed)
+    {
+        return;
+    }
+    if (verbose == 1)
+    {
+        snprintf(job->message, sizeof(job->message), "Archivo agregado al TAR: %s\n", job->filename);
+    }
+    else if (verbose == 2)
+    {
+        snprintf(job->message, sizeof(job->message), "Archivo agregado al TAR: %s, Tamaño: %llu bytes, Bloques iniciales: %u, Bloques: %u\n", job->filename, job->file_size, job->starting_block, job->used_blocks);
+    }
+    statMember(job->filename, job->file_size, start);
+}
+
+void *ingestWorker(void *arg)
+{
+    IngestPool *pool = arg;
+    // Descriptor propio para cada hilo
+    int tarFd = open(pool->tarFilename, O_RDWR);
+    char *buffer = malloc(2 * BLOCK_SIZE);
+    while (1)
+    {
+        // Esperar el siguiente archivo planificado o el fin de la planificacion
+        pthread_mutex_lock(&pool->queueLock);
+        while (pool->next >= pool->numJobs && pool->planning)
+        {
+            pthread_cond_wait(&pool->jobReady, &pool->queueLock);
+        }
+        if (pool->next >= pool->numJobs)
+        {
+            pthread_mutex_unlock(&pool->queueLock);
+            break;
+        }
+        IngestJob *job = ingestJobAt(pool, pool->next++);
+        pthread_mutex_unlock(&pool->queueLock);
+
+        if (tarFd < 0)
+        {
+            snprintf(job->message, sizeof(job->message), "ERROR: no se pudo abrir el archivo TAR %s\n", pool->tarFilename);
+            job->failed = 1;
+            continue;
+        }
+        writeFileToTar(pool, job, tarFd, buffer);
+    }
+    free(buffer);
+    if (tarFd >= 0)
+    {
+        close(tarFd);
+    }
+    return NULL;
+}
+
+unsigned long long sparseDataStart(unsigned long long numRegions)
+{
+    unsigned long long mapSize = sizeof(unsigned long long) + numRegions * sizeof(SparseRegion);
+    return (mapSize + SPARSE_ALIGN - 1) / SPARSE_ALIGN * SPARSE_ALIGN;
+}
+
+int findSparseRegions(int fd, unsigned long long size, SparseRegion **regions)
+{
+    // Regiones con datos segun SEEK_DATA/SEEK_HOLE. Devuelve -1 si el sistema
+    // de archivos no lo soporta o los huecos no suman al menos un bloque.
+    struct stat st;
+    *regions = NULL;
+    if (fstat(fd, &st) != 0 || (unsigned long long)st.st_blocks * 512 + BLOCK_SIZE > size)
+    {
+        return -1;
+    }
+
+    SparseRegion *list = NULL;
+    unsigned int count = 0, capacity = 0;
+    unsigned long long dataBytes = 0;
+    off_t position = 0;
+    while ((unsigned long long)position < size)
+    {
+        off_t data = lseek(fd, position, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+        {
+            break; // Solo queda un hueco hasta el final
+        }
+        off_t hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+        if (hole < 0)
+        {
+            free(list);
+            lseek(fd, 0, SEEK_SET);
+            return -1;
+        }
+        if ((unsigned long long)hole > size)
+        {
+            hole = size;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            list = realloc(list, capacity * sizeof(SparseRegion));
+        }
+        list[count].offset = data;
+        list[count].length = hole - data;
+        dataBytes += hole - data;
+        count++;
+        position = hole;
+    }
+    lseek(fd, 0, SEEK_SET);
+    if (size - dataBytes < BLOCK_SIZE)
+    {
+        free(list);
+        return -1;
+    }
+
+    unsigned long long stored = sparseDataStart(count);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        list[i].position = stored;
+        stored += list[i].length;
+    }
+    *regions = list != NULL ? list : malloc(sizeof(SparseRegion));
+    return count;
+}
+
+off_t readPlainMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt)
+{
+    // Cada bloque se revisa con su CRC al pasar por la copia, antes de escribirlo
+    ExtentCrc check;
+    off_t copied = 0;
+    if (loadExtentCrc(&check, tarFd, super, entry->starting_block, entry->num_blocks) == 0)
+    {
+        copied = copyExtentRange(tarFd, blockOffset(entry->starting_block), outFd, 0, entry->file_size, buffer, &check, 0);
+    }
+    *corrupt = finishExtentCrc(&check);
+    return copied;
+}
+
+off_t readSparseMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt)
+{
+    // Los huecos se recrean fijando el tamanno final: solo se escriben las regiones con datos
+    off_t base = blockOffset(entry->starting_block);
+    unsigned long long count;
+    *corrupt = -1;
+    if (pread(tarFd, &count, sizeof(count), base) != sizeof(count) ||
+        sparseDataStart(count) > (unsigned long long)entry->num_blocks * BLOCK_SIZE)
+    {
+        return 0;
+    }
+    unsigned long long mapSize = sparseDataStart(count);
+    char *map = malloc(mapSize);
+    ExtentCrc check;
+    if (loadExtentCrc(&check, tarFd, super, entry->starting_block, entry->num_blocks) != 0 ||
+        pread(tarFd, map, mapSize, base) != (ssize_t)mapSize || checksumBytes(&check, 0, map, mapSize) != 0)
+    {
+        *corrupt = finishExtentCrc(&check);
+        free(map);
+        return 0;
+    }
+    if (ftruncate(outFd, entry->file_size) != 0)
+    {
+        finishExtentCrc(&check);
+        free(map);
+        return -1;
+    }
+    SparseRegion *regions = (SparseRegion *)(map + sizeof(count));
+    off_t written = entry->file_size;
+    for (unsigned long long i = 0; i < count; i++)
+    {
+        if (copyExtentRange(tarFd, base + regions[i].position, outFd, regions[i].offset, regions[i].length, buffer, &check, regions[i].position) != (off_t)regions[i].length)
+        {
+            written = regions[i].offset;
+            break;
+        }
+    }
+    *corrupt = finishExtentCrc(&check);
+    free(map);
+    return written;
+}
+
+off_t readCompressedMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt)
+{
+    unsigned int numBlocks = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int mapSize = blockMapSize(entry->file_size);
+    unsigned long long *blockMap = malloc(mapSize);
+    off_t base = blockOffset(entry->starting_block);
+    char *compressed = buffer + BLOCK_SIZE;
+    off_t written = 0;
+
+    // El mapa y cada trozo se revisan con su CRC antes de usarlos
+    ExtentCrc check;
+    if (loadExtentCrc(&check, tarFd, super, entry->starting_block, entry->num_blocks) != 0 ||
+        pread(tarFd, blockMap, mapSize, base) != (ssize_t)mapSize || checksumBytes(&check, 0, (char *)blockMap, mapSize) != 0)
+    {
+        *corrupt = finishExtentCrc(&check);
+        free(blockMap);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < numBlocks; i++)
+    {
+        unsigned int rawLength = blockLength(entry->file_size, i);
+        unsigned long long length = blockMap[i + 1] - blockMap[i];
+        if (blockMap[i + 1] < blockMap[i] || length > rawLength ||
+            pread(tarFd, compressed, length, base + blockMap[i]) != (ssize_t)length ||
+            checksumBytes(&check, blockMap[i], compressed, length) != 0)
+        {
+            break;
+        }
+
+        // Bloques del mismo tamanno que el original se guardaron sin comprimir
+        char *data = compressed;
+        if (length < rawLength)
+        {
+            if (decompressBlock(entry->flags & FAT_COMPRESSED, compressed, length, buffer, rawLength) != 0)
+            {
+                written = -1;
+                break;
+            }
+            data = buffer;
+        }
+        if (pwrite(outFd, data, rawLength, (off_t)i * BLOCK_SIZE) != rawLength)
+        {
+            written = -1;
+            break;
+        }
+        written += rawLength;
+    }
+    *corrupt = finishExtentCrc(&check);
+    free(blockMap);
+    return written;
+}
+
+off_t readDedupMember(int tarFd, SuperBlock *super, FatEntry *entry, const char *tailBlock, int outFd, char *buffer, int *corrupt)
+{
+    // La lista y cada bloque compartido se revisan con su CRC al leerlos;
+    // los bloques de datos estan fuera de la extension del archivo. Una lista
+    // corta sale de tailBlock, el bloque de colas que el llamador ya verifico.
+    unsigned int numData = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int listSize = dedupListSize(entry->file_size);
+    unsigned int *list = malloc(listSize + sizeof(unsigned int));
+    off_t written = 0;
+    ExtentCrc check;
+    *corrupt = -1;
+    if (entry->flags & FAT_TAIL)
+    {
+        memcpy(list, tailBlock + entry->tail_offset * TAIL_ALIGN, listSize);
+    }
+    else if (loadExtentCrc(&check, tarFd, super, entry->starting_block, entry->num_blocks) != 0 ||
+             pread(tarFd, list, listSize, blockOffset(entry->starting_block)) != (ssize_t)listSize ||
+             checksumBytes(&check, 0, (char *)list, listSize) != 0)
+    {
+        *corrupt = finishExtentCrc(&check);
+        free(list);
+        return 0;
+    }
+    else
+    {
+        *corrupt = finishExtentCrc(&check);
+    }
+    for (unsigned int i = 0; *corrupt < 0 && i < numData; i++)
+    {
+        unsigned int length = blockLength(entry->file_size, i);
+        off_t copied = 0;
+        if (loadExtentCrc(&check, tarFd, super, list[i], 1) == 0)
+        {
+            copied = copyExtentRange(tarFd, blockOffset(list[i]), outFd, (off_t)i * BLOCK_SIZE, length, buffer, &check, 0);
+        }
+        *corrupt = finishExtentCrc(&check);
+        if (copied < 0)
+        {
+            free(list);
+            return -1;
+        }
+        written += copied;
+        if (copied < length)
+        {
+            break;
+        }
+    }
+    free(list);
+    return written;
+}
+
+int readTailBlock(int tarFd, SuperBlock *super, TailMap *tails, unsigned int block, char *buffer)
+{
+    // Leer un bloque de colas completo; devuelve el bloque si no coincide su
+    // CRC, que cuenta los espacios libres como ceros
+    BlockInfo info = {0, 0};
+    if (block < super->btab_num_blocks * BLOCK_INFO_PER_BLOCK)
+    {
+        pread(tarFd, &info, sizeof(BlockInfo), blockOffset(super->btab_start_block) + (off_t)block * sizeof(BlockInfo));
+    }
+    unsigned int length = info.length > 0 && info.length <= BLOCK_SIZE ? info.length : BLOCK_SIZE;
+    ssize_t bytesRead = pread(tarFd, buffer, length, blockOffset(block));
+    if (bytesRead < 0)
+    {
+        bytesRead = 0;
+    }
+    memset(buffer + bytesRead, 0, BLOCK_SIZE - bytesRead);
+    maskTailHoles(tails, block, buffer, bytesRead);
+    if (info.length > 0 && (bytesRead != info.length || crc32cUpdate(0, buffer, info.length) != info.crc))
+    {
+        return block;
+    }
+    return -1;
+}
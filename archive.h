@@ -0,0 +1,590 @@
+// Formato del TAR y funciones internas compartidas por la biblioteca
+// (archive.c, libtar.c) y la linea de comandos (main.c).
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+
+#define BLOCK_SIZE 262144   // 256 kB
+#define HEADER_SIZE 4096    // Espacio reservado para el superbloque
+#define DIR_PAGE_SIZE 4096  // Tamanno de una pagina del directorio
+#define DIR_MAX_LOAD 75     // Porcentaje maximo de ocupacion del directorio
+#define FORMAT_VERSION "04" // Version del formato en disco (dos copias del superbloque)
+#define PREVIOUS_VERSION "03" // Una sola copia del superbloque: se lee igual
+#define LEGACY_VERSION "02" // Version anterior: se convierte al abrir
+#define SUPER_COPY_OFFSET 2048 // Segunda copia del superbloque (transacciones impares)
+#define STREAM_VERSION "S4" // Version del formato de flujo (-f -, nombres largos)
+#define STREAM_LEGACY_VERSION "S3" // Flujo anterior, sin nombres largos: se sigue leyendo
+#define COPY_CHUNK (64 * 1024 * 1024)      // Maximo por llamada del motor de copia
+
+extern int verbose;                // Nivel de mensajes (-v)
+extern unsigned char compression;  // Codec para los archivos nuevos (-z)
+extern unsigned char deduplicate;  // Compartir bloques repetidos (--dedup)
+extern unsigned char ioBackend;    // Backend del motor de copia (--io)
+extern unsigned char ioSqPoll;     // Hilo del kernel que consume la cola (--sqpoll)
+
+#define IO_SYNC 0  // Llamadas bloqueantes (copy_file_range, sendfile, pread/pwrite)
+#define IO_URING 1 // Muchas lecturas y escrituras en vuelo con io_uring
+
+// Nombre de mas de 12 caracteres: el registro guarda su huella y su
+// posicion en la tabla de cadenas (FAT_LONG_NAME)
+typedef struct LongName
+{
+    unsigned int hash;   // hashFilename del nombre completo
+    unsigned int offset; // Posicion del nombre en la tabla de cadenas
+    unsigned int length; // Largo del nombre sin el '\0'
+} LongName;
+
+typedef struct FatEntry
+{
+    union
+    {
+        char filename[12];       // Nombre del archivo (hasta 12 caracteres)
+        LongName name;           // Nombre en la tabla de cadenas (FAT_LONG_NAME)
+    };
+    unsigned int starting_block; // Bloque inicial
+    unsigned int num_blocks;     // Tamanno en bloques
+    unsigned char is_empty;      // Flag que indica si esta vacio
+    unsigned char flags;         // Formato de los datos (FAT_LZ, FAT_ZSTD, FAT_DEDUP, FAT_TAIL, FAT_SPARSE) y FAT_LONG_NAME
+    unsigned short tail_offset;  // Posicion en el bloque compartido (FAT_TAIL), en unidades de TAIL_ALIGN
+    unsigned long long file_size; // Tamanno en bytes
+} FatEntry;
+
+#define FAT_LZ 0x01                        // Bloques comprimidos con el LZ interno
+#define FAT_ZSTD 0x02                      // Bloques comprimidos con zstd
+#define FAT_COMPRESSED (FAT_LZ | FAT_ZSTD) // El archivo tiene mapa de bloques
+#define FAT_DEDUP 0x04                     // La extension es la lista de bloques compartidos
+#define FAT_TAIL 0x08                      // Archivo pequenno (o lista corta de FAT_DEDUP) dentro de un bloque compartido
+#define TAIL_ALIGN 4                       // Alineacion de los archivos en un bloque compartido
+#define FAT_SPARSE 0x10                    // La extension empieza con el mapa de regiones con datos
+#define FAT_LONG_NAME 0x20                 // El nombre esta en la tabla de cadenas
+#define FAT_LAYOUT_FLAGS 0x1f              // Bits de flags que describen los datos
+
+// Archivo disperso (FAT_SPARSE): la extension empieza con la cantidad de
+// regiones (8 bytes) y las regiones; los datos de las regiones van despues,
+// seguidos, desde sparseDataStart. Los huecos no ocupan espacio en el TAR.
+typedef struct SparseRegion
+{
+    unsigned long long offset;   // Posicion de los datos dentro del archivo
+    unsigned long long length;   // Bytes con datos
+    unsigned long long position; // Posicion de los datos dentro de la extension
+} SparseRegion;
+
+#define SPARSE_ALIGN 4096 // Alineacion del inicio de los datos de un archivo disperso
+
+#define DIR_PAGE_ENTRIES ((DIR_PAGE_SIZE - 2 * sizeof(unsigned int)) / sizeof(FatEntry))
+#define DIR_PAGES_PER_BLOCK (BLOCK_SIZE / DIR_PAGE_SIZE)
+
+typedef struct DirPage
+{
+    unsigned int count;                 // Registros ocupados en la pagina
+    unsigned int reserved;              // Sin uso
+    FatEntry entries[DIR_PAGE_ENTRIES]; // Registros de la pagina
+} DirPage;
+
+typedef struct TarHeader
+{
+    char magic_number[6];       // Numero magico para identificar el TAR
+    char version_number[2];     // No. de version
+    char user_name[100];        // Nombre de usuario
+    char group_name[100];       // Nombre del grupo
+    char modification_time[12]; // Hora de modificacion
+    char checksum[8];           // Checksum
+    char file_size[12];         // Tamanno en bytes
+    char block_size[12];        // Tamanno en bloques
+    char linked_tar_file[100];  // Nombre del archivo TAR
+    char prefix[155];           // Prefijo para los archivos
+} TarHeader;
+
+typedef struct SuperBlock
+{
+    TarHeader header;             // Encabezado del TAR
+    unsigned int block_size;      // Tamanno de bloque usado al crear el TAR
+    unsigned int num_entries;     // Registros ocupados en el directorio
+    unsigned int dir_buckets;     // Paginas del directorio (hash lineal)
+    unsigned int dir_start_block; // Primer bloque del directorio
+    unsigned int dir_num_blocks;  // Bloques reservados para el directorio
+    unsigned int next_free_block; // Primer bloque que nunca se ha usado
+    unsigned int fmap_start_block; // Primer bloque del mapa de espacio libre
+    unsigned int fmap_num_blocks;  // Bloques reservados para el mapa
+    unsigned int fmap_count;       // Cantidad de extensiones libres
+    unsigned int btab_start_block; // Primer bloque de la tabla de bloques
+    unsigned int btab_num_blocks;  // Bloques reservados para la tabla
+    unsigned int dedup_start_block; // Primer bloque del indice de deduplicacion
+    unsigned int dedup_num_blocks;  // Bloques reservados para el indice
+    unsigned int dedup_count;       // Cantidad de bloques compartidos
+    unsigned int tail_start_block;  // Primer bloque del mapa de bloques de colas
+    unsigned int tail_num_blocks;   // Bloques reservados para el mapa
+    unsigned int tail_count;        // Cantidad de bloques de colas
+    unsigned int journal_start_block; // Primer bloque del diario de metadatos
+    unsigned int journal_num_blocks;  // Bloques reservados para el diario
+    unsigned int journal_sequence;    // Transaccion que escribio este superbloque
+    unsigned int journal_offset;      // Posicion de esa transaccion en el diario
+    unsigned int strtab_start_block;  // Primer bloque de la tabla de cadenas
+    unsigned int strtab_num_blocks;   // Bloques reservados para la tabla
+    unsigned int tail_hole_count;     // Huecos dentro de los bloques de colas
+} SuperBlock;
+
+// Tabla de bloques: un registro por bloque fisico del TAR con el CRC32C de
+// los bytes usados del bloque. length == 0 indica un bloque sin datos
+// verificables (libre o de metadatos).
+typedef struct BlockInfo
+{
+    unsigned int crc;    // CRC32C de los primeros length bytes
+    unsigned int length; // Bytes usados del bloque
+} BlockInfo;
+
+#define BLOCK_INFO_PER_PAGE (DIR_PAGE_SIZE / sizeof(BlockInfo))
+#define BLOCK_INFO_PER_BLOCK (BLOCK_SIZE / sizeof(BlockInfo))
+
+typedef struct Extent
+{
+    unsigned int start;  // Primer bloque
+    unsigned int length; // Cantidad de bloques
+} Extent;
+
+// Mapa de espacio libre: cada hueco esta a la vez en dos arboles AVL, uno
+// por posicion (para unir vecinos y buscar el primer hueco donde cabe algo)
+// y otro por (tamanno, posicion) para el mejor ajuste. En disco es el
+// arreglo de huecos ordenado por posicion.
+#define FREE_BY_START 0
+#define FREE_BY_SIZE 1
+
+typedef struct FreeNode
+{
+    Extent extent;                // Hueco
+    struct FreeNode *child[2][2]; // Hijos izquierdo y derecho en cada arbol
+    unsigned char height[2];      // Altura del subarbol en cada arbol
+    unsigned int maxLength;       // Hueco mas grande del subarbol por posicion
+} FreeNode;
+
+typedef struct FreeMap
+{
+    FreeNode *root[2];    // Raices de los arboles por posicion y por tamanno
+    unsigned int count;   // Cantidad de huecos
+    unsigned char loaded; // El mapa ya se leyo del TAR
+    unsigned char dirty;  // El mapa fue modificado
+} FreeMap;
+
+typedef struct DedupEntry
+{
+    unsigned long long hash; // Huella del contenido del bloque
+    unsigned int block;      // Bloque fisico con el contenido
+    unsigned int refs;       // Archivos que usan el bloque
+} DedupEntry;
+
+// Indice de deduplicacion: los bloques compartidos ordenados por bloque
+// (para llevar las referencias, que solo son validas en byBlock) y por
+// huella (para encontrar contenido repetido).
+typedef struct DedupIndex
+{
+    DedupEntry *byBlock;   // Bloques ordenados por numero de bloque
+    DedupEntry *byHash;    // Bloques ordenados por (huella, bloque)
+    unsigned int count;    // Cantidad de bloques compartidos
+    unsigned int capacity; // Capacidad de los arreglos
+    unsigned char loaded;  // El indice ya se leyo del TAR
+    unsigned char dirty;   // El indice fue modificado
+} DedupIndex;
+
+typedef struct TailBlock
+{
+    unsigned int block;   // Bloque compartido
+    unsigned int fill;    // Bytes desde el inicio hasta el espacio libre del final
+    unsigned int members; // Archivos guardados en el bloque
+} TailBlock;
+
+typedef struct TailHole
+{
+    unsigned int block;  // Bloque de colas
+    unsigned int offset; // Primer byte libre
+    unsigned int length; // Bytes libres
+} TailHole;
+
+typedef struct TailSpace
+{
+    TailBlock tail;        // Registro del bloque (la forma en disco)
+    FreeMap runs;          // Espacios libres del bloque en bytes, incluido el del final
+    unsigned char retired; // -p lo esta vaciando: no recibe archivos nuevos
+} TailSpace;
+
+// Bloques que guardan varios archivos pequennos uno detras de otro,
+// ordenados por numero de bloque. El espacio de un archivo borrado se
+// reutiliza: space indexa cada bloque por su espacio libre mas grande para
+// el mejor ajuste. En disco van los TailBlock y despues los huecos
+// interiores (TailHole). El CRC de un bloque de colas se calcula con sus
+// espacios libres en cero, asi que escribir en un espacio libre no invalida
+// el CRC confirmado; por eso lo liberado queda en held hasta guardar la FAT
+// que ya no lo usa. Un bloque se libera cuando no le quedan archivos.
+typedef struct TailMap
+{
+    TailSpace *blocks;         // Bloques de colas ordenados por bloque
+    unsigned int count;        // Cantidad de bloques
+    unsigned int capacity;     // Capacidad del arreglo
+    FreeMap space;             // (bloque, espacio libre mas grande) de los que reciben archivos
+    TailHole *held;            // Liberado desde el ultimo guardado
+    unsigned int numHeld;      // Espacios en held
+    unsigned int heldCapacity; // Capacidad de held
+    unsigned char loaded;      // El mapa ya se leyo del TAR
+    unsigned char dirty;       // El mapa fue modificado
+} TailMap;
+
+// Tabla de cadenas: los nombres de mas de 12 caracteres uno detras de otro,
+// terminados en '\0'. En disco la extension empieza con los bytes usados
+// (8 bytes). Los nombres de archivos borrados quedan hasta compactar (-p).
+#define MAX_NAME_LENGTH 4095 // Largo maximo de un nombre (ruta relativa)
+
+typedef struct StringTable
+{
+    char *data;                 // Nombres
+    unsigned long long length;   // Bytes usados
+    unsigned long long saved;    // Bytes que ya estan en disco
+    unsigned long long capacity; // Capacidad de data
+    unsigned char loaded;        // La tabla ya se leyo del TAR
+} StringTable;
+
+// Diario de metadatos. Cada vez que se guarda la FAT, todas las escrituras
+// de metadatos forman una transaccion: se escribe en el diario, se hace un
+// solo fdatasync y despues se aplica en su lugar. Al abrir el TAR se
+// vuelven a aplicar las transacciones completas que siguen a la que
+// escribio el superbloque; las incompletas no pasan el CRC y se descartan.
+// Una transaccion que no cabe agranda el diario (growJournal) y, ya
+// confirmada, el diario vuelve a JOURNAL_BLOCKS (shrinkJournal).
+// El superbloque de cada transaccion va a la copia de su paridad (en 0 o
+// en SUPER_COPY_OFFSET), asi la otra sigue intacta si su escritura se corta:
+// al abrir se usa la copia valida mas nueva y el diario completa el resto.
+#define JOURNAL_BLOCKS 4      // Bloques reservados para el diario
+#define JOURNAL_MAGIC "JTXN"  // Inicio de una transaccion
+
+typedef struct JournalHeader
+{
+    char magic[4];         // JOURNAL_MAGIC
+    unsigned int sequence; // Numero de la transaccion
+    unsigned int records;  // Cantidad de registros
+    unsigned int length;   // Bytes de registros despues del encabezado
+    unsigned int crc;      // CRC32C de los registros
+    unsigned int reserved; // Sin uso
+} JournalHeader;
+
+typedef struct JournalRecord
+{
+    unsigned long long offset; // Posicion de los datos en el TAR
+    unsigned int length;       // Bytes de datos despues del registro
+    unsigned int reserved;     // Sin uso
+} JournalRecord;
+
+// Directorio hash paginado. Las paginas se leen del TAR solo cuando se
+// necesitan, de modo que buscar un archivo cuesta una sola lectura.
+typedef struct FatTable
+{
+    int fd;                   // Descriptor del archivo TAR
+    SuperBlock super;         // Copia en memoria del superbloque
+    DirPage **pages;          // Paginas cargadas (NULL si no se han leido)
+    unsigned char *dirty;     // Paginas modificadas
+    unsigned int pageCapacity; // Tamanno de pages y dirty
+    unsigned char superDirty; // Superbloque modificado
+    FreeMap freeMap;          // Huecos disponibles (se carga bajo demanda)
+    BlockInfo **blockPages;   // Paginas de la tabla de bloques cargadas
+    unsigned char *blockDirty; // Paginas de la tabla de bloques modificadas
+    unsigned int numBlockPages; // Tamanno de los dos arreglos anteriores
+    DedupIndex dedup;         // Bloques compartidos (se carga bajo demanda)
+    TailMap tails;            // Bloques de colas (se carga bajo demanda)
+    StringTable strings;      // Nombres largos (se carga bajo demanda)
+    char *journal;            // Transaccion en curso (empieza con su encabezado)
+    unsigned int journalLength;   // Bytes usados de journal
+    unsigned int journalCapacity; // Capacidad de journal
+    unsigned int journalRecords;  // Registros en la transaccion
+    unsigned int journalHead;     // Posicion de la proxima transaccion en el diario
+    unsigned int journalSequence; // Numero de la proxima transaccion
+    unsigned char journalMoved;   // El diario cambio de lugar en la transaccion en curso
+    unsigned char lazySave;       // saveFatTableToFile deja los cambios en memoria (--serve, -p)
+    unsigned char singleSuper;    // En disco solo esta la copia 0 del superbloque (formato 03 o 02)
+    unsigned int diskEnd;         // next_free_block de la FAT confirmada en disco
+    Extent *heldFree;             // Liberado desde el ultimo guardado (la FAT en disco aun lo usa)
+    unsigned int numHeldFree;     // Extensiones en heldFree
+    unsigned int heldFreeCapacity; // Capacidad de heldFree
+} FatTable;
+
+// TAR que el servidor (--serve) mantiene abiertos entre operaciones. openTar
+// entrega una copia de la FatTable en cache y closeTar la devuelve; la FAT
+// se escribe en disco con flushCachedArchives.
+#define MAX_CACHED_ARCHIVES 16
+
+typedef struct CachedArchive
+{
+    dev_t device;              // Identidad del archivo TAR
+    ino_t inode;
+    FatTable fatTable;         // Directorio, mapas y tablas en memoria
+    unsigned char modified;    // Hay cambios sin guardar
+    unsigned long long lastUse; // Para descartar el menos usado
+} CachedArchive;
+
+extern unsigned char keepArchivesOpen; // openTar y closeTar usan la cache (--serve)
+
+typedef struct IngestJob
+{
+    char *filename;              // Archivo de origen (su nombre en el TAR es memberName)
+    unsigned long long file_size; // Tamanno en bytes al planificar
+    unsigned int starting_block; // Extension reservada en el TAR
+    unsigned int num_blocks;     // Bloques reservados
+    unsigned int used_blocks;    // Bloques realmente usados (menos si se comprimio)
+    unsigned long long stored_size; // Bytes escritos en la extension
+    BlockInfo *blocks;           // CRC de cada bloque escrito
+    unsigned int *list;          // Bloques de datos de un archivo deduplicado
+    unsigned int tail_offset;    // Byte donde empieza dentro del bloque de colas
+    unsigned int list_count;     // Referencias ya tomadas en el indice
+    SparseRegion *regions;       // Regiones con datos de un archivo disperso
+    unsigned int num_regions;    // Cantidad de regiones
+    unsigned char flags;         // Codec de compresion
+    int failed;                  // La copia no se completo
+    char message[256];           // Mensaje a imprimir al terminar
+} IngestJob;
+
+#define INGEST_CHUNK 4096 // Trabajos por trozo de IngestPool
+
+// Los hilos copian mientras el hilo principal sigue planificando: los
+// trabajos se guardan en trozos que no se mueven al crecer la lista.
+typedef struct IngestPool
+{
+    char *tarFilename;    // Cada hilo abre su propio descriptor del TAR
+    IngestJob **chunks;   // Archivos planificados, de INGEST_CHUNK en INGEST_CHUNK
+    unsigned int numChunks; // Trozos reservados
+    unsigned int numJobs; // Archivos listos para copiar
+    unsigned int next;    // Siguiente trabajo libre
+    int planning;         // El hilo principal todavia agrega trabajos
+    FatTable *fatTable;   // Indice y reserva de bloques compartidos (--dedup)
+    pthread_mutex_t dedupLock; // Protege el FAT mientras se planifica y se copia
+    pthread_mutex_t queueLock; // Protege chunks, numJobs, next y planning
+    pthread_cond_t jobReady;   // Hay un trabajo nuevo o termino la planificacion
+} IngestPool;
+
+// Directorio y superbloque
+int openArchive(char *tarFilename, int flags, FatTable *fatTable);
+int openTar(char *tarFilename, int flags, FatTable *fatTable);
+void closeTar(FatTable *fatTable);
+void flushFatTable(FatTable *fatTable);
+void flushCachedArchives();
+int syncCachedArchive(char *tarFilename);
+void reuseCachedBlocks(char *tarFilename);
+void forgetCachedArchive(char *tarFilename, int save);
+int hasUnsavedArchives();
+void closeCachedArchives();
+int createEmptyTar(char *tarFilename);
+void freeFatTable(FatTable *fatTable);
+void saveFatTableToFile(FatTable *fatTable);
+void journalWrite(FatTable *fatTable, const void *data, unsigned int length, off_t offset);
+int shrinkJournal(FatTable *fatTable);
+FatEntry *findFatEntry(FatTable *fatTable, const char *filename);
+FatEntry *addFatEntry(FatTable *fatTable, const char *filename);
+FatEntry *nextFatEntry(FatTable *fatTable, unsigned int *bucket, unsigned int *slot);
+void splitDirectoryPage(FatTable *fatTable);
+void resizeDirectory(FatTable *fatTable, unsigned int newBuckets);
+void markFatEntryDirty(FatTable *fatTable, FatEntry *entry);
+void removeFatEntry(FatTable *fatTable, FatEntry *entry);
+const char *fatEntryName(FatTable *fatTable, const FatEntry *entry, char shortName[13]);
+StringTable *loadStringTable(FatTable *fatTable);
+void compactStringTable(FatTable *fatTable);
+
+// Espacio libre, tabla de bloques, deduplicacion y colas
+off_t blockOffset(unsigned int block);
+FreeMap *loadFreeMap(FatTable *fatTable);
+Extent *bestFitExtent(FreeMap *freeMap, unsigned int num_blocks);
+Extent *freeExtentAfter(FreeMap *freeMap, unsigned int block);
+Extent *freeExtentBefore(FreeMap *freeMap, unsigned int block);
+Extent *firstFittingExtent(FreeMap *freeMap, unsigned int num_blocks, unsigned int limit);
+void clearFreeMap(FreeMap *freeMap);
+unsigned int allocateBlocks(FatTable *fatTable, unsigned int num_blocks);
+int extendBlocks(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks, unsigned int new_blocks);
+int reserveBlocksAt(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks);
+unsigned int reserveFreshBlocks(FatTable *fatTable, unsigned int num_blocks);
+void releaseBlocks(FatTable *fatTable, unsigned int starting_block, unsigned int num_blocks);
+BlockInfo *loadBlockInfo(FatTable *fatTable, unsigned int block);
+void setBlockInfo(FatTable *fatTable, unsigned int block, unsigned int crc, unsigned int length);
+DedupIndex *loadDedupIndex(FatTable *fatTable);
+void insertDedupEntry(DedupIndex *index, DedupEntry entry);
+void removeDedupEntry(DedupIndex *index, DedupEntry entry);
+DedupEntry *findDedupBlock(DedupIndex *index, unsigned int block);
+TailMap *loadTailMap(FatTable *fatTable);
+TailSpace *findTailSpace(TailMap *tails, unsigned int block);
+unsigned int reserveTail(FatTable *fatTable, unsigned int size, unsigned int *offset);
+void releaseTail(FatTable *fatTable, unsigned int block, unsigned int offset, unsigned int size, int live);
+void applyTailChecksum(FatTable *fatTable, unsigned int block, unsigned int offset, unsigned int length, unsigned int oldCrc, unsigned int newCrc);
+int storeTailMember(FatTable *fatTable, FatEntry *entry, const char *data, unsigned int length);
+void settleTailSpace(FatTable *fatTable);
+void retireTailBlock(FatTable *fatTable, unsigned int block, int retired);
+void moveTailBlock(FatTable *fatTable, unsigned int from, unsigned int to);
+void maskTailHoles(TailMap *tails, unsigned int block, char *data, unsigned int length);
+unsigned int dedupListSize(unsigned long long file_size);
+off_t dedupListOffset(const FatEntry *entry);
+unsigned int tailMemberSize(const FatEntry *entry);
+unsigned int blockLength(unsigned long long size, unsigned int block);
+void releaseMemberBlocks(FatTable *fatTable, FatEntry *entry);
+
+// CRC32C y verificacion. ExtentCrc lleva el CRC de cada bloque de una
+// extension con los datos que ya pasan por memoria durante una copia, sin
+// releerlos: al escribir en el TAR se calculan en blocks; al extraer
+// (verify) blocks trae los de la tabla de bloques y cada bloque se revisa
+// al completarse. Los trozos que no empiezan en el limite de un bloque
+// deben llegar en orden.
+typedef struct ExtentCrc
+{
+    BlockInfo *blocks;       // CRC de cada bloque (calculados, o esperados con verify)
+    unsigned int numBlocks;  // Bloques de la extension
+    unsigned int firstBlock; // Primer bloque fisico (verify)
+    int verify;              // Revisar contra blocks en vez de calcularlos
+    int fd;                  // TAR, para leer lo que la copia no trae (verify)
+    unsigned int block;      // Bloque en curso de los trozos parciales (verify)
+    unsigned int crc;        // CRC de lo visto del bloque en curso
+    unsigned int seen;       // Bytes vistos del bloque en curso (0: ninguno pendiente)
+    char *scratch;           // Buffer para los bytes que la copia no trae
+    int corrupt;             // Primer bloque que no coincidio, o -1
+} ExtentCrc;
+
+unsigned int crc32cUpdate(unsigned int crc, const void *data, size_t length);
+unsigned int crc32cCombine(unsigned int crcA, unsigned int crcB, size_t lengthB);
+unsigned int crc32cZeros(size_t length);
+int verifyExtent(int fd, SuperBlock *super, unsigned int starting_block, unsigned int num_blocks, char *buffer);
+void startExtentCrc(ExtentCrc *check, BlockInfo *blocks, unsigned int numBlocks);
+int loadExtentCrc(ExtentCrc *check, int fd, SuperBlock *super, unsigned int firstBlock, unsigned int numBlocks);
+int checksumBytes(ExtentCrc *check, unsigned long long position, const char *data, size_t length);
+int finishExtentCrc(ExtentCrc *check);
+
+// Motor de copia
+int isCopyFallbackError(int error);
+off_t copyFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer);
+off_t cloneFileRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer);
+int copyCheckedPiece(int inFd, off_t inOffset, int outFd, off_t outOffset, const char *data, size_t length, int *useCopyFileRange);
+off_t copyExtentRange(int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, char *buffer, ExtentCrc *check, unsigned long long position);
+ssize_t readFully(int fd, void *buffer, size_t length);
+ssize_t writeFully(int fd, const void *buffer, size_t length);
+
+// Backend io_uring (uring.c); sin soporte del kernel threadIoRing devuelve NULL
+typedef struct IoRing IoRing;
+IoRing *threadIoRing();
+off_t ioRingCopy(IoRing *ring, int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, ExtentCrc *check, unsigned long long position);
+
+// Estadisticas de --stats (stats.c)
+typedef enum StatPhase
+{
+    STAT_FAT_LOAD,       // Leer el superbloque
+    STAT_JOURNAL_REPLAY, // Reaplicar transacciones pendientes
+    STAT_ALLOCATE,       // Reservar y liberar extensiones
+    STAT_COPY,           // Copiar los datos de un archivo
+    STAT_CHECKSUM,       // Calcular o revisar CRC32C
+    STAT_FAT_SAVE,       // Escribir los metadatos
+    STAT_JOURNAL_COMMIT, // Confirmar la transaccion (dentro de STAT_FAT_SAVE)
+    STAT_PHASES
+} StatPhase;
+
+typedef enum StatCall
+{
+    CALL_COPY_FILE_RANGE,
+    CALL_SENDFILE,
+    CALL_SPLICE,
+    CALL_PREAD,  // Solo las del motor de copia
+    CALL_PWRITE, // Solo las del motor de copia
+    CALL_FDATASYNC,
+    CALL_URING_ENTER,
+    CALL_FICLONERANGE,
+    STAT_CALLS
+} StatCall;
+
+typedef struct StatMember
+{
+    char *filename;           // Archivo procesado
+    unsigned long long bytes; // Bytes del archivo
+    unsigned long long nanos; // Duracion de la copia
+} StatMember;
+
+typedef struct TarStats
+{
+    const char *operation;                     // Operacion de la linea de comandos
+    unsigned long long startNanos;             // Inicio del programa
+    unsigned long long phaseNanos[STAT_PHASES]; // Tiempo de cada fase (sumado entre hilos)
+    unsigned long long phaseCount[STAT_PHASES]; // Veces que se entro a cada fase
+    unsigned long long calls[STAT_CALLS];      // Llamadas al sistema contadas
+    unsigned long long callBytes[STAT_CALLS];  // Bytes movidos por esas llamadas
+    StatMember *members;                       // Rendimiento de cada archivo
+    unsigned int numMembers;
+    unsigned int memberCapacity;
+    pthread_mutex_t lock;                      // Protege members
+} TarStats;
+
+extern unsigned char collectStats; // Medir fases y llamadas (--stats)
+extern TarStats tarStats;
+
+unsigned long long monotonicNanos();
+void startStats(const char *operation);
+unsigned long long statStart();
+void statEnd(StatPhase phase, unsigned long long start);
+void statCall(StatCall call, long long bytes);
+void statMember(const char *filename, unsigned long long bytes, unsigned long long start);
+void printStats(FILE *out);
+
+// Servidor de TAR sobre un socket Unix (server.c, con la linea de comandos)
+int runCommand(int argc, char *argv[]);
+int serveArchives(const char *socketPath);
+int runRemoteCommand(const char *socketPath, int argc, char *argv[]);
+
+// Compresion por bloques
+int compressBlock(unsigned char codec, const char *src, int srcLength, char *dst, int dstCapacity);
+int decompressBlock(unsigned char codec, const char *src, int srcLength, char *dst, int dstLength);
+unsigned int blockMapSize(unsigned long long file_size);
+
+// Escritura de archivos en el TAR
+pthread_t *startWorkers(void *(*worker)(void *), void *pool, int jobs);
+void joinWorkers(pthread_t *threads, int jobs);
+void runWorkers(void *(*worker)(void *), void *pool, int jobs, unsigned int numJobs);
+void initIngestPool(IngestPool *pool, char *tarFilename, FatTable *fatTable);
+IngestJob *ingestJobAt(IngestPool *pool, unsigned int i);
+IngestJob *reserveIngestJob(IngestPool *pool);
+void publishIngestJob(IngestPool *pool);
+void closeIngestPool(IngestPool *pool);
+void freeIngestPool(IngestPool *pool);
+void planMemberLayout(FatTable *fatTable, FatEntry *entry, IngestJob *job, unsigned char flags);
+int planFileForTar(char *filename, const struct stat *st, FatTable *fatTable, IngestJob *job);
+void finishIngestJob(FatTable *fatTable, IngestJob *job);
+void addTailChecksum(FatTable *fatTable, IngestJob *job);
+void *ingestWorker(void *arg);
+
+// Recorrido paralelo de directorios (walk.c)
+typedef struct WalkedFile
+{
+    char *path;     // Ruta para abrir el archivo (la libera quien la recibe)
+    struct stat st; // Resultado de fstatat
+} WalkedFile;
+
+typedef struct FileWalk FileWalk;
+FileWalk *startFileWalk(char **paths, int numPaths, int threads);
+int nextWalkedFile(FileWalk *walk, WalkedFile *file);
+unsigned int finishFileWalk(FileWalk *walk);
+const char *memberName(const char *path);
+int isSafeMemberName(const char *name);
+int createParentDirectories(const char *path);
+
+// Archivos dispersos
+int findSparseRegions(int fd, unsigned long long size, SparseRegion **regions);
+unsigned long long sparseDataStart(unsigned long long numRegions);
+off_t readSparseMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt);
+
+// Lectura de archivos del TAR
+off_t readCompressedMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt);
+off_t readDedupMember(int tarFd, SuperBlock *super, FatEntry *entry, const char *tailBlock, int outFd, char *buffer, int *corrupt);
+off_t readPlainMember(int tarFd, SuperBlock *super, FatEntry *entry, int outFd, char *buffer, int *corrupt);
+int readTailBlock(int tarFd, SuperBlock *super, TailMap *tails, unsigned int block, char *buffer);
+
+#endif
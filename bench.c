@@ -0,0 +1,511 @@
+// Pruebas de rendimiento reproducibles del TAR.
+//
+// Genera conjuntos de datos sinteticos (siempre los mismos bytes para la
+// misma semilla), ejecuta el programa tar sobre ellos y mide cada operacion:
+// crear, agregar, listar, extraer, eliminar, actualizar y compactar. El
+// resultado se imprime como JSON en stdout.
+//
+//     ./tarbench --tar ./tar [--scale N] [--samples N] [--rounds N] [--dir D] [-- opciones de tar]
+//
+// Las opciones despues de -- se pasan a cada ejecucion de tar, por ejemplo
+// `-- --io uring` o `-- -z`, para comparar motores contra el camino actual.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 16         // Opciones extra para tar
+#define DEFAULT_SAMPLES 50  // Ejecuciones por operacion de un solo archivo
+#define DEFAULT_ROUNDS 5    // Ejecuciones por operacion sobre todo el TAR
+#define OUTPUT_SIZE 4096    // Salida de tar que se guarda para leer sus cifras
+
+typedef struct Dataset
+{
+    const char *name;      // Nombre en el reporte
+    unsigned int count;    // Cantidad de archivos
+    unsigned int minSize;  // Tamanno minimo en bytes
+    unsigned int maxSize;  // Tamanno maximo (distribucion logaritmica)
+    int fragment;          // Eliminar un archivo de cada dos antes de medir
+} Dataset;
+
+typedef struct Measure
+{
+    const char *operation; // Operacion medida
+    double *samples;       // Duracion de cada ejecucion en segundos
+    unsigned int runs;     // Cantidad de ejecuciones
+    unsigned long long bytes; // Bytes de datos procesados en total
+    unsigned long long files; // Archivos procesados en total
+} Measure;
+
+char *tarPath;                 // Programa a medir (ruta absoluta)
+char *extraArgs[MAX_ARGS];     // Opciones extra para cada ejecucion
+int numExtraArgs = 0;
+
+unsigned long long nextRandom(unsigned long long *state)
+{
+    // xorshift64*: rapido y con la misma secuencia en cualquier maquina
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+void writeSyntheticFile(const char *path, unsigned int size, unsigned long long seed)
+{
+    // Mitad de cada bloque aleatoria y mitad texto repetido, para que -z y
+    // --dedup tengan algo que hacer sin que todo sea comprimible
+    static const char text[] = "lorem ipsum dolor sit amet consectetur adipiscing elit ";
+    unsigned long long state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    char *buffer = malloc(65536);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    unsigned int written = 0;
+    while (fd >= 0 && written < size)
+    {
+        unsigned int chunk = size - written < 65536 ? size - written : 65536;
+        for (unsigned int i = 0; i < chunk; i += 8)
+        {
+            unsigned long long value = nextRandom(&state);
+            for (unsigned int j = 0; j < 8 && i + j < chunk; j++)
+            {
+                buffer[i + j] = (i & 4096) ? text[(i + j) % (sizeof(text) - 1)] : (char)(value >> (8 * j));
+            }
+        }
+        if (write(fd, buffer, chunk) != (ssize_t)chunk)
+        {
+            break;
+        }
+        written += chunk;
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    free(buffer);
+}
+
+unsigned int datasetFileSize(Dataset *dataset, unsigned int index)
+{
+    // Tamannos repartidos en escala logaritmica entre minSize y maxSize
+    if (dataset->count <= 1 || dataset->minSize == dataset->maxSize)
+    {
+        return dataset->maxSize;
+    }
+    unsigned long long state = index + 12345;
+    double fraction = (nextRandom(&state) % 10000) / 10000.0;
+    double logMin = log(dataset->minSize), logMax = log(dataset->maxSize);
+    return (unsigned int)exp(logMin + fraction * (logMax - logMin));
+}
+
+double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double runTarOutput(const char *cwd, char **args, int numArgs, char *output)
+{
+    // Ejecutar tar con las opciones extra; devuelve la duracion o -1. Si
+    // output no es NULL guarda ahi el final de la salida (OUTPUT_SIZE bytes)
+    char **argv = malloc((numArgs + numExtraArgs + 2) * sizeof(char *));
+    int argc = 0;
+    argv[argc++] = tarPath;
+    for (int i = 0; i < numExtraArgs; i++)
+    {
+        argv[argc++] = extraArgs[i];
+    }
+    for (int i = 0; i < numArgs; i++)
+    {
+        argv[argc++] = args[i];
+    }
+    argv[argc] = NULL;
+
+    int pipeFds[2] = {-1, -1};
+    if (output != NULL && pipe(pipeFds) != 0)
+    {
+        output = NULL;
+    }
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(output != NULL ? pipeFds[1] : devNull, STDOUT_FILENO);
+        if (chdir(cwd) != 0)
+        {
+            _exit(127);
+        }
+        execv(tarPath, argv);
+        _exit(127);
+    }
+    if (output != NULL)
+    {
+        // Leer mientras tar escribe, para que no se bloquee con el pipe lleno
+        close(pipeFds[1]);
+        size_t length = 0;
+        char chunk[OUTPUT_SIZE];
+        ssize_t n;
+        while ((n = read(pipeFds[0], chunk, sizeof(chunk) - 1)) > 0)
+        {
+            // Solo se guarda el final: ahi esta el resumen de tar
+            if (length + n > OUTPUT_SIZE - 1)
+            {
+                size_t drop = length + n - (OUTPUT_SIZE - 1);
+                memmove(output, output + drop, length - drop);
+                length -= drop;
+            }
+            memcpy(output + length, chunk, n);
+            length += n;
+        }
+        output[length] = '\0';
+        close(pipeFds[0]);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    double elapsed = now() - start;
+    free(argv);
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "tarbench: fallo la ejecucion de %s %s\n", tarPath, args[0]);
+        return -1;
+    }
+    return elapsed;
+}
+
+double runTar(const char *cwd, char **args, int numArgs)
+{
+    return runTarOutput(cwd, args, numArgs, NULL);
+}
+
+int copyArchive(const char *from, const char *to)
+{
+    // Copia del TAR para repetir una operacion que lo modifica
+    int in = open(from, O_RDONLY), out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    char *buffer = malloc(1 << 20);
+    ssize_t n = in < 0 || out < 0 ? -1 : 0;
+    while (n >= 0 && (n = read(in, buffer, 1 << 20)) > 0)
+    {
+        if (write(out, buffer, n) != n)
+        {
+            n = -1;
+        }
+    }
+    free(buffer);
+    if (in >= 0)
+    {
+        close(in);
+    }
+    if (out >= 0)
+    {
+        close(out);
+    }
+    return n < 0 ? -1 : 0;
+}
+
+unsigned long long packedBytes(const char *output)
+{
+    // -p imprime los bytes que realmente movio: "datos movidos: N bytes"
+    const char *found = strstr(output, "datos movidos: ");
+    return found != NULL ? strtoull(found + strlen("datos movidos: "), NULL, 10) : 0;
+}
+
+void addSample(Measure *measure, double seconds, unsigned long long bytes, unsigned long long files)
+{
+    if (seconds < 0)
+    {
+        return;
+    }
+    measure->samples = realloc(measure->samples, (measure->runs + 1) * sizeof(double));
+    measure->samples[measure->runs++] = seconds;
+    measure->bytes += bytes;
+    measure->files += files;
+}
+
+int compareDouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(double *sorted, unsigned int count, double fraction)
+{
+    return count == 0 ? 0 : sorted[(unsigned int)((count - 1) * fraction + 0.5)];
+}
+
+void printMeasure(Measure *measure, int last)
+{
+    double total = 0;
+    for (unsigned int i = 0; i < measure->runs; i++)
+    {
+        total += measure->samples[i];
+    }
+    qsort(measure->samples, measure->runs, sizeof(double), compareDouble);
+    printf("        {\"operation\": \"%s\", \"runs\": %u, \"bytes\": %llu, \"files\": %llu, "
+           "\"seconds\": %.6f, \"mb_per_s\": %.2f, \"files_per_s\": %.2f, \"p50_ms\": %.3f, \"p99_ms\": %.3f}%s\n",
+           measure->operation, measure->runs, measure->bytes, measure->files, total,
+           total > 0 ? measure->bytes / total / (1024 * 1024) : 0.0,
+           total > 0 ? measure->files / total : 0.0,
+           percentile(measure->samples, measure->runs, 0.50) * 1000,
+           percentile(measure->samples, measure->runs, 0.99) * 1000, last ? "" : ",");
+    free(measure->samples);
+}
+
+void benchDataset(Dataset *dataset, const char *root, unsigned int samples, unsigned int rounds, int last)
+{
+    char dir[4096], out[4096], archive[4096], snapshot[4200];
+    snprintf(dir, sizeof(dir), "%s/%s", root, dataset->name);
+    snprintf(out, sizeof(out), "%s/%s.out", root, dataset->name);
+    snprintf(archive, sizeof(archive), "%s/%s.tar", root, dataset->name);
+    snprintf(snapshot, sizeof(snapshot), "%s.antes", archive);
+    mkdir(dir, 0755);
+    mkdir(out, 0755);
+
+    // Archivos del conjunto y los que se agregan despues (nombres de hasta 12 caracteres)
+    unsigned int total = dataset->count + samples;
+    char **names = malloc(total * sizeof(char *));
+    unsigned int *sizes = malloc(total * sizeof(unsigned int));
+    unsigned long long dataBytes = 0;
+    for (unsigned int i = 0; i < total; i++)
+    {
+        names[i] = malloc(16);
+        snprintf(names[i], 16, "f%07u", i);
+        sizes[i] = datasetFileSize(dataset, i);
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        writeSyntheticFile(path, sizes[i], i);
+        if (i < dataset->count)
+        {
+            dataBytes += sizes[i];
+        }
+    }
+
+    Measure create = {"create", NULL, 0, 0, 0}, append = {"append", NULL, 0, 0, 0};
+    Measure list = {"list", NULL, 0, 0, 0}, extract = {"extract", NULL, 0, 0, 0};
+    Measure extractOne = {"extract_member", NULL, 0, 0, 0}, delete = {"delete", NULL, 0, 0, 0};
+    Measure update = {"update", NULL, 0, 0, 0}, pack = {"pack", NULL, 0, 0, 0};
+
+    // Crear con todos los archivos en una sola ejecucion (-c reemplaza el TAR)
+    char **args = malloc((dataset->count + 8) * sizeof(char *));
+    int numArgs = 0;
+    args[numArgs++] = "-c";
+    args[numArgs++] = "-f";
+    args[numArgs++] = archive;
+    for (unsigned int i = 0; i < dataset->count; i++)
+    {
+        args[numArgs++] = names[i];
+    }
+    for (unsigned int i = 0; i < rounds; i++)
+    {
+        addSample(&create, runTar(dir, args, numArgs), dataBytes, dataset->count);
+    }
+
+    // Fragmentar: eliminar uno de cada dos en una sola transaccion
+    unsigned long long liveBytes = dataBytes;
+    unsigned int liveFiles = dataset->count;
+    if (dataset->fragment)
+    {
+        numArgs = 0;
+        args[numArgs++] = "-d";
+        args[numArgs++] = "-f";
+        args[numArgs++] = archive;
+        for (unsigned int i = 1; i < dataset->count; i += 2)
+        {
+            args[numArgs++] = names[i];
+            liveBytes -= sizes[i];
+            liveFiles--;
+        }
+        runTar(dir, args, numArgs);
+    }
+
+    // Agregar archivos de a uno
+    for (unsigned int i = dataset->count; i < total; i++)
+    {
+        char *appendArgs[] = {"-r", "-f", archive, names[i]};
+        addSample(&append, runTar(dir, appendArgs, 4), sizes[i], 1);
+    }
+
+    for (unsigned int i = 0; i < samples; i++)
+    {
+        char *listArgs[] = {"-t", "-f", archive};
+        addSample(&list, runTar(dir, listArgs, 3), 0, liveFiles + samples);
+    }
+
+    // Extraer todo (se reescriben los mismos archivos) y algunos sueltos a /dev/null
+    char *extractArgs[] = {"-x", "-f", archive};
+    for (unsigned int i = 0; i < rounds; i++)
+    {
+        addSample(&extract, runTar(out, extractArgs, 3), liveBytes, liveFiles);
+    }
+    for (unsigned int i = 0; i < samples; i++)
+    {
+        unsigned int index = (i * 2) % dataset->count;
+        char *memberArgs[] = {"-x", "-O", "-f", archive, names[index]};
+        addSample(&extractOne, runTar(dir, memberArgs, 5), sizes[index], 1);
+    }
+
+    // Actualizar con contenido nuevo del mismo tamanno
+    for (unsigned int i = 0; i < samples; i++)
+    {
+        unsigned int index = (i * 2) % dataset->count;
+        char path[4200];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[index]);
+        writeSyntheticFile(path, sizes[index], index + total);
+        char *updateArgs[] = {"-u", "-f", archive, names[index]};
+        addSample(&update, runTar(dir, updateArgs, 4), sizes[index], 1);
+    }
+
+    for (unsigned int i = dataset->count; i < total; i++)
+    {
+        char *deleteArgs[] = {"-d", "-f", archive, names[i]};
+        addSample(&delete, runTar(dir, deleteArgs, 4), sizes[i], 1);
+    }
+
+    // Compactar siempre el mismo TAR: cada ronda parte de una copia sin
+    // compactar y cuenta los bytes que -p dice haber movido
+    char *packArgs[] = {"-p", "-f", archive};
+    char *output = malloc(OUTPUT_SIZE);
+    if (copyArchive(archive, snapshot) == 0)
+    {
+        for (unsigned int i = 0; i < rounds && copyArchive(snapshot, archive) == 0; i++)
+        {
+            double seconds = runTarOutput(dir, packArgs, 3, output);
+            addSample(&pack, seconds, seconds < 0 ? 0 : packedBytes(output), liveFiles);
+        }
+        unlink(snapshot);
+    }
+    free(output);
+
+    printf("    {\"dataset\": \"%s\", \"files\": %u, \"bytes\": %llu, \"fragmented\": %s, \"operations\": [\n",
+           dataset->name, dataset->count, dataBytes, dataset->fragment ? "true" : "false");
+    Measure *measures[] = {&create, &append, &list, &extract, &extractOne, &update, &delete, &pack};
+    for (int i = 0; i < 8; i++)
+    {
+        printMeasure(measures[i], i == 7);
+    }
+    printf("    ]}%s\n", last ? "" : ",");
+
+    for (unsigned int i = 0; i < total; i++)
+    {
+        free(names[i]);
+    }
+    free(names);
+    free(sizes);
+    free(args);
+}
+
+void removeTree(const char *path)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execlp("rm", "rm", "-rf", path, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned int scale = 1, samples = DEFAULT_SAMPLES, rounds = DEFAULT_ROUNDS;
+    const char *root = NULL;
+    char *tar = "./tar";
+    int keep = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--tar") == 0 && i + 1 < argc)
+        {
+            tar = argv[++i];
+        }
+        else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+        {
+            scale = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc)
+        {
+            samples = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+        {
+            rounds = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            root = argv[++i];
+            keep = 1;
+        }
+        else if (strcmp(argv[i], "--") == 0)
+        {
+            while (++i < argc && numExtraArgs < MAX_ARGS)
+            {
+                extraArgs[numExtraArgs++] = argv[i];
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Uso: %s [--tar programa] [--scale N] [--samples N] [--rounds N] [--dir directorio] [-- opciones de tar]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (scale < 1 || samples < 1 || rounds < 1)
+    {
+        fprintf(stderr, "--scale, --samples y --rounds deben ser al menos 1.\n");
+        return 1;
+    }
+    tarPath = realpath(tar, NULL);
+    if (tarPath == NULL)
+    {
+        fprintf(stderr, "No se encontro el programa %s.\n", tar);
+        return 1;
+    }
+
+    char rootBuffer[] = "/tmp/tarbench.XXXXXX";
+    if (root == NULL)
+    {
+        root = mkdtemp(rootBuffer);
+    }
+    else
+    {
+        mkdir(root, 0755);
+    }
+    if (root == NULL)
+    {
+        fprintf(stderr, "No se pudo crear el directorio de trabajo.\n");
+        return 1;
+    }
+
+    Dataset datasets[] = {
+        {"tiny", 2000 * scale, 64, 4096, 0},
+        {"huge", 2, 64u * 1024 * 1024 * scale, 64u * 1024 * 1024 * scale, 0},
+        {"mixed", 400 * scale, 1024, 8 * 1024 * 1024, 0},
+        {"fragmented", 400 * scale, 1024, 8 * 1024 * 1024, 1},
+    };
+    int numDatasets = sizeof(datasets) / sizeof(datasets[0]);
+
+    printf("{\n  \"tar\": \"%s\",\n  \"options\": \"", tarPath);
+    for (int i = 0; i < numExtraArgs; i++)
+    {
+        printf("%s%s", i > 0 ? " " : "", extraArgs[i]);
+    }
+    printf("\",\n  \"scale\": %u,\n  \"samples\": %u,\n  \"rounds\": %u,\n  \"datasets\": [\n", scale, samples, rounds);
+    for (int i = 0; i < numDatasets; i++)
+    {
+        benchDataset(&datasets[i], root, samples, rounds, i == numDatasets - 1);
+        fflush(stdout);
+    }
+    printf("  ]\n}\n");
+
+    if (!keep)
+    {
+        removeTree(root);
+    }
+    free(tarPath);
+    return 0;
+}
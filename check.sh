@@ -0,0 +1,75 @@
+#!/bin/bash
+# Pruebas de la linea de comandos: make check (o ./check.sh ./tar)
+TAR="$(realpath "${1:-./tar}")"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+failed=0
+fail() {
+    echo "FALLO: $*"
+    failed=1
+}
+size() {
+    stat -c %s "$1"
+}
+
+# -p despues de -u: el diario que agrando -u no deja el TAR mas grande
+head -c 10000000 /dev/urandom > grande
+head -c 100000 /dev/urandom > chico
+"$TAR" -cf u.tar chico grande > /dev/null
+head -c 3000000 /dev/urandom | dd of=grande conv=notrunc status=none
+"$TAR" -uf u.tar grande > /dev/null
+before=$(size u.tar)
+"$TAR" -pf u.tar > /dev/null
+after=$(size u.tar)
+[ "$after" -le "$before" ] || fail "-p agrando el TAR de $before a $after bytes"
+"$TAR" -xOf u.tar grande | cmp -s - grande || fail "-p despues de -u cambio los datos"
+
+# --verify termina con error si hay un bloque corrupto o no se puede abrir el TAR
+"$TAR" -cf v.tar grande > /dev/null
+"$TAR" --verify -f v.tar > /dev/null || fail "--verify fallo con un TAR sano"
+printf 'X' | dd of=v.tar bs=1 seek=$((4096 + 262144 * 8 + 1000)) conv=notrunc status=none
+"$TAR" --verify -f v.tar > /dev/null && fail "--verify termino en 0 con un bloque corrupto"
+"$TAR" --verify -f no_existe.tar > /dev/null && fail "--verify termino en 0 sin TAR"
+
+# -O y --range terminan con error si falta el archivo, el rango empieza
+# despues del final o un bloque esta corrupto
+"$TAR" -cf o.tar chico grande > /dev/null
+"$TAR" -xOf o.tar chico 2> /dev/null | cmp -s - chico || fail "-O no devolvio el archivo"
+"$TAR" -xOf o.tar no_existe > /dev/null 2>&1 && fail "-O termino en 0 sin el archivo"
+"$TAR" -x --range 100001:10 -f o.tar chico > /dev/null 2>&1 && fail "--range termino en 0 despues del final"
+"$TAR" -x --range 100000:10 -f o.tar chico > /dev/null 2>&1 || fail "--range fallo justo en el final"
+"$TAR" -xOf v.tar grande > /dev/null 2>&1 && fail "-O termino en 0 con un bloque corrupto"
+
+# --merge con un origen que no se puede leer termina con error y no cambia el destino
+"$TAR" -cf m.tar chico > /dev/null
+"$TAR" -tf m.tar > antes.txt
+echo "no es un TAR" > roto.tar
+"$TAR" --merge o.tar roto.tar -f m.tar > /dev/null && fail "--merge termino en 0 con un origen roto"
+"$TAR" -tf m.tar | cmp -s - antes.txt || fail "--merge fallido cambio el directorio del destino"
+"$TAR" --verify -f m.tar > /dev/null || fail "--merge fallido dejo bloques corruptos"
+"$TAR" --merge o.tar -f m.tar > /dev/null || fail "--merge fallo con un origen sano"
+
+# -p --budget repetido llega al mismo tamanno que -p, aunque los huecos sean
+# mas chicos que las extensiones que siguen
+for i in 1 3 5 7; do
+    head -c 300000 /dev/urandom > p$i
+done
+for i in 2 4 6 8; do
+    head -c 2000000 /dev/urandom > p$i
+done
+"$TAR" -cf p.tar p1 p2 p3 p4 p5 p6 p7 p8 > /dev/null
+"$TAR" -df p.tar p1 p3 p5 p7 > /dev/null
+cp p.tar pb.tar
+"$TAR" -pf p.tar > /dev/null
+for i in $(seq 1 50); do
+    "$TAR" -p --budget 256KB -f pb.tar | grep -q "vuelva a ejecutar" || break
+done
+[ "$(size pb.tar)" = "$(size p.tar)" ] || fail "-p --budget quedo en $(size pb.tar) bytes y -p en $(size p.tar)"
+for i in 2 4 6 8; do
+    "$TAR" -xOf pb.tar p$i | cmp -s - p$i || fail "-p --budget cambio p$i"
+done
+
+[ $failed = 0 ] && echo "Todas las pruebas pasaron."
+exit $failed
@@ -0,0 +1,401 @@
+#include "archive.h"
+#include "libtar.h"
+
+struct TarArchive
+{
+    FatTable fatTable;    // Directorio (las paginas se cargan bajo demanda)
+    const char *map;      // TAR completo proyectado en memoria
+    size_t mapSize;       // Bytes proyectados
+    pthread_mutex_t lock; // Protege la carga de paginas en tarLookup
+};
+
+TarArchive *tarOpen(const char *path)
+{
+    TarArchive *archive = calloc(1, sizeof(TarArchive));
+    if (archive == NULL)
+    {
+        return NULL;
+    }
+    if (openArchive((char *)path, O_RDONLY, &archive->fatTable) != 0)
+    {
+        free(archive);
+        return NULL;
+    }
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(archive->fatTable.fd, &st) == 0)
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, archive->fatTable.fd, 0);
+    }
+    if (map == MAP_FAILED)
+    {
+        int error = errno;
+        closeTar(&archive->fatTable);
+        free(archive);
+        errno = error;
+        return NULL;
+    }
+    archive->map = map;
+    archive->mapSize = st.st_size;
+    pthread_mutex_init(&archive->lock, NULL);
+    return archive;
+}
+
+void tarClose(TarArchive *archive)
+{
+    if (archive == NULL)
+    {
+        return;
+    }
+    munmap((void *)archive->map, archive->mapSize);
+    pthread_mutex_destroy(&archive->lock);
+    closeTar(&archive->fatTable);
+    free(archive);
+}
+
+const TarMember *tarLookup(TarArchive *archive, const char *name)
+{
+    pthread_mutex_lock(&archive->lock);
+    FatEntry *entry = findFatEntry(&archive->fatTable, name);
+    pthread_mutex_unlock(&archive->lock);
+    if (entry == NULL)
+    {
+        errno = ENOENT;
+    }
+    return entry;
+}
+
+off_t tarMemberSize(const TarMember *member)
+{
+    return member->file_size;
+}
+
+const char *mapRange(TarArchive *archive, off_t offset, size_t length)
+{
+    // Puntero dentro de la proyeccion, o NULL si la FAT apunta fuera del TAR
+    if (offset < 0 || (size_t)offset > archive->mapSize || length > archive->mapSize - offset)
+    {
+        errno = EIO;
+        return NULL;
+    }
+    return archive->map + offset;
+}
+
+// Lo que se devuelve al leer un hueco de un archivo disperso
+static const char zeroBlock[BLOCK_SIZE];
+
+const SparseRegion *sparseRegions(TarArchive *archive, const FatEntry *entry, unsigned long long *count)
+{
+    const unsigned long long *header = (const unsigned long long *)mapRange(archive, blockOffset(entry->starting_block), sizeof(unsigned long long));
+    if (header == NULL || sparseDataStart(*header) > (unsigned long long)entry->num_blocks * BLOCK_SIZE ||
+        mapRange(archive, blockOffset(entry->starting_block), sparseDataStart(*header)) == NULL)
+    {
+        errno = EIO;
+        return NULL;
+    }
+    *count = *header;
+    return (const SparseRegion *)(header + 1);
+}
+
+const char *sparseSlice(TarArchive *archive, const FatEntry *entry, off_t offset, size_t *length)
+{
+    // Buscar la ultima region que empieza antes de offset
+    unsigned long long count;
+    const SparseRegion *regions = sparseRegions(archive, entry, &count);
+    if (regions == NULL)
+    {
+        return NULL;
+    }
+    unsigned long long low = 0, high = count;
+    while (low < high)
+    {
+        unsigned long long middle = (low + high) / 2;
+        if (regions[middle].offset <= (unsigned long long)offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    if (low > 0 && (unsigned long long)offset < regions[low - 1].offset + regions[low - 1].length)
+    {
+        const SparseRegion *region = &regions[low - 1];
+        *length = region->offset + region->length - offset;
+        return mapRange(archive, blockOffset(entry->starting_block) + region->position + (offset - region->offset), *length);
+    }
+
+    // Hueco: ceros hasta la siguiente region
+    unsigned long long end = low < count ? regions[low].offset : entry->file_size;
+    *length = end - offset < BLOCK_SIZE ? end - offset : BLOCK_SIZE;
+    return zeroBlock;
+}
+
+const char *memberSlice(TarArchive *archive, const FatEntry *entry, off_t offset, size_t *length)
+{
+    // Bytes seguidos desde offset; para un bloque comprimido devuelve NULL
+    // con errno = ENOTSUP y en *length el tamanno original del bloque
+    unsigned int block = offset / BLOCK_SIZE;
+    unsigned int inBlock = offset % BLOCK_SIZE;
+    unsigned int rawLength = blockLength(entry->file_size, block);
+    if (entry->flags & FAT_SPARSE)
+    {
+        return sparseSlice(archive, entry, offset, length);
+    }
+    if ((entry->flags & (FAT_TAIL | FAT_DEDUP)) == FAT_TAIL)
+    {
+        *length = entry->file_size - offset;
+        return mapRange(archive, blockOffset(entry->starting_block) + entry->tail_offset * TAIL_ALIGN + offset, *length);
+    }
+    if (entry->flags & FAT_DEDUP)
+    {
+        const unsigned int *list = (const unsigned int *)mapRange(archive, dedupListOffset(entry), dedupListSize(entry->file_size));
+        if (list == NULL)
+        {
+            return NULL;
+        }
+        *length = rawLength - inBlock;
+        return mapRange(archive, blockOffset(list[block]) + inBlock, *length);
+    }
+    if (entry->flags & FAT_COMPRESSED)
+    {
+        const unsigned long long *blockMap = (const unsigned long long *)mapRange(archive, blockOffset(entry->starting_block), blockMapSize(entry->file_size));
+        if (blockMap == NULL)
+        {
+            return NULL;
+        }
+        // Bloques del mismo tamanno que el original se guardaron sin comprimir
+        if (blockMap[block + 1] - blockMap[block] != rawLength)
+        {
+            *length = rawLength;
+            errno = ENOTSUP;
+            return NULL;
+        }
+        *length = rawLength - inBlock;
+        return mapRange(archive, blockOffset(entry->starting_block) + blockMap[block] + inBlock, *length);
+    }
+    *length = entry->file_size - offset;
+    return mapRange(archive, blockOffset(entry->starting_block) + offset, *length);
+}
+
+const void *tarSlice(TarArchive *archive, const TarMember *member, off_t offset, size_t *length)
+{
+    if (offset < 0 || offset >= (off_t)member->file_size)
+    {
+        // Fuera del archivo no hay bytes que devolver
+        *length = 0;
+        errno = offset < 0 ? EINVAL : 0;
+        return NULL;
+    }
+    size_t available;
+    const char *data = memberSlice(archive, member, offset, &available);
+    if (data != NULL && available < *length)
+    {
+        *length = available;
+    }
+    return data;
+}
+
+int decompressMemberBlock(TarArchive *archive, const FatEntry *entry, unsigned int block, char *buffer, unsigned int rawLength)
+{
+    const unsigned long long *blockMap = (const unsigned long long *)(archive->map + blockOffset(entry->starting_block));
+    unsigned long long stored = blockMap[block + 1] - blockMap[block];
+    const char *compressed = mapRange(archive, blockOffset(entry->starting_block) + blockMap[block], stored);
+    if (compressed == NULL || blockMap[block + 1] < blockMap[block] ||
+        decompressBlock(entry->flags & FAT_COMPRESSED, compressed, stored, buffer, rawLength) != 0)
+    {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t tarRead(TarArchive *archive, const TarMember *member, off_t offset, void *buffer, size_t length)
+{
+    if (offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset >= (off_t)member->file_size)
+    {
+        return 0;
+    }
+    if (length > (size_t)(member->file_size - offset))
+    {
+        length = member->file_size - offset;
+    }
+
+    char *out = buffer;
+    char *scratch = NULL;
+    size_t copied = 0;
+    while (copied < length)
+    {
+        size_t available;
+        const char *data = memberSlice(archive, member, offset + copied, &available);
+        if (data == NULL && errno == ENOTSUP)
+        {
+            // Bloque comprimido: se descomprime directo en el destino si
+            // se pide completo, si no en un buffer aparte
+            unsigned int block = (offset + copied) / BLOCK_SIZE;
+            unsigned int inBlock = (offset + copied) % BLOCK_SIZE;
+            if (inBlock == 0 && length - copied >= available)
+            {
+                if (decompressMemberBlock(archive, member, block, out + copied, available) != 0)
+                {
+                    break;
+                }
+                copied += available;
+                continue;
+            }
+            if (scratch == NULL)
+            {
+                scratch = malloc(BLOCK_SIZE);
+            }
+            if (scratch == NULL || decompressMemberBlock(archive, member, block, scratch, available) != 0)
+            {
+                break;
+            }
+            data = scratch + inBlock;
+            available -= inBlock;
+        }
+        else if (data == NULL)
+        {
+            break;
+        }
+        if (available > length - copied)
+        {
+            available = length - copied;
+        }
+        memcpy(out + copied, data, available);
+        copied += available;
+    }
+    free(scratch);
+    if (copied == 0 && length > 0)
+    {
+        return -1;
+    }
+    return copied;
+}
+
+int verifyTailBlock(TarArchive *archive, unsigned int block, char *buffer)
+{
+    // El mapa de colas se carga una vez, compartido por los hilos
+    pthread_mutex_lock(&archive->lock);
+    TailMap *tails = loadTailMap(&archive->fatTable);
+    pthread_mutex_unlock(&archive->lock);
+    return readTailBlock(archive->fatTable.fd, &archive->fatTable.super, tails, block, buffer);
+}
+
+int tarVerifyRange(TarArchive *archive, const TarMember *member, off_t offset, size_t length)
+{
+    if (offset < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset >= (off_t)member->file_size || length == 0)
+    {
+        return 0;
+    }
+    if (length > (size_t)(member->file_size - offset))
+    {
+        length = member->file_size - offset;
+    }
+    char *buffer = malloc(BLOCK_SIZE);
+    if (buffer == NULL)
+    {
+        return -1;
+    }
+
+    // Solo se leen los bloques fisicos que contienen el rango
+    int fd = archive->fatTable.fd;
+    SuperBlock *super = &archive->fatTable.super;
+    unsigned int first = offset / BLOCK_SIZE;
+    unsigned int last = (offset + length - 1) / BLOCK_SIZE;
+    int corrupt = -1;
+    if ((member->flags & (FAT_TAIL | FAT_DEDUP)) == FAT_TAIL)
+    {
+        corrupt = verifyTailBlock(archive, member->starting_block, buffer);
+    }
+    else if (member->flags & FAT_SPARSE)
+    {
+        // El mapa y los bytes guardados de las regiones que tocan el rango
+        unsigned long long count, end = offset + length;
+        const SparseRegion *regions = sparseRegions(archive, member, &count);
+        unsigned int mapBlocks = regions == NULL ? 0 : (sparseDataStart(count) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        corrupt = regions == NULL ? (int)member->starting_block : verifyExtent(fd, super, member->starting_block, mapBlocks, buffer);
+        for (unsigned long long i = 0; corrupt < 0 && i < count; i++)
+        {
+            const SparseRegion *region = &regions[i];
+            if (region->offset >= end || region->offset + region->length <= (unsigned long long)offset)
+            {
+                continue;
+            }
+            unsigned long long from = region->offset > (unsigned long long)offset ? region->offset : (unsigned long long)offset;
+            unsigned long long to = region->offset + region->length < end ? region->offset + region->length : end;
+            unsigned int firstBlock = (region->position + (from - region->offset)) / BLOCK_SIZE;
+            unsigned int lastBlock = (region->position + (to - region->offset) - 1) / BLOCK_SIZE;
+            corrupt = verifyExtent(fd, super, member->starting_block + firstBlock, lastBlock - firstBlock + 1, buffer);
+        }
+    }
+    else if (member->flags & FAT_DEDUP)
+    {
+        // La lista esta en un bloque de colas (FAT_TAIL) o en la extension
+        const unsigned int *list = (const unsigned int *)mapRange(archive, dedupListOffset(member), dedupListSize(member->file_size));
+        if (list == NULL)
+        {
+            corrupt = member->starting_block;
+        }
+        else if (member->flags & FAT_TAIL)
+        {
+            corrupt = verifyTailBlock(archive, member->starting_block, buffer);
+        }
+        else
+        {
+            corrupt = verifyExtent(fd, super, member->starting_block, member->num_blocks, buffer);
+        }
+        for (unsigned int i = first; corrupt < 0 && i <= last; i++)
+        {
+            corrupt = verifyExtent(fd, super, list[i], 1, buffer);
+        }
+    }
+    else if (member->flags & FAT_COMPRESSED)
+    {
+        // El mapa de bloques y los bytes comprimidos de los bloques pedidos
+        const unsigned long long *blockMap = (const unsigned long long *)mapRange(archive, blockOffset(member->starting_block), blockMapSize(member->file_size));
+        unsigned int mapBlocks = (blockMapSize(member->file_size) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        corrupt = blockMap == NULL ? (int)member->starting_block : verifyExtent(fd, super, member->starting_block, mapBlocks, buffer);
+        if (corrupt < 0 && blockMap[last + 1] > blockMap[first])
+        {
+            unsigned int from = blockMap[first] / BLOCK_SIZE;
+            unsigned int to = (blockMap[last + 1] - 1) / BLOCK_SIZE;
+            if (to >= member->num_blocks)
+            {
+                to = member->num_blocks - 1;
+            }
+            if (from <= to)
+            {
+                corrupt = verifyExtent(fd, super, member->starting_block + from, to - from + 1, buffer);
+            }
+        }
+    }
+    else
+    {
+        corrupt = verifyExtent(fd, super, member->starting_block + first, last - first + 1, buffer);
+    }
+    free(buffer);
+    if (corrupt >= 0)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 0;
+}
+
+int tarVerify(TarArchive *archive, const TarMember *member)
+{
+    return tarVerifyRange(archive, member, 0, member->file_size);
+}
@@ -0,0 +1,50 @@
+// Biblioteca para leer archivos de un TAR sin extraerlos.
+//
+//     TarArchive *archive = tarOpen("datos.tar");
+//     const TarMember *member = tarLookup(archive, "a.txt");
+//     char buffer[4096];
+//     ssize_t n = tarRead(archive, member, 0, buffer, sizeof(buffer));
+//     tarClose(archive);
+//
+// El TAR se proyecta en memoria con mmap: tarSlice devuelve los bytes de un
+// archivo sin copiarlos y tarRead los copia (o descomprime) en un buffer.
+// Las funciones devuelven NULL o -1 en caso de error y dejan la causa en
+// errno. tarRead, tarSlice y tarVerify se pueden llamar desde varios hilos.
+#ifndef LIBTAR_H
+#define LIBTAR_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define TAR_API __attribute__((visibility("default")))
+
+typedef struct TarArchive TarArchive; // TAR abierto para lectura
+typedef struct FatEntry TarMember;    // Archivo dentro del TAR
+
+// Abrir un TAR para lectura. Aplica las transacciones pendientes del diario.
+TAR_API TarArchive *tarOpen(const char *path);
+TAR_API void tarClose(TarArchive *archive);
+
+// Buscar un archivo por nombre; NULL con errno = ENOENT si no existe.
+// El registro es valido hasta tarClose.
+TAR_API const TarMember *tarLookup(TarArchive *archive, const char *name);
+TAR_API off_t tarMemberSize(const TarMember *member);
+
+// Copiar hasta length bytes desde offset. Devuelve los bytes copiados
+// (0 al final del archivo).
+TAR_API ssize_t tarRead(TarArchive *archive, const TarMember *member, off_t offset, void *buffer, size_t length);
+
+// Puntero a los bytes del archivo desde offset, sin copiarlos. En *length se
+// pasa el maximo deseado y se devuelve cuantos bytes seguidos hay (hasta el
+// final del bloque en archivos deduplicados). Los bloques comprimidos no se
+// pueden leer asi: NULL con errno = ENOTSUP, se debe usar tarRead. Al
+// final del archivo devuelve NULL con *length = 0.
+TAR_API const void *tarSlice(TarArchive *archive, const TarMember *member, off_t offset, size_t *length);
+
+// Revisar el CRC32C de los bloques del archivo; -1 con errno = EBADMSG si
+// alguno esta corrupto. tarVerifyRange solo lee los bloques que contienen
+// el rango.
+TAR_API int tarVerify(TarArchive *archive, const TarMember *member);
+TAR_API int tarVerifyRange(TarArchive *archive, const TarMember *member, off_t offset, size_t length);
+
+#endif
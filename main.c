@@ -1,429 +1,965 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <bits/getopt_core.h>
+#include "archive.h"
+#include "libtar.h"
+#include <getopt.h>
 
-#define BLOCK_SIZE 262144 // 256 kB
-int verbose = 0;
-
-typedef struct FatEntry
+typedef struct ExtractJob
 {
-    char filename[12];           // Nombre del archivo
-    unsigned int starting_block; // Bloque inicial
-    unsigned int num_blocks;     // Tamanno en bloques
-    unsigned int file_size;      // Tamanno en bytes
-    unsigned char is_empty;      // Flag que indica si esta vacio
-} FatEntry;
+    FatEntry entry;     // Copia del registro a extraer
+    char *filename;     // Nombre completo (de la tabla de cadenas si es largo)
+    char message[256];  // Mensaje a imprimir al terminar (en orden del directorio)
+    int failed;         // El archivo no se extrajo completo
+} ExtractJob;
 
-typedef struct FatTable
+typedef struct ExtractPool
 {
-    FatEntry entries[256]; // 256 registros en el FAT
-} FatTable;
+    int tarFd;             // Descriptor compartido del TAR (solo pread)
+    SuperBlock *super;     // Ubicacion de la tabla de bloques
+    TailMap *tails;        // Espacios libres de los bloques de colas
+    ExtractJob *jobs;      // Archivos por extraer
+    unsigned int *order;   // Orden de proceso (por posicion fisica)
+    unsigned int numJobs;  // Cantidad de archivos
+    unsigned int *groups;  // Inicio de cada grupo en order (un bloque de colas por grupo)
+    unsigned int numGroups; // Cantidad de grupos
+    unsigned int next;     // Siguiente grupo libre (atomico)
+} ExtractPool;
 
-typedef struct TarHeader
+void printFatTable(FatTable *fatTable)
 {
-    char magic_number[6];       // Numero magico para identificar el TAR
-    char version_number[2];     // No. de version
-    char user_name[100];        // Nombre de usuario
-    char group_name[100];       // Nombre del grupo
-    char modification_time[12]; // Hora de modificacion
-    char checksum[8];           // Checksum
-    char file_size[12];         // Tamanno en bytes
-    char block_size[12];        // Tamanno en bloques
-    char linked_tar_file[100];  // Nombre del archivo TAR
-    char prefix[155];           // Prefijo para los archivos
-} TarHeader;
+    printf("-------------------------------------------------------------------------------------\n");
+    printf("| %-20s | %-12s | %-12s | %-15s | %-10s |\n", "Filename", "First Block", "Block Size", "File Size", "Is Empty");
+    printf("|----------------------|--------------|--------------|-----------------|------------|\n");
 
-void initializeFatTable(FatTable *fatTable)
-{
-    for (int i = 0; i < 256; i++)
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
     {
-        fatTable->entries[i].is_empty = 1;
-        fatTable->entries[i].starting_block = 0;
-        fatTable->entries[i].num_blocks = 0;
-        strcpy(fatTable->entries[i].filename, "\0");
-        fatTable->entries[i].file_size = 0;
+        char shortName[13];
+        const char *filename = fatEntryName(fatTable, entry, shortName);
+        printf("| %-20s | %12u | %12u | %15llu | %10d |\n", filename, entry->starting_block, entry->num_blocks, entry->file_size, entry->is_empty);
     }
+    printf("-------------------------------------------------------------------------------------\n");
 }
 
-int findEmptyFatEntry(FatTable *fatTable)
+void extractMember(int tarFd, SuperBlock *super, ExtractJob *job, const char *tailBlock, char *buffer)
 {
-    for (int i = 0; i < 256; i++)
-    {
-        if (fatTable->entries[i].is_empty)
+    // Obtener informacion del FAT
+    const char *filename = job->filename;
+    unsigned long long file_size = job->entry.file_size;
+    unsigned int starting_block = job->entry.starting_block;
+    int length = 0;
+
+    // Archivo por extraer (con los directorios de su ruta)
+    unsigned long long start = statStart();
+    int outFd = -1;
+    if (isSafeMemberName(filename))
+    {
+        outFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (outFd < 0 && errno == ENOENT && createParentDirectories(filename) == 0)
         {
-            return i;
+            outFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
         }
     }
-    return -1;
-}
-
-void saveFatTableToFile(FatTable *fatTable, FILE *tarFile)
-{
-    fwrite(fatTable->entries, sizeof(FatEntry), 256, tarFile);
-}
-
-void loadFatTableFromFile(FatTable *fatTable, FILE *tarFile)
-{
-    fread(fatTable->entries, sizeof(FatEntry), 256, tarFile);
-}
+    if (outFd < 0)
+    {
+        snprintf(job->message, sizeof(job->message), "ERROR: no se pudo extraer el archivo %s\n", filename);
+        job->failed = 1;
+        return;
+    }
 
-void printFatTable(FatTable *fatTable)
-{
-    printf("-------------------------------------------------------------------------------------\n");
-    printf("| %-20s | %-12s | %-12s | %-15s | %-10s |\n", "Filename", "First Block", "Block Size", "File Size", "Is Empty");
-    printf("|----------------------|--------------|--------------|-----------------|------------|\n");
+    if (verbose == 2)
+    {
+        length += snprintf(job->message + length, sizeof(job->message) - length, "Extrayendo el contenido del archivo %s.\n", filename);
+    }
+    // Extraer el archivo revisando el CRC de cada bloque mientras se copia (los
+    // bloques de colas ya los verifico extractWorker al leerlos en tailBlock);
+    // no usa la posicion compartida del TAR
+    off_t copied;
+    int corrupt = -1;
+    if (job->entry.flags & FAT_DEDUP)
+    {
+        copied = readDedupMember(tarFd, super, &job->entry, tailBlock, outFd, buffer, &corrupt);
+    }
+    else if (job->entry.flags & FAT_TAIL)
+    {
+        copied = pwrite(outFd, tailBlock + job->entry.tail_offset * TAIL_ALIGN, file_size, 0);
+    }
+    else if (job->entry.flags & FAT_COMPRESSED)
+    {
+        copied = readCompressedMember(tarFd, super, &job->entry, outFd, buffer, &corrupt);
+    }
+    else if (job->entry.flags & FAT_SPARSE)
+    {
+        copied = readSparseMember(tarFd, super, &job->entry, outFd, buffer, &corrupt);
+    }
+    else
+    {
+        copied = readPlainMember(tarFd, super, &job->entry, outFd, buffer, &corrupt);
+    }
+    if (corrupt >= 0)
+    {
+        // No dejar un archivo con datos que no coinciden con su CRC
+        close(outFd);
+        unlink(filename);
+        statEnd(STAT_COPY, start);
+        snprintf(job->message, sizeof(job->message), "ERROR: bloque %d corrupto, no se extrajo el archivo %s\n", corrupt, filename);
+        job->failed = 1;
+        return;
+    }
+    if (copied < 0)
+    {
+        length += snprintf(job->message + length, sizeof(job->message) - length, "ERROR: no se pudo extraer el contenido de %s\n", filename);
+        job->failed = 1;
+    }
+    else if ((unsigned long long)copied < file_size)
+    {
+        length += snprintf(job->message + length, sizeof(job->message) - length, "ERROR: EOF encontrado dentro del bloque %u.\n", starting_block + (unsigned int)(copied / BLOCK_SIZE));
+        job->failed = 1;
+    }
 
-    for (int i = 0; i < 20; i++)
+    close(outFd);
+    statEnd(STAT_COPY, start);
+    statMember(filename, copied > 0 ? copied : 0, start);
+    if (verbose == 1)
     {
-        FatEntry entry = fatTable->entries[i];
-        printf("| %-20s | %12d | %12d | %15d | %10d |\n", entry.filename, entry.starting_block, entry.num_blocks, entry.file_size, entry.is_empty);
+        snprintf(job->message + length, sizeof(job->message) - length, "Archivo extraído: %s\n", filename);
+    }
+    else if (verbose == 2)
+    {
+        snprintf(job->message + length, sizeof(job->message) - length, "Archivo extraído: %s, Tamaño: %llu bytes, Bloques iniciales: %u, Bloques: %u\n", filename, file_size, starting_block, job->entry.num_blocks);
     }
-    printf("-------------------------------------------------------------------------------------\n");
 }
 
-void createEmptyTar(char *tarFilename)
+void *extractWorker(void *arg)
 {
-    FILE *tarFile = fopen(tarFilename, "wb");
-    if (!tarFile)
+    ExtractPool *pool = arg;
+    char *buffer = malloc(2 * BLOCK_SIZE);
+    char *tailBlock = malloc(BLOCK_SIZE);
+    while (1)
     {
-        printf("ERROR: no se pudo crear el archivo %s\n", tarFilename);
-        exit(-1);
-    }
+        unsigned int group = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        if (group >= pool->numGroups)
+        {
+            break;
+        }
 
-    // FAT
-    FatTable fatTable;
-    initializeFatTable(&fatTable);
+        // Los archivos de un mismo bloque de colas salen de una sola lectura
+        ExtractJob *first = &pool->jobs[pool->order[pool->groups[group]]];
+        int corrupt = -1;
+        if (first->entry.flags & FAT_TAIL)
+        {
+            corrupt = readTailBlock(pool->tarFd, pool->super, pool->tails, first->entry.starting_block, tailBlock);
+        }
+        for (unsigned int i = pool->groups[group]; i < pool->groups[group + 1]; i++)
+        {
+            ExtractJob *job = &pool->jobs[pool->order[i]];
+            if (corrupt >= 0)
+            {
+                snprintf(job->message, sizeof(job->message), "ERROR: bloque %d corrupto, no se extrajo el archivo %s\n", corrupt, job->filename);
+                job->failed = 1;
+                continue;
+            }
+            extractMember(pool->tarFd, pool->super, job, tailBlock, buffer);
+        }
+    }
+    free(buffer);
+    free(tailBlock);
+    return NULL;
+}
 
-    // Guardar el FAT en el TAR
-    saveFatTableToFile(&fatTable, tarFile);
+ExtractJob *extractJobsForSort;
 
-    // Guardar el TAR Header
-    TarHeader tarHeader;
-    memset(&tarHeader, 0, sizeof(TarHeader));
-    strcpy(tarHeader.magic_number, "ustar");  // Numero magico
-    fwrite(&tarHeader, sizeof(TarHeader), 1, tarFile);
+int compareExtractOrder(const void *a, const void *b)
+{
+    unsigned int blockA = extractJobsForSort[*(const unsigned int *)a].entry.starting_block;
+    unsigned int blockB = extractJobsForSort[*(const unsigned int *)b].entry.starting_block;
+    return blockA < blockB ? -1 : blockA > blockB;
+}
 
-    fclose(tarFile);
+int compareExtractNames(const void *a, const void *b)
+{
+    unsigned int indexA = *(const unsigned int *)a;
+    unsigned int indexB = *(const unsigned int *)b;
+    int order = strcmp(extractJobsForSort[indexA].filename, extractJobsForSort[indexB].filename);
+    return order != 0 ? order : (indexA > indexB) - (indexA < indexB);
 }
 
-void writeFileToTar(char *filename, FILE *tarFile, FatTable *fatTable)
+unsigned int dropRepeatedJobs(ExtractJob *jobs, unsigned int numJobs)
 {
-    FILE *sourceFile = fopen(filename, "rb");
-    if (!sourceFile)
+    // Dos trabajos con la misma ruta escribirian el mismo archivo a la vez
+    // (nombre repetido en los argumentos o en el TAR): queda el ultimo
+    unsigned int *order = malloc((numJobs + 1) * sizeof(unsigned int));
+    for (unsigned int i = 0; i < numJobs; i++)
     {
-        printf("ERROR: No se encontro el archivo %s\n", filename);
-        return;
+        order[i] = i;
     }
-
-    if (verbose == 2)
+    extractJobsForSort = jobs;
+    qsort(order, numJobs, sizeof(unsigned int), compareExtractNames);
+    unsigned char *repeated = calloc(numJobs + 1, 1);
+    for (unsigned int i = 0; i + 1 < numJobs; i++)
     {
-        printf("Obteniendo el tamano de %s...\n", filename);
+        repeated[order[i]] = strcmp(jobs[order[i]].filename, jobs[order[i + 1]].filename) == 0;
     }
 
-    // Obtener tamanno (bytes)
-    fseek(sourceFile, 0, SEEK_END);
-    int file_size = ftell(sourceFile);
-    fseek(sourceFile, 0, SEEK_SET);
-
-    if (verbose == 2)
+    unsigned int kept = 0;
+    for (unsigned int i = 0; i < numJobs; i++)
     {
-        printf("Calculando la cantidad de bloques requeridos para %s...\n", filename);
+        if (repeated[i])
+        {
+            free(jobs[i].filename);
+            continue;
+        }
+        jobs[kept++] = jobs[i];
     }
+    free(repeated);
+    free(order);
+    return kept;
+}
 
-    // Calcular tamanno (bloques)
-    int num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+int isGlobPattern(const char *name)
+{
+    return strpbrk(name, "*?[") != NULL;
+}
 
-    if (verbose == 2)
+int matchesAnyPattern(const char *name, char **names, int numNames)
+{
+    // Un nombre que no es patron tambien selecciona lo que hay bajo ese directorio
+    for (int i = 0; i < numNames; i++)
     {
-        printf("Ajustando posiciones dentro del FAT...\n");
+        size_t length = strlen(names[i]);
+        if (isGlobPattern(names[i]) ? fnmatch(names[i], name, 0) == 0
+                                    : strncmp(name, names[i], length) == 0 && (name[length] == '\0' || name[length] == '/'))
+        {
+            return 1;
+        }
     }
+    return 0;
+}
 
-    // Ultimo bloque ocupado
-    int lastOccupiedBlock = -1;
-    for (int i = 0; i < 256; i++)
-    {
-        if (!fatTable->entries[i].is_empty && i < fatTable->entries[i].starting_block + fatTable->entries[i].num_blocks)
+int isUnderDirectory(FatTable *fatTable, const char *dir)
+{
+    // Hay archivos guardados bajo dir/ (se recorre el directorio completo)
+    size_t length = strlen(dir);
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
+    {
+        char shortName[13];
+        const char *name = fatEntryName(fatTable, entry, shortName);
+        if (strncmp(name, dir, length) == 0 && name[length] == '/')
         {
-            lastOccupiedBlock = i;
+            return 1;
         }
     }
+    return 0;
+}
 
-    // Calcular el bloque inicial
-    int starting_block;
-    if (lastOccupiedBlock == -1)
-    {
-        starting_block = 0;
+typedef struct StreamMember
+{
+    char magic[4];                // STREAM_MEMBER o STREAM_TRAILER
+    char filename[12];            // Nombre del archivo (si name_length es 0)
+    unsigned long long file_size; // Tamanno en bytes
+    unsigned long long offset;    // Posicion de los datos (en el trailer: del indice)
+    unsigned int count;           // En el trailer: cantidad de archivos
+    unsigned int name_length;     // Largo de un nombre de mas de 12 caracteres
+} StreamMember;
+
+#define STREAM_MEMBER "MEMB"
+#define STREAM_TRAILER "TRLR"
+
+// Formato de flujo: se escribe y se lee en una sola pasada hacia adelante.
+//   TarHeader | (StreamMember + nombre largo + datos)* | trailer | indice | nombres largos | trailer
+// El indice final permite listar un flujo guardado en disco sin recorrerlo.
+
+off_t streamFileRange(int inFd, int outFd, off_t length, char *buffer)
+{
+    // Copia secuencial (sin posiciones): sendfile desde archivos, splice
+    // desde tuberias y read/write como respaldo
+    struct stat st;
+    int inIsPipe = fstat(inFd, &st) == 0 && S_ISFIFO(st.st_mode);
+    int useKernel = 1;
+    off_t copied = 0;
+    while (copied < length)
+    {
+        off_t remaining = length - copied;
+        size_t chunk = remaining < COPY_CHUNK ? remaining : COPY_CHUNK;
+        ssize_t n;
+        if (useKernel)
+        {
+            n = inIsPipe ? splice(inFd, NULL, outFd, NULL, chunk, SPLICE_F_MOVE) : sendfile(outFd, inFd, NULL, chunk);
+            statCall(inIsPipe ? CALL_SPLICE : CALL_SENDFILE, n);
+            if (n < 0 && isCopyFallbackError(errno))
+            {
+                useKernel = 0;
+                continue;
+            }
+        }
+        else
+        {
+            n = read(inFd, buffer, chunk < BLOCK_SIZE ? chunk : BLOCK_SIZE);
+            if (n > 0 && writeFully(outFd, buffer, n) != n)
+            {
+                n = -1;
+            }
+        }
+        if (n <= 0)
+        {
+            return n < 0 ? -1 : copied;
+        }
+        copied += n;
     }
-    else
+    return copied;
+}
+
+int isStreamVersion(TarHeader *header)
+{
+    return strcmp(header->magic_number, "ustar") == 0 &&
+           (memcmp(header->version_number, STREAM_VERSION, 2) == 0 ||
+            memcmp(header->version_number, STREAM_LEGACY_VERSION, 2) == 0);
+}
+
+int isStreamTar(int fd)
+{
+    TarHeader header;
+    return pread(fd, &header, sizeof(TarHeader), 0) == sizeof(TarHeader) && isStreamVersion(&header);
+}
+
+int openStreamInput(char *tarFilename)
+{
+    if (strcmp(tarFilename, "-") == 0)
     {
-        starting_block = fatTable->entries[lastOccupiedBlock].starting_block + fatTable->entries[lastOccupiedBlock].num_blocks;
+        return STDIN_FILENO;
     }
-
-    // Actualizar FAT
-    int currentBlock = findEmptyFatEntry(fatTable);
-    if (currentBlock == -1)
+    int fd = open(tarFilename, O_RDONLY);
+    if (fd >= 0 && !isStreamTar(fd))
     {
-        printf("ERROR: Se ha superado la cantidad maxima de datos.\n");
-        fclose(sourceFile);
-        return;
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    if (verbose == 2)
+int readStreamHeader(int fd)
+{
+    TarHeader header;
+    if (readFully(fd, &header, sizeof(TarHeader)) != sizeof(TarHeader) || !isStreamVersion(&header))
     {
-        printf("Actualizando estructura FAT...\n");
+        printf("ERROR: la entrada no es un TAR en formato de flujo.\n");
+        return -1;
     }
+    return 0;
+}
 
-    fatTable->entries[currentBlock].is_empty = 0;
-    fatTable->entries[currentBlock].starting_block = starting_block;
-    fatTable->entries[currentBlock].num_blocks = num_blocks;
-    strcpy(fatTable->entries[currentBlock].filename, filename);
-    fatTable->entries[currentBlock].file_size = file_size;
-    int offset = 0;
+int createStreamTar(int argc, char *argv[], int first)
+{
+    // Los datos salen por stdout, los mensajes se desvian a stderr
+    int outFd = dup(STDOUT_FILENO);
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
 
-    if (verbose == 2)
-    {
-        printf("Leyendo el contenido del archivo...\n");
-    }
-    // Usar buffer para escribir el archivo en el TAR
-    char buffer[BLOCK_SIZE];
-    while (fread(buffer, 1, BLOCK_SIZE, sourceFile) > 0)
-    {
-        fwrite(buffer, 1, BLOCK_SIZE, tarFile);
-        offset += BLOCK_SIZE;
+    TarHeader tarHeader;
+    memset(&tarHeader, 0, sizeof(TarHeader));
+    strcpy(tarHeader.magic_number, "ustar"); // Numero magico
+    memcpy(tarHeader.version_number, STREAM_VERSION, 2);
+    writeFully(outFd, &tarHeader, sizeof(TarHeader));
+    unsigned long long position = sizeof(TarHeader);
+
+    // Los directorios se recorren con un hilo: el flujo se escribe en orden
+    StreamMember *index = NULL;
+    unsigned int count = 0, capacity = 0;
+    char *names = NULL;
+    size_t namesLength = 0, namesCapacity = 0;
+    char *buffer = malloc(BLOCK_SIZE);
+    FileWalk *walk = startFileWalk(argv + first, argc - first, 1);
+    WalkedFile file;
+    while (nextWalkedFile(walk, &file))
+    {
+        const char *name = memberName(file.path);
+        size_t nameLength = strlen(name);
+        int sourceFd = nameLength > 0 && nameLength <= MAX_NAME_LENGTH ? open(file.path, O_RDONLY) : -1;
+        if (sourceFd < 0)
+        {
+            printf("ERROR: No se encontro el archivo %s\n", file.path);
+            free(file.path);
+            continue;
+        }
 
-        if (offset == file_size)
+        // Encabezado propio de cada archivo, su nombre si es largo y sus datos
+        if (count == capacity)
         {
-            break;
+            capacity = capacity ? capacity * 2 : 64;
+            index = realloc(index, capacity * sizeof(StreamMember));
+        }
+        StreamMember *member = &index[count];
+        memset(member, 0, sizeof(StreamMember));
+        memcpy(member->magic, STREAM_MEMBER, 4);
+        if (nameLength <= 12)
+        {
+            memcpy(member->filename, name, nameLength);
+        }
+        else
+        {
+            member->name_length = nameLength;
+            if (namesLength + nameLength > namesCapacity)
+            {
+                namesCapacity = (namesLength + nameLength) * 2;
+                names = realloc(names, namesCapacity);
+            }
+            memcpy(names + namesLength, name, nameLength);
+            namesLength += nameLength;
         }
+        member->file_size = file.st.st_size;
+        member->offset = position + sizeof(StreamMember) + member->name_length;
+        unsigned long long start = statStart();
+        if (writeFully(outFd, member, sizeof(StreamMember)) < 0 ||
+            writeFully(outFd, name, member->name_length) < 0 ||
+            streamFileRange(sourceFd, outFd, member->file_size, buffer) != (off_t)member->file_size)
+        {
+            // Un flujo truncado no se puede reparar: abortar
+            printf("ERROR: no se pudo escribir el archivo %s en el flujo\n", file.path);
+            close(sourceFd);
+            free(file.path);
+            finishFileWalk(walk);
+            free(buffer);
+            free(index);
+            free(names);
+            close(outFd);
+            return -1;
+        }
+        close(sourceFd);
+        statEnd(STAT_COPY, start);
+        statMember(name, member->file_size, start);
+        position = member->offset + member->file_size;
+        count++;
 
-        currentBlock = findEmptyFatEntry(fatTable);
-        if (currentBlock == -1)
+        if (verbose > 0)
         {
-            printf("ERROR: Se ha superado la cantidad maxima de datos.\n");
-            break;
+            printf("Archivo agregado al TAR: %s\n", file.path);
         }
-    }
+        free(file.path);
+    }
+    finishFileWalk(walk);
+    free(buffer);
+
+    // Trailer, indice, nombres largos (en el orden del indice) y trailer final
+    StreamMember trailer;
+    memset(&trailer, 0, sizeof(StreamMember));
+    memcpy(trailer.magic, STREAM_TRAILER, 4);
+    trailer.count = count;
+    trailer.offset = position + sizeof(StreamMember);
+    writeFully(outFd, &trailer, sizeof(StreamMember));
+    writeFully(outFd, index, count * sizeof(StreamMember));
+    writeFully(outFd, names, namesLength);
+    writeFully(outFd, &trailer, sizeof(StreamMember));
+    free(index);
+    free(names);
+    close(outFd);
+    return 0;
+}
 
-    fclose(sourceFile);
-    if (verbose == 2)
+int skipStreamBytes(int fd, off_t length, char *buffer)
+{
+    // En archivos se salta con lseek, en tuberias hay que leer y descartar
+    if (lseek(fd, length, SEEK_CUR) >= 0)
+    {
+        return 0;
+    }
+    while (length > 0)
     {
-        printf("Archivo agregado al TAR: %s, Tamaño: %d bytes, Bloques iniciales: %d, Bloques: %d\n", filename, file_size, fatTable->entries[currentBlock].starting_block, num_blocks);
+        ssize_t n = read(fd, buffer, length < BLOCK_SIZE ? length : BLOCK_SIZE);
+        if (n <= 0)
+        {
+            return -1;
+        }
+        length -= n;
     }
+    return 0;
 }
 
-void readTarFile(char *tarFilename)
+int readStreamName(int fd, StreamMember *member, char filename[MAX_NAME_LENGTH + 1])
 {
-    FILE *tarFile = fopen(tarFilename, "rb");
-    if (!tarFile)
+    // El nombre largo va despues del encabezado; el corto esta dentro
+    if (member->name_length == 0)
     {
-        printf("ERROR: No se encontro el archivo TAR: %s\n", tarFilename);
-        return;
+        memcpy(filename, member->filename, 12);
+        filename[12] = '\0';
+        return 0;
     }
-
-    if (verbose == 2)
+    if (member->name_length > MAX_NAME_LENGTH || readFully(fd, filename, member->name_length) != member->name_length)
     {
-        printf("Archivo %s cargado conexito.\n\n", tarFilename);
+        return -1;
     }
+    filename[member->name_length] = '\0';
+    return 0;
+}
 
-    // Calcular el offset despues del inicio del TAR
-    int offset = sizeof(FatTable) + sizeof(TarHeader);
-
-    // FAT
-    FatTable fatTable;
-    fseek(tarFile, 0, SEEK_SET);
-    fread(&fatTable, sizeof(FatTable), 1, tarFile);
-
-    if (verbose == 2)
+int readStreamTar(int fd, char **names, int numNames)
+{
+    if (readStreamHeader(fd) != 0)
     {
-        printf("Extrayendo estructura FAT...\n\n");
+        return -1;
     }
 
-    // Ciclar por todos los registros
-    for (int i = 0; i < 256; i++)
+    char *buffer = malloc(BLOCK_SIZE);
+    StreamMember member;
+    int status = 0;
+    while (readFully(fd, &member, sizeof(StreamMember)) == sizeof(StreamMember))
     {
-        if (fatTable.entries[i].is_empty)
+        if (memcmp(member.magic, STREAM_TRAILER, 4) == 0)
         {
-            continue; // Saltarse los vacios
+            break; // Fin de los datos
         }
-
-        // Obtener informacion del FAT
-        char filename[13];
-        strncpy(filename, fatTable.entries[i].filename, 12);
-        filename[12] = '\0';
-        int file_size = fatTable.entries[i].file_size;
-        int starting_block = fatTable.entries[i].starting_block;
-
-        // Archivo por extraer
-        FILE *outFile = fopen(filename, "wb");
-        if (!outFile)
+        if (memcmp(member.magic, STREAM_MEMBER, 4) != 0)
         {
-            printf("ERROR: no se pudo extraer el archivo %s\n", filename);
-            continue;
+            printf("ERROR: encabezado de archivo invalido dentro del flujo.\n");
+            status = -1;
+            break;
         }
 
-        if (verbose == 2)
+        char filename[MAX_NAME_LENGTH + 1];
+        if (readStreamName(fd, &member, filename) != 0)
         {
-            printf("Extrayendo el contenido del archivo %s.\n", filename);
+            printf("ERROR: encabezado de archivo invalido dentro del flujo.\n");
+            status = -1;
+            break;
         }
-        // Extract el archivo por bloques
-        int bytes_read = 0;
-        int currentBlock = starting_block;
-        char buffer[BLOCK_SIZE];
-        while (bytes_read < file_size)
+        if (numNames > 0 && !matchesAnyPattern(filename, names, numNames))
         {
-            int bytes_to_read = (file_size - bytes_read) < BLOCK_SIZE ? (file_size - bytes_read) : BLOCK_SIZE;
-            fseek(tarFile, offset + starting_block * BLOCK_SIZE + bytes_read, SEEK_SET);
-            int bytes_actually_read = fread(buffer, 1, bytes_to_read, tarFile);
-            
-            if (bytes_actually_read < bytes_to_read && feof(tarFile))
+            if (skipStreamBytes(fd, member.file_size, buffer) != 0)
             {
-                printf("ERROR: EOF encontrado dentro del bloque %d.\n", currentBlock);
+                printf("ERROR: EOF encontrado dentro del archivo %s.\n", filename);
+                status = -1;
                 break;
             }
-            else if (bytes_actually_read != bytes_to_read)
+            continue;
+        }
+
+        int outFd = -1;
+        if (isSafeMemberName(filename))
+        {
+            outFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (outFd < 0 && errno == ENOENT && createParentDirectories(filename) == 0)
+            {
+                outFd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            }
+        }
+        if (outFd < 0)
+        {
+            printf("ERROR: no se pudo extraer el archivo %s\n", filename);
+            status = -1;
+            if (skipStreamBytes(fd, member.file_size, buffer) != 0)
             {
-                printf("ERROR: No se pudo leer los bytes %d del bloque %d.\n", bytes_to_read, currentBlock);
                 break;
             }
-
-            fwrite(buffer, 1, bytes_actually_read, outFile);
-
-            bytes_read += bytes_actually_read;
-            currentBlock++;
+            continue;
+        }
+        unsigned long long start = statStart();
+        off_t copied = streamFileRange(fd, outFd, member.file_size, buffer);
+        close(outFd);
+        statEnd(STAT_COPY, start);
+        statMember(filename, copied > 0 ? copied : 0, start);
+        if (copied != (off_t)member.file_size)
+        {
+            printf("ERROR: EOF encontrado dentro del archivo %s.\n", filename);
+            status = -1;
+            break;
         }
 
-        fclose(outFile);
         if (verbose == 1)
         {
             printf("Archivo extraído: %s\n", filename);
         }
         else if (verbose == 2)
         {
-            printf("Archivo extraído: %s, Tamaño: %d bytes, Bloques iniciales: %d, Bloques: %d\n", filename, file_size, fatTable.entries[i].starting_block, fatTable.entries[i].num_blocks);
+            printf("Archivo extraído: %s, Tamaño: %llu bytes\n", filename, member.file_size);
         }
     }
+    free(buffer);
+    return status;
+}
 
-    fclose(tarFile);
+void printStreamMember(StreamMember *member, const char *filename)
+{
+    printf("| %-20s | %27llu | %15llu |\n", filename, member->offset, member->file_size);
+}
 
-    if (verbose == 2)
+void listStreamTar(int fd)
+{
+    printf("-------------------------------------------------------------------------\n");
+    printf("| %-20s | %-27s | %-15s |\n", "Filename", "Data Offset", "File Size");
+    printf("|----------------------|-----------------------------|-----------------|\n");
+
+    // Flujo guardado en disco: basta con leer el indice del final
+    StreamMember trailer;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t)sizeof(StreamMember) &&
+        pread(fd, &trailer, sizeof(StreamMember), st.st_size - sizeof(StreamMember)) == sizeof(StreamMember) &&
+        memcmp(trailer.magic, STREAM_TRAILER, 4) == 0)
+    {
+        // Los nombres largos siguen al indice, hasta el trailer final
+        off_t namesOffset = trailer.offset + (off_t)trailer.count * sizeof(StreamMember);
+        off_t namesLength = st.st_size - (off_t)sizeof(StreamMember) - namesOffset;
+        StreamMember *index = malloc((trailer.count + 1) * sizeof(StreamMember));
+        char *names = malloc(namesLength > 0 ? namesLength : 1);
+        if (namesLength < 0 ||
+            pread(fd, index, trailer.count * sizeof(StreamMember), trailer.offset) != (ssize_t)(trailer.count * sizeof(StreamMember)) ||
+            pread(fd, names, namesLength, namesOffset) != namesLength)
+        {
+            trailer.count = 0;
+        }
+        off_t used = 0;
+        for (unsigned int i = 0; i < trailer.count; i++)
+        {
+            char filename[MAX_NAME_LENGTH + 1];
+            unsigned int length = index[i].name_length;
+            if (length > MAX_NAME_LENGTH || used + length > namesLength)
+            {
+                break;
+            }
+            memcpy(filename, length > 0 ? names + used : index[i].filename, length > 0 ? length : 12);
+            filename[length > 0 ? length : 12] = '\0';
+            used += length;
+            printStreamMember(&index[i], filename);
+        }
+        free(names);
+        free(index);
+    }
+    else if (readStreamHeader(fd) == 0)
     {
-        printf("\nArchivo TAR cerrado exitosamente.\n\n");
+        // Tuberia: recorrer los encabezados saltando los datos
+        char *buffer = malloc(BLOCK_SIZE);
+        StreamMember member;
+        while (readFully(fd, &member, sizeof(StreamMember)) == sizeof(StreamMember) &&
+               memcmp(member.magic, STREAM_MEMBER, 4) == 0)
+        {
+            char filename[MAX_NAME_LENGTH + 1];
+            if (readStreamName(fd, &member, filename) != 0)
+            {
+                break;
+            }
+            printStreamMember(&member, filename);
+            if (skipStreamBytes(fd, member.file_size, buffer) != 0)
+            {
+                break;
+            }
+        }
+        free(buffer);
     }
+    printf("-------------------------------------------------------------------------\n");
 }
 
-void listTar(char *tar_filename)
+int readTarFile(char *tarFilename, int jobs, char **names, int numNames)
 {
-    FILE *tarFile = fopen(tar_filename, "rb");
-    if (!tarFile)
+    // Flujo por stdin o guardado en un archivo
+    int streamFd = openStreamInput(tarFilename);
+    if (streamFd >= 0)
     {
-        printf("ERROR: No se encontro el archivo %s.\n", tar_filename);
-        return;
+        int status = readStreamTar(streamFd, names, numNames);
+        if (streamFd != STDIN_FILENO)
+        {
+            close(streamFd);
+        }
+        return status;
     }
 
-    if (verbose > 0)
+    FatTable fatTable;
+    if (openTar(tarFilename, O_RDONLY, &fatTable) != 0)
     {
-        printf("Archivo %s cargado conexito.\n\n", tar_filename);
+        return -1;
     }
 
     if (verbose == 2)
     {
-        printf("Extrayendo estructura FAT...\n");
+        printf("Archivo %s cargado conexito.\n\n", tarFilename);
+        printf("Extrayendo estructura FAT...\n\n");
     }
-    // FAT
-    FatTable fatTable;
-    loadFatTableFromFile(&fatTable, tarFile);
 
-    if (verbose == 2)
-    {
-        printf("Imprimiendo tabla de archivos...\n");
-    }
-    printFatTable(&fatTable);
-    if (verbose == 2)
+    // Copiar los registros: los hilos comparten la lista sin tocar el directorio
+    ExtractPool pool;
+    memset(&pool, 0, sizeof(ExtractPool));
+    pool.tarFd = fatTable.fd;
+    pool.super = &fatTable.super;
+    pool.tails = loadTailMap(&fatTable);
+
+    int hasPatterns = 0;
+    for (int i = 0; i < numNames; i++)
     {
-        printf("Tabla de archivos desplegada con exito.\n");
+        hasPatterns |= isGlobPattern(names[i]);
     }
 
-    fclose(tarFile);
-    if (verbose == 2)
+    int status = 0;
+    int allFound = 1;
+    for (int i = 0; i < numNames && !hasPatterns; i++)
     {
-        printf("\nArchivo TAR cerrado exitosamente.\n\n");
+        allFound &= findFatEntry(&fatTable, names[i]) != NULL;
     }
-}
 
-void deleteFileFromTar(char *filename, char *tar_filename)
-{
-    FILE *tarFile = fopen(tar_filename, "rb+");
-    if (!tarFile)
+    // Los nombres se resuelven aqui: los hilos no leen la tabla de cadenas
+    char shortName[13];
+    if (numNames > 0 && !hasPatterns && allFound)
     {
-        printf("ERROR: No se encontro el archivo %s.\n", tar_filename);
-        return;
+        // Solo nombres exactos: una busqueda en el directorio por archivo
+        pool.jobs = malloc(numNames * sizeof(ExtractJob));
+        for (int i = 0; i < numNames; i++)
+        {
+            FatEntry *entry = findFatEntry(&fatTable, names[i]);
+            pool.jobs[pool.numJobs].entry = *entry;
+            pool.jobs[pool.numJobs].filename = strdup(fatEntryName(&fatTable, entry, shortName));
+            pool.jobs[pool.numJobs].message[0] = '\0';
+            pool.jobs[pool.numJobs].failed = 0;
+            pool.numJobs++;
+        }
     }
-
-    if (verbose > 0)
+    else
     {
-        printf("Archivo %s cargado conexito.\n\n", tar_filename);
+        // Todo el TAR, patrones o directorios: recorrer el directorio una vez
+        pool.jobs = malloc((fatTable.super.num_entries + 1) * sizeof(ExtractJob));
+        unsigned int bucket = 0, slot = 0;
+        FatEntry *entry;
+        while ((entry = nextFatEntry(&fatTable, &bucket, &slot)) != NULL)
+        {
+            const char *filename = fatEntryName(&fatTable, entry, shortName);
+            if (numNames > 0 && !matchesAnyPattern(filename, names, numNames))
+            {
+                continue;
+            }
+            pool.jobs[pool.numJobs].entry = *entry;
+            pool.jobs[pool.numJobs].filename = strdup(filename);
+            pool.jobs[pool.numJobs].message[0] = '\0';
+            pool.jobs[pool.numJobs].failed = 0;
+            pool.numJobs++;
+        }
+
+        for (int i = 0; i < numNames; i++)
+        {
+            if (!isGlobPattern(names[i]) && findFatEntry(&fatTable, names[i]) == NULL && !isUnderDirectory(&fatTable, names[i]))
+            {
+                printf("ERROR: Archivo no encontrado dentro del TAR: %s\n", names[i]);
+                status = -1;
+            }
+        }
     }
 
-    if (verbose == 2)
+    pool.numJobs = dropRepeatedJobs(pool.jobs, pool.numJobs);
+
+    // Procesar en orden fisico para que las lecturas sean secuenciales
+    pool.order = malloc((pool.numJobs + 1) * sizeof(unsigned int));
+    for (unsigned int i = 0; i < pool.numJobs; i++)
     {
-        printf("Extrayendo estructura FAT...\n");
+        pool.order[i] = i;
     }
-    // FAT
-    FatTable fatTable;
-    loadFatTableFromFile(&fatTable, tarFile);
+    extractJobsForSort = pool.jobs;
+    qsort(pool.order, pool.numJobs, sizeof(unsigned int), compareExtractOrder);
 
-    // Buscar archivo
-    int fileIndex = -1;
-    for (int i = 0; i < 256; i++)
+    // Agrupar los archivos consecutivos que comparten un bloque de colas
+    pool.groups = malloc((pool.numJobs + 1) * sizeof(unsigned int));
+    for (unsigned int i = 0; i < pool.numJobs; i++)
     {
-        if (!fatTable.entries[i].is_empty && strcmp(fatTable.entries[i].filename, filename) == 0)
+        FatEntry *entry = &pool.jobs[pool.order[i]].entry;
+        FatEntry *previous = i > 0 ? &pool.jobs[pool.order[i - 1]].entry : NULL;
+        if (previous == NULL || !(entry->flags & FAT_TAIL) || !(previous->flags & FAT_TAIL) ||
+            previous->starting_block != entry->starting_block)
         {
-            fileIndex = i;
-            break;
+            pool.groups[pool.numGroups++] = i;
         }
     }
+    pool.groups[pool.numGroups] = pool.numJobs;
+
+    runWorkers(extractWorker, &pool, jobs, pool.numGroups);
 
-    if (fileIndex == -1)
+    // Los mensajes se imprimen en el orden del directorio sin importar los hilos
+    for (unsigned int i = 0; i < pool.numJobs; i++)
     {
-        printf("ERROR: Archivo no encontrado dentro del TAR: %s\n", filename);
-        fclose(tarFile);
+        fputs(pool.jobs[i].message, stdout);
+        if (pool.jobs[i].failed)
+        {
+            status = -1;
+        }
+        free(pool.jobs[i].filename);
+    }
+    free(pool.groups);
+    free(pool.order);
+    free(pool.jobs);
+
+    closeTar(&fatTable);
+
+    if (verbose == 2)
+    {
+        printf("\nArchivo TAR cerrado exitosamente.\n\n");
+    }
+    return status;
+}
+
+int parseRange(const char *text, long long *offset, long long *length)
+{
+    // off:len, con len vacio hasta el final y off negativo contado desde el final
+    char *end;
+    *offset = strtoll(text, &end, 10);
+    if (end == text || *end != ':')
+    {
+        return -1;
+    }
+    text = end + 1;
+    *length = -1;
+    if (*text != '\0')
+    {
+        *length = strtoll(text, &end, 10);
+        if (*end != '\0' || *length < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int parseBudget(const char *text, unsigned long long *nanos, unsigned long long *bytes)
+{
+    // Tiempo (500ms, 2s, 10min, 1h) o bytes (512M, 1GB, 2T) para -p --budget
+    const char *units[] = {"ms", "s", "min", "h", "b", "k", "kb", "m", "mb", "g", "gb", "t", "tb"};
+    const unsigned long long scale[] = {1000000ULL, 1000000000ULL, 60000000000ULL, 3600000000000ULL,
+                                        1, 1ULL << 10, 1ULL << 10, 1ULL << 20, 1ULL << 20, 1ULL << 30, 1ULL << 30, 1ULL << 40, 1ULL << 40};
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value <= 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < 13; i++)
+    {
+        if (strcasecmp(end, units[i]) == 0)
+        {
+            unsigned long long amount = value * scale[i];
+            *(i < 4 ? nanos : bytes) = amount > 0 ? amount : 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int writeTarMembers(char *tarFilename, char **names, int numNames, long long rangeOffset, long long rangeLength)
+{
+    // Los datos van a stdout; los mensajes, a stderr. Devuelve -1 si algun
+    // archivo no se escribio completo
+    TarArchive *archive = tarOpen(tarFilename);
+    if (archive == NULL)
+    {
+        fprintf(stderr, "ERROR: no se pudo abrir el TAR %s: %s\n", tarFilename, strerror(errno));
+        return -1;
+    }
+    int status = 0;
+    char *buffer = malloc(BLOCK_SIZE);
+    for (int i = 0; i < numNames; i++)
+    {
+        const TarMember *member = tarLookup(archive, names[i]);
+        if (member == NULL)
+        {
+            fprintf(stderr, "ERROR: Archivo no encontrado dentro del TAR: %s\n", names[i]);
+            status = -1;
+            continue;
+        }
+
+        // El final del rango se recorta al tamanno del archivo; un inicio
+        // despues del final es un error
+        off_t size = tarMemberSize(member);
+        off_t offset = rangeOffset < 0 ? size + rangeOffset : rangeOffset;
+        if (offset < 0)
+        {
+            offset = 0;
+        }
+        if (offset > size)
+        {
+            fprintf(stderr, "ERROR: el rango empieza despues del final de %s (%lld bytes)\n", names[i], (long long)size);
+            status = -1;
+            continue;
+        }
+        off_t length = rangeLength < 0 || rangeLength > size - offset ? size - offset : rangeLength;
+        if (tarVerifyRange(archive, member, offset, length) != 0)
+        {
+            fprintf(stderr, "ERROR: bloque corrupto, no se leyo el archivo %s\n", names[i]);
+            status = -1;
+            continue;
+        }
+        if (verbose > 0)
+        {
+            fprintf(stderr, "Leyendo %s: %lld bytes desde %lld\n", names[i], (long long)length, (long long)offset);
+        }
+
+        // Sin copias cuando los datos estan en el TAR tal cual
+        unsigned long long start = statStart();
+        off_t requested = length;
+        while (length > 0)
+        {
+            size_t available = length;
+            const void *data = tarSlice(archive, member, offset, &available);
+            ssize_t bytesRead = available;
+            if (data == NULL)
+            {
+                bytesRead = tarRead(archive, member, offset, buffer, length < BLOCK_SIZE ? length : BLOCK_SIZE);
+                data = buffer;
+            }
+            if (bytesRead <= 0 || writeFully(STDOUT_FILENO, data, bytesRead) != bytesRead)
+            {
+                fprintf(stderr, "ERROR: no se pudo leer el contenido de %s\n", names[i]);
+                status = -1;
+                break;
+            }
+            offset += bytesRead;
+            length -= bytesRead;
+        }
+        statEnd(STAT_COPY, start);
+        statMember(names[i], requested - length, start);
+    }
+    free(buffer);
+    tarClose(archive);
+    return status;
+}
+
+void listTar(char *tar_filename)
+{
+    int streamFd = openStreamInput(tar_filename);
+    if (streamFd >= 0)
+    {
+        listStreamTar(streamFd);
+        if (streamFd != STDIN_FILENO)
+        {
+            close(streamFd);
+        }
         return;
     }
 
-    if (verbose > 0)
+    FatTable fatTable;
+    if (openTar(tar_filename, O_RDONLY, &fatTable) != 0)
     {
-        printf("Eliminando archivo %s...\n", filename);
+        return;
     }
-    // Marcar registro como vacio
-    fatTable.entries[fileIndex].is_empty = 1;
-    fatTable.entries[fileIndex].file_size = 0;
-    strcpy(fatTable.entries[fileIndex].filename, "");
 
-    // Actualizar TAR
-    fseek(tarFile, 0, SEEK_SET);
-    saveFatTableToFile(&fatTable, tarFile);
+    if (verbose > 0)
+    {
+        printf("Archivo %s cargado conexito.\n\n", tar_filename);
+    }
 
     if (verbose == 2)
     {
-        printf("Actualizando la estructura FAT...\n");
+        printf("Imprimiendo tabla de archivos...\n");
+    }
+    printFatTable(&fatTable);
+    if (verbose == 2)
+    {
+        printf("Tabla de archivos desplegada con exito.\n");
     }
 
-    fclose(tarFile);
+    closeTar(&fatTable);
     if (verbose == 2)
     {
         printf("\nArchivo TAR cerrado exitosamente.\n\n");
     }
-    printf("Archivo eliminado del TAR: %s\n", filename);
 }
 
-void updateFileFromTar(char *filename, char *tar_filename)
+int deleteFilesFromTar(char **names, int numNames, char *tar_filename)
 {
-    FILE *tarFile = fopen(tar_filename, "rb+");
-    if (!tarFile)
+    FatTable fatTable;
+    if (openTar(tar_filename, O_RDWR, &fatTable) != 0)
     {
-        printf("ERROR: No se encontro el archivo %s.\n", tar_filename);
-        return;
+        return -1;
     }
 
     if (verbose > 0)
@@ -431,181 +967,1812 @@ void updateFileFromTar(char *filename, char *tar_filename)
         printf("Archivo %s cargado conexito.\n\n", tar_filename);
     }
 
+    // Todos los archivos se eliminan en una sola transaccion
+    unsigned char *deleted = calloc(numNames, 1);
+    int numDeleted = 0;
+    for (int i = 0; i < numNames; i++)
+    {
+        FatEntry *entry = findFatEntry(&fatTable, memberName(names[i]));
+        if (entry == NULL)
+        {
+            printf("ERROR: Archivo no encontrado dentro del TAR: %s\n", names[i]);
+            continue;
+        }
+
+        // Devolver los bloques al mapa de espacio libre y marcar registro como vacio
+        releaseMemberBlocks(&fatTable, entry);
+        removeFatEntry(&fatTable, entry);
+        deleted[i] = 1;
+        numDeleted++;
+    }
+    if (numDeleted == 0)
+    {
+        free(deleted);
+        closeTar(&fatTable);
+        return -1;
+    }
+
+    // Actualizar TAR
+    if (verbose == 2)
+    {
+        printf("Actualizando la estructura FAT...\n");
+    }
+    saveFatTableToFile(&fatTable);
+
+    closeTar(&fatTable);
     if (verbose == 2)
     {
-        printf("Extrayendo estructura FAT...\n");
+        printf("\nArchivo TAR cerrado exitosamente.\n\n");
+    }
+    for (int i = 0; i < numNames; i++)
+    {
+        if (deleted[i])
+        {
+            printf("Archivo eliminado del TAR: %s\n", names[i]);
+        }
     }
-    // FAT
+    free(deleted);
+    return numDeleted < numNames ? -1 : 0;
+}
+
+#define DELTA_JOURNAL_BLOCKS 16 // Bloques cambiados que -u reescribe en su lugar (por el diario)
+
+int updateFileFromTar(char *filename, char *tar_filename)
+{
     FatTable fatTable;
-    loadFatTableFromFile(&fatTable, tarFile);
+    if (openTar(tar_filename, O_RDWR, &fatTable) != 0)
+    {
+        return -1;
+    }
+
+    if (verbose > 0)
+    {
+        printf("Archivo %s cargado conexito.\n\n", tar_filename);
+    }
 
     if (verbose == 2)
     {
         printf("Buscando archivo: %s...\n", filename);
     }
     // Buscar archivo
-    int fileIndex = -1;
-    for (int i = 0; i < 256; i++)
+    FatEntry *entry = findFatEntry(&fatTable, memberName(filename));
+    if (entry == NULL)
+    {
+        printf("ERROR: Archivo no encontrado dentro del TAR: %s\n", filename);
+        closeTar(&fatTable);
+        return -1;
+    }
+
+    if (verbose > 0)
+    {
+        printf("Actualizando informacion de: %s...\n", filename);
+    }
+    // Abrir nueva version del archivo
+    int newFd = open(filename, O_RDONLY);
+    if (newFd < 0)
+    {
+        printf("Error opening new version of the file: %s\n", filename);
+        closeTar(&fatTable);
+        return -1;
+    }
+
+    if (verbose == 2)
     {
-        if (!fatTable.entries[i].is_empty && strcmp(fatTable.entries[i].filename, filename) == 0)
+        printf("Calculando la cantidad de bloques requeridos para %s...\n", filename);
+    }
+    // Calcular el numero de bloques del archivo
+    struct stat st;
+    fstat(newFd, &st);
+    unsigned long long newFileSize = st.st_size;
+    unsigned int newNumBlocks = (newFileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    SparseRegion *regions = NULL;
+    int numRegions = -1;
+    if (!(entry->flags & (FAT_COMPRESSED | FAT_DEDUP)))
+    {
+        numRegions = findSparseRegions(newFd, newFileSize, &regions);
+    }
+
+    if ((entry->flags & (FAT_COMPRESSED | FAT_DEDUP | FAT_TAIL | FAT_SPARSE)) || entry->num_blocks == 0 || numRegions >= 0)
+    {
+        // Un archivo comprimido, deduplicado, en un bloque de colas, disperso
+        // o vacio cambia de forma de guardarse: se reescribe en una ubicacion nueva
+        FatEntry old = *entry;
+        IngestPool pool;
+        initIngestPool(&pool, tar_filename, &fatTable);
+        IngestJob *job = reserveIngestJob(&pool);
+        memset(job, 0, sizeof(IngestJob));
+        job->filename = filename;
+        job->file_size = newFileSize;
+        job->regions = regions;
+        job->num_regions = numRegions > 0 ? numRegions : 0;
+        planMemberLayout(&fatTable, entry, job, entry->flags & (FAT_COMPRESSED | FAT_DEDUP));
+
+        loadDedupIndex(&fatTable);
+        publishIngestJob(&pool);
+        closeIngestPool(&pool);
+        runWorkers(ingestWorker, &pool, 1, 1);
+        fputs(job->message, stdout);
+        if (job->failed)
         {
-            fileIndex = i;
-            break;
+            free(job->blocks);
+            free(job->list);
+            free(job->regions);
+            freeIngestPool(&pool);
+            *entry = old;
+            close(newFd);
+            closeTar(&fatTable);
+            return -1;
         }
+        finishIngestJob(&fatTable, job);
+        freeIngestPool(&pool);
+        markFatEntryDirty(&fatTable, entry);
+        releaseMemberBlocks(&fatTable, &old);
+        saveFatTableToFile(&fatTable);
+
+        close(newFd);
+        closeTar(&fatTable);
+        printf("Archivo modifocado en TAR: %s\n", filename);
+        return 0;
     }
 
-    if (fileIndex == -1)
+    if (verbose == 2)
     {
-        printf("ERROR: Archivo no encontrado dentro del TAR: %s\n", filename);
-        fclose(tarFile);
-        return;
+        printf("Ubicando el archivo dentro del TAR...\n");
+    }
+    // Comparar primero los bloques que ya estan en el TAR. La FAT en disco
+    // todavia los usa: los que cambiaron se reescriben por el diario y, si son
+    // muchos, el archivo completo va a una extension nueva
+    posix_fadvise(newFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    unsigned long long start = statStart();
+    unsigned int comparable = entry->num_blocks < newNumBlocks ? entry->num_blocks : newNumBlocks;
+    unsigned char *changed = calloc(comparable + 1, 1);
+    unsigned int numChanged = 0;
+    char *buffer = malloc(BLOCK_SIZE);
+    char *stored = malloc(BLOCK_SIZE);
+    for (unsigned int i = 0; i < comparable; i++)
+    {
+        unsigned int length = blockLength(newFileSize, i);
+        if (readFully(newFd, buffer, length) != (ssize_t)length)
+        {
+            printf("ERROR: no se pudo leer completo el archivo %s\n", filename);
+            free(changed);
+            free(buffer);
+            free(stored);
+            close(newFd);
+            closeTar(&fatTable);
+            return -1;
+        }
+        // Un CRC32 igual no garantiza datos iguales: antes de saltar el
+        // bloque se comparan sus bytes con los que estan en el TAR
+        BlockInfo *info = loadBlockInfo(&fatTable, entry->starting_block + i);
+        if (info->length != length || info->crc != crc32cUpdate(0, buffer, length) ||
+            pread(fatTable.fd, stored, length, blockOffset(entry->starting_block + i)) != (ssize_t)length ||
+            memcmp(stored, buffer, length) != 0)
+        {
+            changed[i] = 1;
+            numChanged++;
+        }
+    }
+    free(stored);
+
+    // Ajustar la extension al nuevo tamanno: recortar, crecer en su lugar o reubicar
+    int relocate = numChanged > DELTA_JOURNAL_BLOCKS;
+    if (!relocate && newNumBlocks < entry->num_blocks)
+    {
+        releaseBlocks(&fatTable, entry->starting_block + newNumBlocks, entry->num_blocks - newNumBlocks);
+    }
+    else if (!relocate && newNumBlocks > entry->num_blocks && !extendBlocks(&fatTable, entry->starting_block, entry->num_blocks, newNumBlocks))
+    {
+        relocate = 1; // Sin espacio contiguo
+    }
+    if (relocate)
+    {
+        unsigned int starting_block = allocateBlocks(&fatTable, newNumBlocks);
+        releaseBlocks(&fatTable, entry->starting_block, entry->num_blocks);
+        entry->starting_block = starting_block;
+        comparable = 0;
+    }
+    entry->num_blocks = newNumBlocks;
+
+    // Escribir los bloques que cambiaron y los nuevos
+    unsigned int rewritten = 0, journaled = 0;
+    for (unsigned int i = 0; i < newNumBlocks; i++)
+    {
+        if (i < comparable && !changed[i])
+        {
+            continue;
+        }
+        unsigned int length = blockLength(newFileSize, i);
+        off_t offset = blockOffset(entry->starting_block + i);
+        if (lseek(newFd, (off_t)i * BLOCK_SIZE, SEEK_SET) < 0 || readFully(newFd, buffer, length) != (ssize_t)length)
+        {
+            printf("ERROR: no se pudo leer completo el archivo %s\n", filename);
+            free(changed);
+            free(buffer);
+            close(newFd);
+            closeTar(&fatTable);
+            return -1;
+        }
+        if (i < comparable)
+        {
+            journalWrite(&fatTable, buffer, length, offset);
+            journaled++;
+        }
+        else if (pwrite(fatTable.fd, buffer, length, offset) != length)
+        {
+            printf("ERROR: no se pudo escribir el bloque %u\n", entry->starting_block + i);
+            free(changed);
+            free(buffer);
+            close(newFd);
+            closeTar(&fatTable);
+            return -1;
+        }
+        setBlockInfo(&fatTable, entry->starting_block + i, crc32cUpdate(0, buffer, length), length);
+        rewritten++;
+    }
+    free(changed);
+    free(buffer);
+    posix_fadvise(newFd, 0, 0, POSIX_FADV_DONTNEED);
+    statEnd(STAT_COPY, start);
+    statMember(filename, newFileSize, start);
+
+    if (verbose > 0)
+    {
+        printf("Bloques reescritos: %u de %u\n", rewritten, newNumBlocks);
+    }
+
+    if (verbose == 2)
+    {
+        printf("Actualizando la estructura FAT...\n");
+    }
+
+    // Actualizar FAT. Los bloques que van por el diario solo llegan a su
+    // lugar al confirmar, asi que con --serve se guarda de inmediato
+    entry->file_size = newFileSize;
+    markFatEntryDirty(&fatTable, entry);
+    if (journaled > 0)
+    {
+        flushFatTable(&fatTable);
+    }
+    else
+    {
+        saveFatTableToFile(&fatTable);
+    }
+
+    close(newFd);
+    closeTar(&fatTable);
+
+    if (verbose == 2)
+    {
+        printf("\nArchivo TAR cerrado exitosamente.\n\n");
+    }
+
+    printf("Archivo modifocado en TAR: %s\n", filename);
+    return 0;
+}
+
+typedef struct Relocation
+{
+    unsigned int old_start; // Bloque inicial antes de compactar
+    unsigned int length;    // Cantidad de bloques
+    unsigned int new_start; // Bloque inicial despues de compactar
+} Relocation;
+
+double elapsedSeconds(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+unsigned int relocateBlock(Relocation *relocations, unsigned int count, unsigned int block)
+{
+    // Busqueda binaria de la extension que contiene el bloque
+    unsigned int low = 0, high = count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (relocations[mid].old_start + relocations[mid].length <= block)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low < count && relocations[low].old_start <= block)
+    {
+        return block - relocations[low].old_start + relocations[low].new_start;
+    }
+    return block;
+}
+
+int compareRelocations(const void *a, const void *b)
+{
+    const Relocation *x = a, *y = b;
+    return x->old_start < y->old_start ? -1 : x->old_start > y->old_start;
+}
+
+void remapDedupList(FatTable *fatTable, FatEntry *entry, Relocation *relocations, unsigned int numRelocations)
+{
+    // Reescribir la lista de bloques de datos con sus nuevas posiciones
+    unsigned int numData = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int listSize = dedupListSize(entry->file_size);
+    unsigned int *list = malloc(listSize + sizeof(unsigned int));
+    if (pread(fatTable->fd, list, listSize, dedupListOffset(entry)) == (ssize_t)listSize)
+    {
+        unsigned int oldCrc = crc32cUpdate(0, (char *)list, listSize);
+        for (unsigned int i = 0; i < numData; i++)
+        {
+            list[i] = relocateBlock(relocations, numRelocations, list[i]);
+        }
+        // La FAT en disco sigue usando la lista anterior hasta confirmar el paso
+        journalWrite(fatTable, list, listSize, dedupListOffset(entry));
+        if (entry->flags & FAT_TAIL)
+        {
+            // Una lista en un bloque de colas cambia solo su parte del CRC del bloque
+            applyTailChecksum(fatTable, entry->starting_block, entry->tail_offset * TAIL_ALIGN, listSize, oldCrc, crc32cUpdate(0, (char *)list, listSize));
+            free(list);
+            return;
+        }
+
+        // El CRC sale de la lista en memoria, sin releerla
+        BlockInfo *blocks = calloc(entry->num_blocks + 1, sizeof(BlockInfo));
+        ExtentCrc check;
+        startExtentCrc(&check, blocks, entry->num_blocks);
+        checksumBytes(&check, 0, (char *)list, listSize);
+        finishExtentCrc(&check);
+        for (unsigned int i = 0; i < entry->num_blocks; i++)
+        {
+            setBlockInfo(fatTable, entry->starting_block + i, blocks[i].crc, blocks[i].length);
+        }
+        free(blocks);
+    }
+    free(list);
+}
+
+// Archivo de un bloque de colas; block no cambia aunque el bloque se mueva en el paso
+typedef struct TailRef
+{
+    unsigned int block; // Bloque de colas al recolectar
+    FatEntry *entry;    // Archivo guardado en el bloque
+} TailRef;
+
+int compareTailRefs(const void *a, const void *b)
+{
+    const TailRef *x = a, *y = b;
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+// Bloque de colas con los bytes que todavia usan sus archivos (-p)
+typedef struct TailUsage
+{
+    unsigned int block;      // Bloque de colas
+    unsigned int live;       // Bytes ocupados (alineados)
+    unsigned int first;      // Primer archivo del bloque en la lista de TailRef
+    unsigned int numMembers; // Archivos del bloque
+} TailUsage;
+
+int compareTailUsage(const void *a, const void *b)
+{
+    const TailUsage *x = a, *y = b;
+    return x->live < y->live ? -1 : x->live > y->live;
+}
+
+unsigned long long repackTailBlocks(FatTable *fatTable, unsigned int maxBlocks)
+{
+    // Vaciar los bloques de colas con menos datos en los espacios libres de
+    // los demas, hasta dejar los bloques que hacen falta para lo que guardan
+    // (a lo mas maxBlocks por llamada, 0 = sin limite). Los archivos se
+    // copian a espacio que la FAT en disco no usa y sus lugares anteriores se
+    // liberan al guardarla: los bloques vaciados quedan libres en la misma
+    // transaccion. Devuelve los bytes movidos.
+    TailMap *tails = loadTailMap(fatTable);
+    unsigned int numRefs = 0, capacity = 64;
+    TailRef *refs = malloc(capacity * sizeof(TailRef));
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
+    {
+        if (entry->flags & FAT_TAIL)
+        {
+            if (numRefs == capacity)
+            {
+                capacity *= 2;
+                refs = realloc(refs, capacity * sizeof(TailRef));
+            }
+            TailRef ref = {entry->starting_block, entry};
+            refs[numRefs++] = ref;
+        }
+    }
+    qsort(refs, numRefs, sizeof(TailRef), compareTailRefs);
+
+    TailUsage *usage = malloc((numRefs + 1) * sizeof(TailUsage));
+    unsigned int numUsed = 0;
+    unsigned long long totalLive = 0;
+    for (unsigned int i = 0; i < numRefs; i++)
+    {
+        if (i == 0 || refs[i].block != refs[i - 1].block)
+        {
+            TailUsage block = {refs[i].block, 0, i, 0};
+            usage[numUsed++] = block;
+        }
+        unsigned int aligned = (tailMemberSize(refs[i].entry) + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+        usage[numUsed - 1].live += aligned;
+        usage[numUsed - 1].numMembers++;
+        totalLive += aligned;
+    }
+    unsigned int needed = (totalLive + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned int numEmpty = numUsed > needed ? numUsed - needed : 0;
+    if (maxBlocks > 0 && numEmpty > maxBlocks)
+    {
+        numEmpty = maxBlocks;
+    }
+    qsort(usage, numUsed, sizeof(TailUsage), compareTailUsage);
+    for (unsigned int i = 0; i < numEmpty; i++)
+    {
+        retireTailBlock(fatTable, usage[i].block, 1);
+    }
+
+    if (verbose == 2 && numEmpty > 0)
+    {
+        printf("Vaciando %u de %u bloques de colas...\n", numEmpty, numUsed);
+    }
+    char *buffer = malloc(BLOCK_SIZE);
+    unsigned long long bytesMoved = 0;
+    int full = 0;
+    for (unsigned int i = 0; i < numEmpty && !full; i++)
+    {
+        // Leer el bloque completo y comprobarlo antes de repartir sus archivos
+        unsigned int block = usage[i].block;
+        BlockInfo info = *loadBlockInfo(fatTable, block);
+        unsigned int length = info.length > 0 && info.length <= BLOCK_SIZE ? info.length : BLOCK_SIZE;
+        if (pread(fatTable->fd, buffer, length, blockOffset(block)) != length)
+        {
+            printf("ERROR: no se pudo leer el bloque de colas %u.\n", block);
+            continue;
+        }
+        maskTailHoles(tails, block, buffer, length);
+        if (info.length > 0 && crc32cUpdate(0, buffer, info.length) != info.crc)
+        {
+            printf("ERROR: bloque %u corrupto, sus archivos no se movieron.\n", block);
+            continue;
+        }
+
+        for (unsigned int j = usage[i].first; j < usage[i].first + usage[i].numMembers; j++)
+        {
+            FatEntry *member = refs[j].entry;
+            unsigned int offset = member->tail_offset * TAIL_ALIGN;
+            unsigned int size = tailMemberSize(member);
+            unsigned int aligned = (size + TAIL_ALIGN - 1) / TAIL_ALIGN * TAIL_ALIGN;
+            // Sin espacio en los bloques que quedan no se abre otro
+            if (bestFitExtent(&tails->space, aligned) == NULL)
+            {
+                full = 1;
+                break;
+            }
+            if (offset + size > length || storeTailMember(fatTable, member, buffer + offset, size) != 0)
+            {
+                printf("ERROR: no se pudo mover el archivo del bloque de colas %u.\n", block);
+                break;
+            }
+            releaseTail(fatTable, block, offset, size, 1);
+            markFatEntryDirty(fatTable, member);
+            bytesMoved += aligned;
+        }
+    }
+    for (unsigned int i = 0; i < numEmpty; i++)
+    {
+        retireTailBlock(fatTable, usage[i].block, 0);
+    }
+    free(buffer);
+    free(usage);
+    free(refs);
+    return bytesMoved;
+}
+
+#define PACK_STEP (256 * 1024 * 1024) // Bytes movidos entre dos guardados de la FAT en -p
+#define PACK_SLIDE (PACK_STEP / 8)    // Espacio libre minimo para bajar extensiones sin pasar por el final
+
+typedef struct PackUnit
+{
+    unsigned int start;  // Primer bloque
+    unsigned int length; // Cantidad de bloques
+    unsigned int origin; // Primer bloque al recolectar (ubica los archivos de un bloque de colas)
+    FatEntry *entry;     // Archivo duenno de la extension (o NULL)
+    unsigned int *field; // Campo del superbloque que la ubica (metadatos, o NULL)
+    unsigned int *size;  // Campo del superbloque con su largo (metadatos)
+    int tail;            // Bloque de colas
+    int shared;          // Bloque compartido de --dedup
+} PackUnit;
+
+// Una compactacion (-p) en curso: lo que se puede mover y los bloques
+// compartidos que el paso actual ya movio
+typedef struct PackPass
+{
+    PackUnit *units;              // De la ultima extension a la primera
+    unsigned int numUnits;        // Extensiones en units
+    TailRef *tailMembers;         // Archivos en bloques de colas, por bloque
+    unsigned int numTailMembers;  // Archivos en tailMembers
+    Relocation *shared;           // Bloques compartidos movidos en el paso
+    unsigned int numShared;       // Bloques en shared
+    unsigned int sharedCapacity;  // Capacidad de shared
+    char *buffer;                 // Buffer de copia
+    unsigned long long stepBytes; // Bytes copiados en el paso
+    unsigned long long bytesMoved; // Bytes copiados en total
+    unsigned int numMoved;        // Extensiones movidas
+    unsigned int steps;           // Pasos guardados
+    unsigned long long budgetNanos; // Limite de tiempo de --budget (0 sin limite)
+    unsigned long long budgetBytes; // Limite de bytes de --budget (0 sin limite)
+    unsigned long long startNanos;  // Inicio de la compactacion
+} PackPass;
+
+int packBudgetSpent(PackPass *pass)
+{
+    return (pass->budgetNanos > 0 && monotonicNanos() - pass->startNanos >= pass->budgetNanos) ||
+           (pass->budgetBytes > 0 && pass->bytesMoved >= pass->budgetBytes);
+}
+
+int comparePackUnits(const void *a, const void *b)
+{
+    // De la ultima a la primera: se llenan los huecos con lo del final del TAR
+    const PackUnit *x = a, *y = b;
+    return x->start < y->start ? 1 : x->start > y->start ? -1 : 0;
+}
+
+void pushPackUnit(PackUnit **units, unsigned int *count, unsigned int *capacity, PackUnit unit)
+{
+    if (*count == *capacity)
+    {
+        *capacity *= 2;
+        *units = realloc(*units, *capacity * sizeof(PackUnit));
+    }
+    (*units)[(*count)++] = unit;
+}
+
+void collectPackUnits(FatTable *fatTable, PackPass *pass)
+{
+    // Todo lo que se puede mover: extensiones de archivos, bloques de colas,
+    // bloques compartidos de --dedup y metadatos
+    unsigned int count = 0, capacity = 64;
+    PackUnit *units = malloc(capacity * sizeof(PackUnit));
+    pass->numTailMembers = 0;
+    unsigned int tailCapacity = 64;
+    pass->tailMembers = malloc(tailCapacity * sizeof(TailRef));
+
+    SuperBlock *super = &fatTable->super;
+    unsigned int *fields[][2] = {
+        {&super->dir_start_block, &super->dir_num_blocks}, {&super->btab_start_block, &super->btab_num_blocks},
+        {&super->fmap_start_block, &super->fmap_num_blocks}, {&super->dedup_start_block, &super->dedup_num_blocks},
+        {&super->tail_start_block, &super->tail_num_blocks}, {&super->strtab_start_block, &super->strtab_num_blocks},
+        {&super->journal_start_block, &super->journal_num_blocks}};
+    for (int i = 0; i < 7; i++)
+    {
+        if (*fields[i][1] > 0)
+        {
+            PackUnit unit = {*fields[i][0], *fields[i][1], *fields[i][0], NULL, fields[i][0], fields[i][1], 0, 0};
+            pushPackUnit(&units, &count, &capacity, unit);
+        }
+    }
+
+    TailMap *tails = loadTailMap(fatTable);
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
+    {
+        if (entry->flags & FAT_TAIL)
+        {
+            if (pass->numTailMembers == tailCapacity)
+            {
+                tailCapacity *= 2;
+                pass->tailMembers = realloc(pass->tailMembers, tailCapacity * sizeof(TailRef));
+            }
+            TailRef ref = {entry->starting_block, entry};
+            pass->tailMembers[pass->numTailMembers++] = ref;
+            continue;
+        }
+        if (entry->num_blocks == 0)
+        {
+            continue;
+        }
+        PackUnit unit = {entry->starting_block, entry->num_blocks, entry->starting_block, entry, NULL, NULL, 0, 0};
+        pushPackUnit(&units, &count, &capacity, unit);
+    }
+    for (unsigned int i = 0; i < tails->count; i++)
+    {
+        unsigned int block = tails->blocks[i].tail.block;
+        PackUnit unit = {block, 1, block, NULL, NULL, NULL, 1, 0};
+        pushPackUnit(&units, &count, &capacity, unit);
+    }
+    DedupIndex *index = loadDedupIndex(fatTable);
+    for (unsigned int i = 0; i < index->count; i++)
+    {
+        unsigned int block = index->byBlock[i].block;
+        PackUnit unit = {block, 1, block, NULL, NULL, NULL, 0, 1};
+        pushPackUnit(&units, &count, &capacity, unit);
+    }
+
+    qsort(units, count, sizeof(PackUnit), comparePackUnits);
+    qsort(pass->tailMembers, pass->numTailMembers, sizeof(TailRef), compareTailRefs);
+    pass->units = units;
+    pass->numUnits = count;
+}
+
+void refreshPackUnit(PackUnit *unit)
+{
+    // Guardar la FAT puede reubicar un metadato (o liberarlo): se toma su
+    // posicion actual del superbloque
+    if (unit->field != NULL)
+    {
+        unit->start = *unit->field;
+        unit->length = *unit->size;
+    }
+}
+
+void freePackPass(PackPass *pass)
+{
+    free(pass->units);
+    free(pass->tailMembers);
+    pass->units = NULL;
+    pass->tailMembers = NULL;
+    pass->numUnits = 0;
+}
+
+int movePackUnit(FatTable *fatTable, PackPass *pass, PackUnit *unit, unsigned int to)
+{
+    // Copiar a bloques ya reservados que la FAT en disco no usa: sigue valida
+    // hasta que se guarda la nueva, y lo liberado queda retenido hasta entonces
+    unsigned int from = unit->start;
+    int isJournal = unit->field == &fatTable->super.journal_start_block;
+    if (!isJournal)
+    {
+        if (pass->buffer == NULL)
+        {
+            pass->buffer = malloc(BLOCK_SIZE);
+        }
+        unsigned long long start = statStart();
+        off_t copied = copyFileRange(fatTable->fd, blockOffset(from), fatTable->fd, blockOffset(to), (off_t)unit->length * BLOCK_SIZE, pass->buffer);
+        statEnd(STAT_COPY, start);
+        if (copied < 0)
+        {
+            releaseBlocks(fatTable, to, unit->length);
+            printf("ERROR: no se pudieron mover los bloques %u-%u.\n", from, from + unit->length - 1);
+            return -1;
+        }
+        pass->stepBytes += (unsigned long long)unit->length * BLOCK_SIZE;
+        pass->bytesMoved += (unsigned long long)unit->length * BLOCK_SIZE;
+    }
+    for (unsigned int i = 0; i < unit->length; i++)
+    {
+        BlockInfo info = *loadBlockInfo(fatTable, from + i);
+        setBlockInfo(fatTable, to + i, info.crc, info.length);
+    }
+
+    if (unit->entry != NULL)
+    {
+        unit->entry->starting_block = to;
+        markFatEntryDirty(fatTable, unit->entry);
+    }
+    else if (unit->field != NULL)
+    {
+        // El diario nuevo empieza vacio; la transaccion que lo estrena ya se escribe ahi
+        *unit->field = to;
+        fatTable->superDirty = 1;
+        if (isJournal)
+        {
+            fatTable->journalHead = 0;
+            fatTable->journalMoved = 1;
+        }
+    }
+    else if (unit->shared)
+    {
+        // El indice se mantiene ordenado; las listas que apuntan al bloque se
+        // corrigen al cerrar el paso
+        DedupIndex *index = loadDedupIndex(fatTable);
+        DedupEntry shared = *findDedupBlock(index, from);
+        removeDedupEntry(index, shared);
+        shared.block = to;
+        insertDedupEntry(index, shared);
+        if (pass->numShared == pass->sharedCapacity)
+        {
+            pass->sharedCapacity = pass->sharedCapacity ? pass->sharedCapacity * 2 : 64;
+            pass->shared = realloc(pass->shared, pass->sharedCapacity * sizeof(Relocation));
+        }
+        Relocation relocation = {from, 1, to};
+        pass->shared[pass->numShared++] = relocation;
+    }
+    else
+    {
+        moveTailBlock(fatTable, from, to);
+        // Los archivos del bloque estan seguidos en tailMembers (ordenado por bloque)
+        unsigned int low = 0, high = pass->numTailMembers;
+        while (low < high)
+        {
+            unsigned int mid = (low + high) / 2;
+            if (pass->tailMembers[mid].block < unit->origin)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                high = mid;
+            }
+        }
+        for (unsigned int i = low; i < pass->numTailMembers && pass->tailMembers[i].block == unit->origin; i++)
+        {
+            pass->tailMembers[i].entry->starting_block = to;
+            markFatEntryDirty(fatTable, pass->tailMembers[i].entry);
+        }
+    }
+    releaseBlocks(fatTable, from, unit->length);
+    unit->start = to;
+    pass->numMoved++;
+    return 0;
+}
+
+void finishPackStep(FatTable *fatTable, PackPass *pass)
+{
+    // Las listas de los archivos deduplicados pasan a los bloques compartidos
+    // movidos en el paso, por el diario y en la misma transaccion que el resto
+    if (pass->numShared > 0)
+    {
+        qsort(pass->shared, pass->numShared, sizeof(Relocation), compareRelocations);
+        unsigned int bucket = 0, slot = 0;
+        FatEntry *entry;
+        while ((entry = nextFatEntry(fatTable, &bucket, &slot)) != NULL)
+        {
+            if (entry->flags & FAT_DEDUP)
+            {
+                remapDedupList(fatTable, entry, pass->shared, pass->numShared);
+            }
+        }
+        pass->numShared = 0;
+    }
+    // Al guardar, lo movido queda libre en la misma transaccion que deja de usarlo
+    flushFatTable(fatTable);
+    pass->steps++;
+    if (verbose == 2)
+    {
+        printf("Paso %u: %llu bytes movidos\n", pass->steps, pass->stepBytes);
+    }
+    pass->stepBytes = 0;
+}
+
+int heldBefore(FatTable *fatTable, unsigned int block)
+{
+    // El bloque anterior queda libre al cerrar el paso: esta libre o retenido
+    Extent *hole = freeExtentBefore(&fatTable->freeMap, block);
+    if (hole != NULL && hole->start + hole->length == block)
+    {
+        return 1;
+    }
+    for (unsigned int i = 0; i < fatTable->numHeldFree; i++)
+    {
+        if (fatTable->heldFree[i].start + fatTable->heldFree[i].length == block)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+unsigned int firstReusableBlock(FatTable *fatTable)
+{
+    // Primer bloque libre o retenido (libre al cerrar el paso)
+    Extent *hole = freeExtentAfter(&fatTable->freeMap, 0);
+    unsigned int first = hole != NULL ? hole->start : fatTable->super.next_free_block;
+    for (unsigned int i = 0; i < fatTable->numHeldFree; i++)
+    {
+        if (fatTable->heldFree[i].start < first)
+        {
+            first = fatTable->heldFree[i].start;
+        }
+    }
+    return first;
+}
+
+int sweepPackUnits(FatTable *fatTable, PackPass *pass)
+{
+    // Recorre las extensiones en orden fisico y baja cada una al primer hueco
+    // donde cabe. Una extension solo se copia a bloques que la FAT en disco no
+    // usa, asi que no se escribe sobre datos vivos. Si no cabe porque el
+    // espacio de abajo todavia esta retenido, se cierra el paso; si lo que
+    // hay abajo es poco, la extension y las que siguen (hasta PACK_STEP) se
+    // llevan primero al final del TAR y bajan en el paso siguiente. Con
+    // --budget se detiene al agotarlo; el paso abierto lo cierra quien llama.
+    // Devuelve las extensiones movidas, o -1 si una copia fallo.
+    FreeMap *freeMap = loadFreeMap(fatTable);
+    unsigned int numMoved = pass->numMoved;
+    int flushed = 0, bounced = 0;
+    unsigned int n = pass->numUnits;
+    while (n > 0 && !packBudgetSpent(pass))
+    {
+        PackUnit *unit = &pass->units[n - 1];
+        refreshPackUnit(unit);
+        Extent *hole = unit->length > 0 ? firstFittingExtent(freeMap, unit->length, unit->start) : NULL;
+        if (hole != NULL)
+        {
+            unsigned int to = hole->start;
+            reserveBlocksAt(fatTable, to, unit->length);
+            if (movePackUnit(fatTable, pass, unit, to) != 0)
+            {
+                return -1;
+            }
+            if (pass->stepBytes >= PACK_STEP)
+            {
+                finishPackStep(fatTable, pass);
+            }
+            n--;
+            flushed = bounced = 0;
+            continue;
+        }
+
+        int stuck = unit->length == 0 || !heldBefore(fatTable, unit->start);
+        unsigned int below = stuck ? 0 : unit->start - firstReusableBlock(fatTable);
+        if (!stuck && !bounced && (below < unit->length || below < PACK_SLIDE / BLOCK_SIZE))
+        {
+            // Poco espacio abajo: bajar de a poco costaria un guardado por
+            // extension, asi que el lote pasa antes por el final del TAR,
+            // fuera del camino de lo que todavia no se recorre
+            unsigned long long batch = 0;
+            for (unsigned int k = n; k > 0; k--)
+            {
+                PackUnit *next = &pass->units[k - 1];
+                refreshPackUnit(next);
+                if (next->length == 0)
+                {
+                    continue;
+                }
+                if (k < n && (batch + (unsigned long long)next->length * BLOCK_SIZE > PACK_STEP || packBudgetSpent(pass)))
+                {
+                    break;
+                }
+                if (movePackUnit(fatTable, pass, next, reserveFreshBlocks(fatTable, next->length)) != 0)
+                {
+                    return -1;
+                }
+                batch += (unsigned long long)next->length * BLOCK_SIZE;
+            }
+            finishPackStep(fatTable, pass);
+            bounced = flushed = 1;
+            continue;
+        }
+        if (!stuck && !flushed && pass->stepBytes > 0)
+        {
+            finishPackStep(fatTable, pass);
+            flushed = 1;
+            continue;
+        }
+        n--;
+        flushed = bounced = 0;
+    }
+    return pass->numMoved - numMoved;
+}
+
+void releasePackFreeMap(FatTable *fatTable)
+{
+    // El mapa libre se saca de donde este (aunque ya no registre huecos):
+    // saveFreeMap lo vuelve a reservar al final del TAR, baja de ultimo y lo
+    // libera cuando no quedan huecos
+    releaseBlocks(fatTable, fatTable->super.fmap_start_block, fatTable->super.fmap_num_blocks);
+    fatTable->super.fmap_start_block = 0;
+    fatTable->super.fmap_num_blocks = 0;
+    loadFreeMap(fatTable)->dirty = 1;
+}
+
+int packRounds(FatTable *fatTable, PackPass *pass)
+{
+    // Cada guardado puede reubicar metadatos que crecieron, asi que el
+    // recorrido se repite hasta que nada se mueva (o se agote --budget).
+    // Devuelve lo movido en la ultima vuelta, o -1 si una copia fallo
+    int moved = 0;
+    for (int round = 0; round < 4 && !packBudgetSpent(pass); round++)
+    {
+        // Un diario agrandado (por -u o por un paso grande) vuelve a su tamanno
+        // y baja con el resto
+        if (shrinkJournal(fatTable))
+        {
+            flushFatTable(fatTable);
+        }
+        collectPackUnits(fatTable, pass);
+        if (verbose == 2)
+        {
+            printf("Recorriendo %u extensiones...\n", pass->numUnits);
+        }
+        moved = sweepPackUnits(fatTable, pass);
+        if (pass->stepBytes > 0 || fatTable->numHeldFree > 0)
+        {
+            finishPackStep(fatTable, pass);
+        }
+        freePackPass(pass);
+        if (moved <= 0)
+        {
+            break;
+        }
+    }
+    return moved;
+}
+
+void packTar(char *tar_filename)
+{
+    FatTable fatTable;
+    if (openTar(tar_filename, O_RDWR, &fatTable) != 0)
+    {
+        return;
+    }
+
+    if (verbose > 0)
+    {
+        printf("Archivo %s cargado correctamente.\n\n", tar_filename);
+    }
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    struct stat st;
+    fstat(fatTable.fd, &st);
+    off_t originalSize = st.st_size;
+    // Lo liberado se retiene hasta cada guardado: la FAT en disco lo usa
+    fatTable.lazySave = 1;
+
+    // Juntar los archivos pequennos en menos bloques de colas; los que quedan
+    // vacios se liberan al guardar y la compactacion cierra sus huecos
+    if (repackTailBlocks(&fatTable, 0) > 0)
+    {
+        flushFatTable(&fatTable);
+    }
+
+    // Calcular la menor cantidad de paginas que respeta la ocupacion maxima
+    // (con hash lineal no tiene que ser potencia de 2)
+    unsigned long pageLoad = (unsigned long)DIR_PAGE_ENTRIES * DIR_MAX_LOAD;
+    unsigned int buckets = (fatTable.super.num_entries * 100UL + pageLoad - 1) / pageLoad;
+
+    if (verbose == 2)
+    {
+        printf("Reorganizando el directorio en %u paginas...\n", buckets);
+    }
+    // Reconstruir el directorio (libera las paginas que quedaron vacias) y
+    // compactar la tabla de cadenas y el mapa de colas, que se vuelven a
+    // guardar completos en bloques nuevos; todo en una transaccion
+    resizeDirectory(&fatTable, buckets);
+    compactStringTable(&fatTable);
+    releaseBlocks(&fatTable, fatTable.super.strtab_start_block, fatTable.super.strtab_num_blocks);
+    fatTable.super.strtab_start_block = 0;
+    fatTable.super.strtab_num_blocks = 0;
+    TailMap *tails = loadTailMap(&fatTable);
+    releaseBlocks(&fatTable, fatTable.super.tail_start_block, fatTable.super.tail_num_blocks);
+    fatTable.super.tail_start_block = 0;
+    fatTable.super.tail_num_blocks = 0;
+    tails->dirty = 1;
+    releasePackFreeMap(&fatTable);
+    flushFatTable(&fatTable);
+
+    // Bajar las extensiones en orden fisico
+    PackPass pass;
+    memset(&pass, 0, sizeof(PackPass));
+    int moved = packRounds(&fatTable, &pass);
+    free(pass.shared);
+    free(pass.buffer);
+
+    // Lo que quede sin guardar (tambien tras un error) se confirma aqui
+    fatTable.lazySave = 0;
+    flushFatTable(&fatTable);
+
+    fstat(fatTable.fd, &st);
+    off_t reclaimed = originalSize - st.st_size;
+    closeTar(&fatTable);
+
+    double seconds = elapsedSeconds(&startTime);
+    if (moved < 0)
+    {
+        printf("\nLa compactacion se detuvo; el TAR quedo consistente.\n");
+    }
+    else
+    {
+        printf("\nArchivo TAR compactado exitosamente.\n");
+    }
+    printf("Espacio recuperado: %lld bytes, datos movidos: %llu bytes en %u paso(s), %.3f s (%.1f MB/s)\n\n",
+           (long long)reclaimed, pass.bytesMoved, pass.steps, seconds,
+           seconds > 0 ? pass.bytesMoved / seconds / (1024 * 1024) : 0.0);
+}
+
+void packIncremental(char *tar_filename, unsigned long long budgetNanos, unsigned long long budgetBytes)
+{
+    // Compactacion por pasos (-p --budget): el mismo recorrido que -p, que
+    // baja las extensiones en orden fisico (y lleva al final del TAR las que
+    // no caben todavia), pero se detiene al agotar el presupuesto. Cada paso
+    // guarda la FAT, asi el TAR queda consistente despues de cada uno, y
+    // volver a ejecutarla sigue desde donde quedo hasta llegar a lo de -p.
+    FatTable fatTable;
+    if (openTar(tar_filename, O_RDWR, &fatTable) != 0)
+    {
+        return;
+    }
+    struct stat st;
+    fstat(fatTable.fd, &st);
+    off_t originalSize = st.st_size;
+    // Lo liberado se retiene hasta cada guardado: la FAT en disco lo usa
+    fatTable.lazySave = 1;
+
+    PackPass pass;
+    memset(&pass, 0, sizeof(PackPass));
+    pass.budgetNanos = budgetNanos;
+    pass.budgetBytes = budgetBytes;
+    pass.startNanos = monotonicNanos();
+    // Primero los bloques de colas: cada paso vacia algunos y sus bloques
+    // quedan como huecos para mover las extensiones
+    while (!packBudgetSpent(&pass))
+    {
+        unsigned int numTails = loadTailMap(&fatTable)->count;
+        pass.stepBytes = repackTailBlocks(&fatTable, PACK_STEP / BLOCK_SIZE);
+        if (pass.stepBytes == 0)
+        {
+            break;
+        }
+        pass.bytesMoved += pass.stepBytes;
+        finishPackStep(&fatTable, &pass);
+        if (fatTable.tails.count >= numTails)
+        {
+            break;
+        }
+    }
+    if (fatTable.super.fmap_num_blocks > 0 && !packBudgetSpent(&pass))
+    {
+        releasePackFreeMap(&fatTable);
+        flushFatTable(&fatTable);
+    }
+    int moved = packRounds(&fatTable, &pass);
+    int outOfBudget = packBudgetSpent(&pass);
+    free(pass.shared);
+    free(pass.buffer);
+
+    // Lo retenido por un paso que fallo tambien vuelve al mapa libre
+    fatTable.lazySave = 0;
+    flushFatTable(&fatTable);
+
+    // Una ejecucion interrumpida despues de guardar pudo dejar sin recortar el final
+    off_t end = blockOffset(fatTable.super.next_free_block);
+    if (fstat(fatTable.fd, &st) == 0 && st.st_size > end && ftruncate(fatTable.fd, end) != 0)
+    {
+        perror("ftruncate");
+    }
+    FreeMap *freeMap = loadFreeMap(&fatTable);
+    unsigned long long freeBlocks = 0;
+    for (Extent *hole = freeExtentAfter(freeMap, 0); hole != NULL; hole = freeExtentAfter(freeMap, hole->start + 1))
+    {
+        freeBlocks += hole->length;
+    }
+    unsigned int holes = freeMap->count;
+    fstat(fatTable.fd, &st);
+    closeTar(&fatTable);
+
+    double seconds = (monotonicNanos() - pass.startNanos) / 1e9;
+    if (moved < 0)
+    {
+        printf("\nLa compactacion se detuvo; el TAR quedo consistente.\n");
+    }
+    printf("\nCompactacion incremental: %u extension(es) movidas en %u paso(s), %llu bytes en %.3f s (%.1f MB/s)\n",
+           pass.numMoved, pass.steps, pass.bytesMoved, seconds, seconds > 0 ? pass.bytesMoved / seconds / (1024 * 1024) : 0.0);
+    printf("Espacio recuperado: %lld bytes. Quedan %u hueco(s) con %llu bytes libres.\n",
+           (long long)(originalSize - st.st_size), holes, freeBlocks * BLOCK_SIZE);
+    if (moved >= 0 && (outOfBudget || holes > 0))
+    {
+        printf("%s: vuelva a ejecutar -p --budget para continuar.\n",
+               outOfBudget ? "Se alcanzo el limite de --budget" : "Todavia quedan huecos");
+    }
+}
+
+int mergeMember(FatTable *fatTable, FatTable *source, FatEntry *member, FatEntry *entry, char *buffer)
+{
+    // Copiar los datos del archivo al TAR destino y llenar su registro;
+    // devuelve los bytes movidos o -1
+    unsigned char layout = member->flags & FAT_LAYOUT_FLAGS;
+    entry->file_size = member->file_size;
+
+    // Los bloques compartidos de un archivo deduplicado quedan seguidos en el
+    // destino, como un archivo normal
+    unsigned int numBlocks = member->num_blocks;
+    unsigned int *list = NULL;
+    if (layout & FAT_DEDUP)
+    {
+        numBlocks = (member->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        list = malloc(dedupListSize(member->file_size) + sizeof(unsigned int));
+        if (pread(source->fd, list, dedupListSize(member->file_size), dedupListOffset(member)) != (ssize_t)dedupListSize(member->file_size))
+        {
+            free(list);
+            return -1;
+        }
+        layout &= ~(FAT_DEDUP | FAT_TAIL);
+    }
+    else if (layout & FAT_TAIL)
+    {
+        // Los archivos pequennos pasan a un bloque de colas del destino
+        unsigned int length = member->file_size;
+        if (pread(source->fd, buffer, length, blockOffset(member->starting_block) + member->tail_offset * TAIL_ALIGN) != length ||
+            storeTailMember(fatTable, entry, buffer, length) != 0)
+        {
+            return -1;
+        }
+        return length;
+    }
+    unsigned int start = numBlocks > 0 ? allocateBlocks(fatTable, numBlocks) : 0;
+
+    // Extensiones seguidas del origen se mueven con una sola llamada
+    off_t moved = 0;
+    for (unsigned int i = 0; i < numBlocks;)
+    {
+        unsigned int from = list != NULL ? list[i] : member->starting_block + i;
+        unsigned int run = 1;
+        while (i + run < numBlocks && (list == NULL || list[i + run] == from + run))
+        {
+            run++;
+        }
+        off_t length = (off_t)run * BLOCK_SIZE;
+        unsigned long long copyStart = statStart();
+        off_t copied = cloneFileRange(source->fd, blockOffset(from), fatTable->fd, blockOffset(start + i), length, buffer);
+        statEnd(STAT_COPY, copyStart);
+        if (copied < 0)
+        {
+            free(list);
+            releaseBlocks(fatTable, start, numBlocks);
+            return -1;
+        }
+        // Los CRC se copian tal cual: un bloque corrupto sigue detectandose
+        for (unsigned int j = 0; j < run; j++)
+        {
+            BlockInfo info = *loadBlockInfo(source, from + j);
+            setBlockInfo(fatTable, start + i + j, info.crc, info.length);
+        }
+        moved += copied;
+        i += run;
+    }
+    free(list);
+
+    entry->starting_block = start;
+    entry->num_blocks = numBlocks;
+    entry->flags |= layout;
+    return moved;
+}
+
+int mergeTars(char *tarFilename, char **sources, int numSources)
+{
+    // Los TAR de origen se agregan al destino (que se crea si no existe)
+    // sin extraer sus archivos; si un nombre se repite queda el del ultimo.
+    // Todo va en una transaccion: si algo falla no se guarda nada y devuelve -1
+    struct stat st;
+    int created = 0;
+    if (stat(tarFilename, &st) != 0)
+    {
+        if (createEmptyTar(tarFilename) != 0)
+        {
+            printf("ERROR: no se pudo crear el archivo %s\n", tarFilename);
+            return -1;
+        }
+        created = 1;
+    }
+    FatTable fatTable;
+    if (openTar(tarFilename, O_RDWR, &fatTable) != 0)
+    {
+        return -1;
+    }
+    fstat(fatTable.fd, &st);
+    off_t originalSize = st.st_size;
+    // Lo reemplazado se retiene hasta guardar: la FAT en disco todavia lo
+    // usa, y si algo falla debe seguir intacto
+    fatTable.lazySave = 1;
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+    char *buffer = malloc(BLOCK_SIZE);
+    unsigned int merged = 0, replaced = 0;
+    off_t bytesMoved = 0;
+    int failed = 0;
+    for (int i = 0; i < numSources && !failed; i++)
+    {
+        struct stat sourceSt;
+        if (stat(sources[i], &sourceSt) == 0 && sourceSt.st_dev == st.st_dev && sourceSt.st_ino == st.st_ino)
+        {
+            printf("ERROR: %s es el TAR destino, no se combina consigo mismo.\n", sources[i]);
+            failed = 1;
+            break;
+        }
+        FatTable source;
+        if (openTar(sources[i], O_RDONLY, &source) != 0)
+        {
+            failed = 1;
+            break;
+        }
+        if (verbose > 0)
+        {
+            printf("Combinando %s en %s...\n", sources[i], tarFilename);
+        }
+
+        unsigned int bucket = 0, slot = 0;
+        FatEntry *member;
+        while ((member = nextFatEntry(&source, &bucket, &slot)) != NULL)
+        {
+            char shortName[13];
+            const char *name = fatEntryName(&source, member, shortName);
+
+            // Se copia en un registro aparte: agregar el nombre puede mover el directorio
+            FatEntry copy = {0};
+            off_t moved = mergeMember(&fatTable, &source, member, &copy, buffer);
+            if (moved < 0)
+            {
+                printf("ERROR: no se pudo copiar %s de %s\n", name, sources[i]);
+                failed = 1;
+                break;
+            }
+
+            // El anterior con el mismo nombre se quita solo si la copia salio bien
+            FatEntry *old = findFatEntry(&fatTable, name);
+            if (old != NULL)
+            {
+                if (verbose > 0)
+                {
+                    printf("Reemplazando %s con el de %s\n", name, sources[i]);
+                }
+                releaseMemberBlocks(&fatTable, old);
+                removeFatEntry(&fatTable, old);
+                replaced++;
+            }
+            else
+            {
+                merged++;
+            }
+            FatEntry *entry = addFatEntry(&fatTable, name);
+            entry->starting_block = copy.starting_block;
+            entry->num_blocks = copy.num_blocks;
+            entry->file_size = copy.file_size;
+            entry->tail_offset = copy.tail_offset;
+            entry->flags |= copy.flags;
+            markFatEntryDirty(&fatTable, entry);
+            if (verbose == 2)
+            {
+                printf("Archivo combinado: %s (%llu bytes)\n", name, copy.file_size);
+            }
+            bytesMoved += moved;
+        }
+        closeTar(&source);
+    }
+    free(buffer);
+
+    if (failed)
+    {
+        // Sin guardar la FAT lo ya copiado no pertenece al TAR: se recorta lo
+        // que crecio al final, y un destino recien creado se borra
+        if (ftruncate(fatTable.fd, originalSize) != 0)
+        {
+            perror("ftruncate");
+        }
+        closeTar(&fatTable);
+        if (created)
+        {
+            unlink(tarFilename);
+        }
+        printf("ERROR: no se combino ningun archivo en %s.\n", tarFilename);
+        return -1;
+    }
+
+    // Un solo guardado de la FAT para todo lo combinado
+    fatTable.lazySave = 0;
+    flushFatTable(&fatTable);
+    closeTar(&fatTable);
+
+    double seconds = elapsedSeconds(&startTime);
+    printf("Archivos combinados en %s: %u nuevo(s), %u reemplazado(s), datos movidos: %lld bytes en %.3f s (%.1f MB/s)\n",
+           tarFilename, merged, replaced, (long long)bytesMoved, seconds,
+           seconds > 0 ? bytesMoved / seconds / (1024 * 1024) : 0.0);
+    return 0;
+}
+
+#define VERIFY_CHUNK 16 // Bloques por trabajo en --verify
+
+typedef struct VerifyPool
+{
+    int tarFd;                // Descriptor compartido del TAR (solo pread)
+    BlockInfo *blocks;        // Tabla de bloques completa
+    TailMap *tails;           // Espacios libres de los bloques de colas
+    unsigned int numBlocks;   // Bloques del TAR
+    unsigned int next;        // Siguiente grupo de bloques libre (atomico)
+    unsigned long long bytes; // Bytes verificados (atomico)
+    unsigned int *bad;        // Bloques corruptos encontrados
+    unsigned int numBad;
+    pthread_mutex_t lock;     // Protege la lista de bloques corruptos
+} VerifyPool;
+
+void *verifyWorker(void *arg)
+{
+    VerifyPool *pool = arg;
+    char *buffer = malloc(BLOCK_SIZE);
+    while (1)
+    {
+        unsigned int first = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) * VERIFY_CHUNK;
+        if (first >= pool->numBlocks)
+        {
+            break;
+        }
+        for (unsigned int block = first; block < first + VERIFY_CHUNK && block < pool->numBlocks; block++)
+        {
+            BlockInfo *info = &pool->blocks[block];
+            if (info->length == 0)
+            {
+                continue;
+            }
+            int bad = info->length > BLOCK_SIZE || pread(pool->tarFd, buffer, info->length, blockOffset(block)) != info->length;
+            if (!bad)
+            {
+                maskTailHoles(pool->tails, block, buffer, info->length);
+                bad = crc32cUpdate(0, buffer, info->length) != info->crc;
+            }
+            if (bad)
+            {
+                pthread_mutex_lock(&pool->lock);
+                pool->bad[pool->numBad++] = block;
+                pthread_mutex_unlock(&pool->lock);
+            }
+            __atomic_fetch_add(&pool->bytes, info->length, __ATOMIC_RELAXED);
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+int compareBlocks(const void *a, const void *b)
+{
+    unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+    return x < y ? -1 : x > y;
+}
+
+unsigned int lowerBoundBlock(unsigned int *blocks, unsigned int count, unsigned int block)
+{
+    unsigned int low = 0, high = count;
+    while (low < high)
+    {
+        unsigned int mid = (low + high) / 2;
+        if (blocks[mid] < block)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+int verifyTar(char *tarFilename, int jobs)
+{
+    // Devuelve la cantidad de bloques corruptos, o -1 si no se pudo abrir
+    FatTable fatTable;
+    if (openTar(tarFilename, O_RDONLY, &fatTable) != 0)
+    {
+        return -1;
+    }
+
+    struct timespec startTime;
+    clock_gettime(CLOCK_MONOTONIC, &startTime);
+
+    // Copiar la tabla de bloques para que los hilos no toquen las paginas
+    VerifyPool pool;
+    memset(&pool, 0, sizeof(VerifyPool));
+    pool.tarFd = fatTable.fd;
+    pool.numBlocks = fatTable.super.next_free_block;
+    pool.tails = loadTailMap(&fatTable);
+    pool.blocks = malloc((pool.numBlocks + 1) * sizeof(BlockInfo));
+    pool.bad = malloc((pool.numBlocks + 1) * sizeof(unsigned int));
+    pthread_mutex_init(&pool.lock, NULL);
+    for (unsigned int i = 0; i < pool.numBlocks; i++)
+    {
+        pool.blocks[i] = *loadBlockInfo(&fatTable, i);
+    }
+
+    if (verbose == 2)
+    {
+        printf("Verificando %u bloques con %d hilo(s)...\n", pool.numBlocks, jobs);
+    }
+    runWorkers(verifyWorker, &pool, jobs, (pool.numBlocks + VERIFY_CHUNK - 1) / VERIFY_CHUNK);
+    double seconds = elapsedSeconds(&startTime);
+
+    // Asignar cada bloque corrupto al archivo que lo contiene
+    qsort(pool.bad, pool.numBad, sizeof(unsigned int), compareBlocks);
+    unsigned char *reported = calloc(pool.numBad + 1, 1);
+    char shortName[13];
+    unsigned int bucket = 0, slot = 0;
+    FatEntry *entry;
+    while ((entry = nextFatEntry(&fatTable, &bucket, &slot)) != NULL)
+    {
+        // Un archivo en un bloque de colas ocupa parte de su bloque inicial
+        unsigned int numBlocks = (entry->flags & FAT_TAIL) ? 1 : entry->num_blocks;
+        unsigned int i = lowerBoundBlock(pool.bad, pool.numBad, entry->starting_block);
+        for (; i < pool.numBad && pool.bad[i] < entry->starting_block + numBlocks; i++)
+        {
+            printf("ERROR: bloque %u corrupto en el archivo %s\n", pool.bad[i], fatEntryName(&fatTable, entry, shortName));
+            reported[i] = 1;
+        }
+        if (pool.numBad == 0 || !(entry->flags & FAT_DEDUP))
+        {
+            continue;
+        }
+
+        // Los bloques compartidos se buscan en la lista del archivo
+        unsigned int numData = (entry->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        unsigned int *list = calloc(numData + 1, sizeof(unsigned int));
+        pread(fatTable.fd, list, dedupListSize(entry->file_size), dedupListOffset(entry));
+        for (unsigned int j = 0; j < numData; j++)
+        {
+            i = lowerBoundBlock(pool.bad, pool.numBad, list[j]);
+            if (i < pool.numBad && pool.bad[i] == list[j])
+            {
+                printf("ERROR: bloque %u corrupto en el archivo %s\n", pool.bad[i], fatEntryName(&fatTable, entry, shortName));
+                reported[i] = 1;
+            }
+        }
+        free(list);
     }
-
-    if (verbose > 0)
+    for (unsigned int i = 0; i < pool.numBad; i++)
     {
-        printf("Actualizando informacion de: %s...\n", filename);
+        if (!reported[i])
+        {
+            printf("ERROR: bloque %u corrupto fuera de los archivos\n", pool.bad[i]);
+        }
     }
-    // Abrir nueva version del archivo
-    FILE *newFile = fopen(filename, "rb");
-    if (!newFile)
+
+    printf("Verificados %llu bytes en %.3f s (%.1f MB/s): %u bloque(s) corrupto(s).\n",
+           pool.bytes, seconds, seconds > 0 ? pool.bytes / seconds / (1024 * 1024) : 0.0, pool.numBad);
+
+    unsigned int numBad = pool.numBad;
+    free(reported);
+    pthread_mutex_destroy(&pool.lock);
+    free(pool.bad);
+    free(pool.blocks);
+    closeTar(&fatTable);
+    return numBad;
+}
+
+int appendFilesToTar(char *tarFilename, int argc, char *argv[], int first, int jobs)
+{
+    // Abrir el archivo TAR en modo de actualización
+    FatTable fatTable;
+    if (openTar(tarFilename, O_RDWR, &fatTable) != 0)
     {
-        printf("Error opening new version of the file: %s\n", filename);
-        fclose(tarFile);
-        return;
+        return -1;
     }
 
     if (verbose == 2)
     {
-        printf("Calculando la cantidad de bloques requeridos para %s...\n", filename);
+        printf("Planificando la ubicacion de los archivos...\n");
     }
-    // Calcular el numero de bloques del archivo
-    fseek(newFile, 0, SEEK_END);
-    int newFileSize = ftell(newFile);
-    fseek(newFile, 0, SEEK_SET);
-    int newNumBlocks = (newFileSize + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-    // Comparar la cantidad de bloques del actualizado con el original
-    if (newNumBlocks != fatTable.entries[fileIndex].num_blocks)
+    // Tres etapas a la vez: los hilos del recorrido leen los directorios,
+    // este hilo reserva la extension de cada archivo encontrado y los hilos
+    // de copia escriben los que ya tienen lugar
+    IngestPool pool;
+    initIngestPool(&pool, tarFilename, &fatTable);
+    if (deduplicate)
     {
-        printf("Error: The number of blocks of the new file does not match the number specified in the FAT table.\n");
-        fclose(newFile);
-        fclose(tarFile);
-        return;
+        // Los hilos reservan los bloques nuevos: el mapa libre ya debe estar cargado
+        loadDedupIndex(&fatTable);
+        loadFreeMap(&fatTable);
     }
-
-
-    if (verbose == 2)
+    pthread_t *threads = startWorkers(ingestWorker, &pool, jobs);
+    FileWalk *walk = startFileWalk(argv + first, argc - first, jobs);
+    WalkedFile file;
+    int status = 0;
+    while (nextWalkedFile(walk, &file))
     {
-        printf("Ubicando el archivo dentro del TAR...\n");
+        IngestJob *job = reserveIngestJob(&pool);
+        pthread_mutex_lock(&pool.dedupLock);
+        int planned = planFileForTar(file.path, &file.st, &fatTable, job);
+        pthread_mutex_unlock(&pool.dedupLock);
+        if (planned == 0)
+        {
+            publishIngestJob(&pool);
+        }
+        else
+        {
+            free(file.path);
+            status = -1;
+        }
+    }
+    if (finishFileWalk(walk) > 0)
+    {
+        status = -1;
     }
-    // Ir al bloque inicial
-    int startingBlock = fatTable.entries[fileIndex].starting_block;
-    fseek(tarFile, sizeof(FatTable) + sizeof(TarHeader) + (startingBlock * BLOCK_SIZE), SEEK_SET);
+    closeIngestPool(&pool);
+    joinWorkers(threads, jobs);
 
-    // Actualizar contenido del archivo
-    char buffer[BLOCK_SIZE];
-    int bytesRead;
-    while ((bytesRead = fread(buffer, 1, BLOCK_SIZE, newFile)) > 0)
+    // Los mensajes y la FAT se actualizan en el orden en que se planifico
+    for (unsigned int i = 0; i < pool.numJobs; i++)
     {
-        fwrite(buffer, 1, bytesRead, tarFile);
+        IngestJob *job = ingestJobAt(&pool, i);
+        fputs(job->message, stdout);
+        if (job->failed)
+        {
+            status = -1;
+        }
+        finishIngestJob(&fatTable, job);
+        free(job->filename);
     }
+    freeIngestPool(&pool);
 
+    // Guardar la FAT table actualizada en el archivo TAR (una sola vez)
     if (verbose == 2)
     {
-        printf("Actualizando la estructura FAT...\n");
+        printf("Actualizando la estructura FAT...\n\n");
     }
+    saveFatTableToFile(&fatTable);
 
-    // Actualizar FAT
-    fatTable.entries[fileIndex].file_size = newFileSize;
-    fseek(tarFile, 0, SEEK_SET);
-    saveFatTableToFile(&fatTable, tarFile);
-
-    fclose(newFile);
-    fclose(tarFile);
-
+    closeTar(&fatTable);
     if (verbose == 2)
     {
         printf("\nArchivo TAR cerrado exitosamente.\n\n");
     }
-
-    printf("Archivo modifocado en TAR: %s\n", filename);
+    return status;
 }
 
-void packTar(char *tar_filename)
+typedef struct BatchCommand
 {
-    FILE *tarFile = fopen(tar_filename, "rb+");
-    if (!tarFile)
+    char op;           // 'r', 'd', 'u' o 'x' (como la opcion de la linea de comandos)
+    unsigned int first; // Primer nombre en la lista de nombres del lote
+    unsigned int count; // Cantidad de nombres
+} BatchCommand;
+
+char batchOperation(const char *word)
+{
+    const char *words[] = {"add", "delete", "update", "extract"};
+    const char ops[] = {'r', 'd', 'u', 'x'};
+    for (int i = 0; i < 4; i++)
     {
-        printf("ERROR: No se encontro el archivo %s.\n", tar_filename);
-        return;
+        if (strcmp(word, words[i]) == 0 || (word[0] == ops[i] && word[1] == '\0'))
+        {
+            return ops[i];
+        }
     }
+    return 0;
+}
 
-    if (verbose > 0)
+int splitBatchLine(char *line, char ***words, unsigned int *numWords, unsigned int *capacity)
+{
+    // Palabras separadas por espacios; "..." permite nombres con espacios
+    unsigned int start = *numWords;
+    char *in = line, *out = line;
+    while (1)
     {
-        printf("Archivo %s cargado correctamente.\n\n", tar_filename);
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+        {
+            in++;
+        }
+        if (*in == '\0' || *in == '#')
+        {
+            return *numWords - start;
+        }
+        if (*numWords == *capacity)
+        {
+            *capacity = *capacity ? *capacity * 2 : 256;
+            *words = realloc(*words, *capacity * sizeof(char *));
+        }
+        (*words)[(*numWords)++] = out;
+        int quoted = 0;
+        while (*in != '\0' && (quoted || (*in != ' ' && *in != '\t' && *in != '\n' && *in != '\r')))
+        {
+            if (*in == '"')
+            {
+                quoted = !quoted;
+                in++;
+                continue;
+            }
+            *out++ = *in++;
+        }
+        if (quoted)
+        {
+            return -1;
+        }
+        int end = *in == '\0';
+        in += !end;
+        *out++ = '\0';
+        if (end)
+        {
+            return *numWords - start;
+        }
     }
+}
 
-    if (verbose == 2)
+int batchTar(char *tarFilename, char *batchFilename, int jobs)
+{
+    // Se lee y revisa todo el lote antes de tocar el TAR
+    FILE *in = strcmp(batchFilename, "-") == 0 ? stdin : fopen(batchFilename, "r");
+    if (in == NULL)
+    {
+        printf("ERROR: no se pudo abrir el lote %s\n", batchFilename);
+        return -1;
+    }
+    char **lines = NULL, **names = NULL;
+    unsigned int numLines = 0, numNames = 0, nameCapacity = 0;
+    BatchCommand *commands = NULL;
+    char *line = NULL;
+    size_t lineCapacity = 0;
+    int status = 0;
+    for (unsigned int lineNumber = 1; getline(&line, &lineCapacity, in) >= 0; lineNumber++)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *copy = strdup(line);
+        int numWords = splitBatchLine(copy, &names, &numNames, &nameCapacity);
+        if (numWords == 0)
+        {
+            free(copy);
+            continue;
+        }
+        lines = realloc(lines, (numLines + 1) * sizeof(char *));
+        commands = realloc(commands, (numLines + 1) * sizeof(BatchCommand));
+        lines[numLines] = copy;
+        BatchCommand *command = &commands[numLines++];
+        if (numWords < 2 || (command->op = batchOperation(names[numNames - numWords])) == 0)
+        {
+            printf("ERROR: linea %u del lote invalida: %s\n", lineNumber, line);
+            status = -1;
+            break;
+        }
+        command->first = numNames - numWords + 1;
+        command->count = numWords - 1;
+    }
+    free(line);
+    if (in != stdin)
     {
-        printf("Extrayendo estructura FAT...\n");
+        fclose(in);
     }
-    // FAT
-    FatTable fatTable;
-    loadFatTableFromFile(&fatTable, tarFile);
-
 
-    int emptyBlockOffset = 0;
+    struct stat st;
+    if (status == 0 && stat(tarFilename, &st) != 0 && createEmptyTar(tarFilename) != 0)
+    {
+        printf("ERROR: no se pudo crear el archivo %s\n", tarFilename);
+        status = -1;
+    }
 
-    // Iterar registros del FAT
-    for (int i = 0; i < 256; i++)
+    // Todo el lote usa una sola apertura del TAR (la del servidor si lo hay)
+    // y se confirma una vez al final. Una operacion que falla no detiene las
+    // siguientes, pero el lote termina con error
+    unsigned char keepOpen = keepArchivesOpen;
+    keepArchivesOpen = 1;
+    int failed = 0;
+    for (unsigned int i = 0; status == 0 && i < numLines;)
     {
-        if (fatTable.entries[i].is_empty)
+        // Los comandos seguidos del mismo tipo se planifican juntos
+        unsigned int end = i + 1;
+        while (end < numLines && commands[end].op == commands[i].op)
+        {
+            end++;
+        }
+        char **group = malloc(numNames * sizeof(char *));
+        int groupSize = 0;
+        for (unsigned int j = i; j < end; j++)
+        {
+            memcpy(group + groupSize, names + commands[j].first, commands[j].count * sizeof(char *));
+            groupSize += commands[j].count;
+        }
+
+        if (verbose > 0)
+        {
+            printf("Lote: %c con %d archivo(s)\n", commands[i].op, groupSize);
+        }
+        if (commands[i].op == 'r')
+        {
+            failed |= appendFilesToTar(tarFilename, groupSize, group, 0, jobs) != 0;
+        }
+        else if (commands[i].op == 'd')
+        {
+            failed |= deleteFilesFromTar(group, groupSize, tarFilename) != 0;
+        }
+        else if (commands[i].op == 'u')
         {
-            // Aumentar el offset de bloques vacios
-            emptyBlockOffset += fatTable.entries[i].num_blocks;
+            for (int j = 0; j < groupSize; j++)
+            {
+                failed |= updateFileFromTar(group[j], tarFilename) != 0;
+            }
         }
         else
         {
-            // Ajustar el bloque inicial del archivo por la cantidad de bloques vacios anteriores
-            fatTable.entries[i].starting_block -= emptyBlockOffset;
+            failed |= readTarFile(tarFilename, jobs, group, groupSize) != 0;
         }
+        free(group);
+
+        // El espacio liberado por este grupo queda disponible para los siguientes
+        reuseCachedBlocks(tarFilename);
+        i = end;
     }
 
-    // Eliminar registros vacios
-    int j = 0;
-    for (int i = 0; i < 256; i++)
+    if (keepOpen)
     {
-        if (!fatTable.entries[i].is_empty)
-        {
-            // Mover registros no vacios
-            fatTable.entries[j] = fatTable.entries[i];
-            j++;
-        }
+        syncCachedArchive(tarFilename);
     }
-    // Limpiar registros restantes
-    for (; j < 256; j++)
+    else
+    {
+        forgetCachedArchive(tarFilename, 1);
+    }
+    keepArchivesOpen = keepOpen;
+
+    for (unsigned int i = 0; i < numLines; i++)
     {
-        memset(&fatTable.entries[j], 0, sizeof(FatEntry));
+        free(lines[i]);
     }
+    free(lines);
+    free(names);
+    free(commands);
+    return failed ? -1 : status;
+}
 
-    // Actualizar FAT
-    fseek(tarFile, 0, SEEK_SET);
-    saveFatTableToFile(&fatTable, tarFile);
+char *statsFilename = NULL; // Destino de --stats (stderr si no se indica)
 
-    fclose(tarFile);
+void writeStats()
+{
+    FILE *out = statsFilename != NULL ? fopen(statsFilename, "w") : stderr;
+    if (out == NULL)
+    {
+        fprintf(stderr, "ERROR: no se pudo escribir %s\n", statsFilename);
+        return;
+    }
+    printStats(out);
+    if (out != stderr)
+    {
+        fclose(out);
+    }
+}
 
-    printf("\nArchivo TAR compactado exitosamente.\n\n");
+void commitTar(char *tarFilename)
+{
+    // Sin servidor cada operacion ya guardo la FAT
+    if (syncCachedArchive(tarFilename) != 0 && !keepArchivesOpen)
+    {
+        printf("ERROR: --commit solo tiene efecto con un servidor (--connect).\n");
+        return;
+    }
+    if (verbose > 0)
+    {
+        printf("Cambios guardados en %s\n", tarFilename);
+    }
 }
 
-int main(int argc, char *argv[])
+int runCommand(int argc, char *argv[])
 {
     int opt;
-    int create = 0, extract = 0, list = 0, delete = 0, update = 0, append = 0, pack = 0;
+    int create = 0, extract = 0, list = 0, delete = 0, update = 0, append = 0, pack = 0, verify = 0, commit = 0, merge = 0;
+    char *batchFilename = NULL;
+    unsigned long long budgetNanos = 0, budgetBytes = 0;
+    int jobs = 1;
+    int toStdout = 0;
+    int stats = 0;
+    long long rangeOffset = 0, rangeLength = -1;
     char *tarFilename = NULL;
-    char *filename = NULL;
+    char *serveSocket = NULL, *connectSocket = NULL;
+
+    // El servidor ejecuta varias operaciones en el mismo proceso
+    verbose = 0;
+    compression = 0;
+    deduplicate = 0;
+    ioBackend = IO_SYNC;
+    ioSqPoll = 0;
+    collectStats = 0;
+    statsFilename = NULL;
+    optind = 0;
+
+    static struct option longOptions[] = {
+        {"verify", no_argument, NULL, 'V'},
+        {"dedup", no_argument, NULL, 'D'},
+        {"range", required_argument, NULL, 'R'},
+        {"io", required_argument, NULL, 'I'},
+        {"sqpoll", no_argument, NULL, 'S'},
+        {"stats", optional_argument, NULL, 'T'},
+        {"serve", required_argument, NULL, 'L'},
+        {"connect", required_argument, NULL, 'C'},
+        {"commit", no_argument, NULL, 'M'},
+        {"batch", required_argument, NULL, 'B'},
+        {"merge", no_argument, NULL, 'G'},
+        {"budget", required_argument, NULL, 'W'},
+        {NULL, 0, NULL, 0}};
 
     // Procesar los argumentos de la línea de comandos
-    while ((opt = getopt(argc, argv, "cxtduvrpf:")) != -1)
+    while ((opt = getopt_long(argc, argv, "cxtduvrpzOf:j:", longOptions, NULL)) != -1)
     {
         switch (opt)
         {
@@ -633,31 +2800,184 @@ int main(int argc, char *argv[])
         case 'p':
             pack = 1;
             break;
+        case 'V':
+            verify = 1;
+            break;
+        case 'D':
+            deduplicate = 1;
+            break;
+        case 'O':
+            toStdout = 1;
+            break;
+        case 'I':
+            if (strcmp(optarg, "uring") == 0)
+            {
+                ioBackend = IO_URING;
+            }
+            else if (strcmp(optarg, "sync") == 0)
+            {
+                ioBackend = IO_SYNC;
+            }
+            else
+            {
+                fprintf(stderr, "Backend de E/S desconocido: %s (use sync o uring).\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            ioSqPoll = 1;
+            break;
+        case 'T':
+            stats = 1;
+            statsFilename = optarg;
+            break;
+        case 'L':
+            serveSocket = optarg;
+            break;
+        case 'C':
+            connectSocket = optarg;
+            break;
+        case 'M':
+            commit = 1;
+            break;
+        case 'B':
+            batchFilename = optarg;
+            break;
+        case 'G':
+            merge = 1;
+            break;
+        case 'W':
+            if (parseBudget(optarg, &budgetNanos, &budgetBytes) != 0)
+            {
+                fprintf(stderr, "El limite de --budget es un tiempo (2s, 500ms, 10min) o una cantidad de bytes (1GB, 512M).\n");
+                return 1;
+            }
+            break;
+        case 'R':
+            if (parseRange(optarg, &rangeOffset, &rangeLength) != 0)
+            {
+                fprintf(stderr, "El rango debe tener la forma inicio:longitud.\n");
+                return 1;
+            }
+            toStdout = 1;
+            break;
+        case 'z':
+#ifdef HAVE_ZSTD
+            compression = FAT_ZSTD;
+#else
+            compression = FAT_LZ;
+#endif
+            break;
         case 'f':
             tarFilename = optarg;
             break;
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs < 1)
+            {
+                fprintf(stderr, "La cantidad de hilos (-j) debe ser al menos 1.\n");
+                return 1;
+            }
+            break;
         default:
-            fprintf(stderr, "Uso: %s [-cxtdurv] [-f archivo_tar] [archivo(s)]\n", argv[0]);
+            fprintf(stderr, "Uso: %s [-cxtdurpvzO] [--verify] [--dedup] [--range inicio:longitud] [--io sync|uring] [--sqpoll] [--stats[=archivo]] [--serve socket] [--connect socket] [--commit] [--batch lote] [--merge] [--budget limite] [-j hilos] [-f archivo_tar] [archivo(s)]\n", argv[0]);
             return 1;
         }
     }
 
+    // Servidor y cliente: el servidor revisa los argumentos de cada operacion
+    if ((serveSocket != NULL || connectSocket != NULL) && (keepArchivesOpen || (serveSocket != NULL && connectSocket != NULL)))
+    {
+        fprintf(stderr, "--serve y --connect no se pueden combinar ni enviar al servidor.\n");
+        return 1;
+    }
+    if (serveSocket != NULL)
+    {
+        return serveArchives(serveSocket);
+    }
+    if (connectSocket != NULL)
+    {
+        return runRemoteCommand(connectSocket, argc, argv);
+    }
+
     // Verificar la validez de las combinaciones de argumentos
-    if ((create + extract + list + delete +update + append + pack) != 1)
+    int batch = batchFilename != NULL;
+    if ((create + extract + list + delete +update + append + pack + verify + commit + batch + merge) != 1)
+    {
+        fprintf(stderr, "Debe especificar exactamente una operación (-c, -x, -t, -d, -u, -r, -p, --verify, --commit, --batch, --merge).\n");
+        return 1;
+    }
+    if (compression && deduplicate)
+    {
+        fprintf(stderr, "No se puede combinar -z con --dedup.\n");
+        return 1;
+    }
+    if (tarFilename == NULL)
+    {
+        fprintf(stderr, "Debe especificar el archivo TAR con -f.\n");
+        return 1;
+    }
+    if (strcmp(tarFilename, "-") == 0 && !(create || extract || list))
     {
-        fprintf(stderr, "Debe especificar exactamente una operación (-c, -x, -t, -d, -u, -r, -p).\n");
+        fprintf(stderr, "Con -f - solo se puede crear (-c), extraer (-x) o listar (-t).\n");
         return 1;
     }
+    if (toStdout && (!extract || strcmp(tarFilename, "-") == 0 || optind >= argc))
+    {
+        fprintf(stderr, "-O y --range se usan con -x, un TAR en disco y los nombres de los archivos.\n");
+        return 1;
+    }
+    if ((delete || update) && optind >= argc)
+    {
+        fprintf(stderr, "Debe especificar el archivo a procesar.\n");
+        return 1;
+    }
+    if ((budgetNanos > 0 || budgetBytes > 0) && !pack)
+    {
+        fprintf(stderr, "--budget se usa con -p.\n");
+        return 1;
+    }
+    if (merge && optind >= argc)
+    {
+        fprintf(stderr, "Debe especificar los TAR a combinar: --merge a.tar b.tar -f salida.tar\n");
+        return 1;
+    }
+
+    // Las estadisticas se escriben al terminar la operacion
+    if (stats)
+    {
+        const char *operations[] = {"create", "extract", "list", "delete", "update", "append", "pack", "verify", "commit", "batch", "merge"};
+        int selected[] = {create, extract, list, delete, update, append, pack, verify, commit, batch, merge};
+        for (int i = 0; i < 11; i++)
+        {
+            if (selected[i])
+            {
+                startStats(operations[i]);
+            }
+        }
+    }
 
     // Ejecutar la operación especificada
-    if (create)
+    int status = 0;
+    if (create && strcmp(tarFilename, "-") == 0)
+    {
+        // Flujo hacia stdout, en una sola pasada
+        status = createStreamTar(argc, argv, optind) != 0;
+    }
+    else if (create)
     {
 
         if (verbose > 0)
         {
             printf("Creando archivo TAR...\n");
         }
-        createEmptyTar(tarFilename);
+        // Un TAR que el servidor tenia abierto se reemplaza completo
+        forgetCachedArchive(tarFilename, 0);
+        if (createEmptyTar(tarFilename) != 0)
+        {
+            printf("ERROR: no se pudo crear el archivo %s\n", tarFilename);
+            status = 1;
+        }
 
         if (verbose == 2)
         {
@@ -666,54 +2986,15 @@ int main(int argc, char *argv[])
         }
 
         // Si hay archivos adicionales para agregar al archivo TAR recién creado
-        if (optind < argc)
+        if (status == 0 && optind < argc)
         {
-            // Abrir el archivo TAR en modo de actualización ("rb+")
-            FILE *tarFile = fopen(tarFilename, "rb+");
-            if (!tarFile)
-            {
-                printf("Error abriendo archivo TAR: %s\n", tarFilename);
-                return 1;
-            }
-
-            // Leer la FAT table del archivo TAR
-            FatTable fatTable;
-            loadFatTableFromFile(&fatTable, tarFile);
-            if (verbose == 2)
-            {
-                printf("Extrayendo estructura FAT...\n");
-            }
-
-            // Iterar sobre los archivos adicionales para agregarlos al archivo TAR
-            for (int i = optind; i < argc; i++)
-            {
-                // Agregar el archivo al archivo TAR
-                writeFileToTar(argv[i], tarFile, &fatTable);
-                if (verbose == 1)
-                {
-                    printf("Archivo agregado al TAR: %s\n", argv[i]);
-                }
-            }
-
-            // Guardar la FAT table actualizada en el archivo TAR
-            fseek(tarFile, 0, SEEK_SET);
-            saveFatTableToFile(&fatTable, tarFile);
-            if (verbose == 2)
-            {
-                printf("Actualizando la estructura FAT...\n\n");
-            }
-
-            fclose(tarFile);
-            if (verbose == 2)
-            {
-                printf("\nArchivo TAR cerrado exitosamente.\n\n");
-            }
-            if (verbose > 0)
+            status = appendFilesToTar(tarFilename, argc, argv, optind, jobs) != 0;
+            if (status == 0 && verbose > 0)
             {
                 printf("Archivos agregados a %s\n", tarFilename);
             }
         }
-        else
+        else if (status == 0)
         {
             if (verbose > 0)
             {
@@ -721,13 +3002,19 @@ int main(int argc, char *argv[])
             }
         }
     }
+    else if (extract && toStdout)
+    {
+        // libtar lee la FAT del disco: guardar antes lo que tenga el servidor
+        syncCachedArchive(tarFilename);
+        status = writeTarMembers(tarFilename, argv + optind, argc - optind, rangeOffset, rangeLength) != 0;
+    }
     else if (extract)
     {
         if (verbose > 0)
         {
             printf("Extrayendo archivos de: %s\n\n", tarFilename);
         }
-        readTarFile(tarFilename);
+        status = readTarFile(tarFilename, jobs, argv + optind, argc - optind) != 0;
         if (verbose > 0)
         {
             printf("Archivos extraidos de: %s\n\n", tarFilename);
@@ -739,107 +3026,72 @@ int main(int argc, char *argv[])
     }
     else if (delete)
     {
-        deleteFileFromTar(argv[optind], tarFilename);
+        status = deleteFilesFromTar(argv + optind, argc - optind, tarFilename) != 0;
     }
     else if (update)
     {
-        updateFileFromTar(argv[optind], tarFilename);
+        status = updateFileFromTar(argv[optind], tarFilename) != 0;
     }
     else if (append)
     {
-        // Abrir el archivo TAR en modo de actualización ("rb+")
-        FILE *tarFile = fopen(tarFilename, "rb+");
-        if (!tarFile)
-        {
-            printf("Error abriendo archivo TAR: %s\n", tarFilename);
-            return 1;
-        }
-
         if (verbose > 0)
         {
             printf("Archivo %s cargado conexito.\n\n", tarFilename);
         }
-
-        if (verbose == 2)
-        {
-            printf("Extrayendo estructura FAT...\n");
-        }
-        // Leer la FAT table del archivo TAR
-        FatTable fatTable;
-        loadFatTableFromFile(&fatTable, tarFile);
-
-        if (verbose == 2)
-        {
-            printf("Encontrando un espacio libre...\n");
-        }
-        // Encontrar un conjunto de bloques libres seguidos para almacenar el archivo
-        int startingBlock = -1;
-        int numBlocksRequired = -1;
-        int lastOccupiedBlock = -1;
-        for (int i = 0; i < 256; i++)
-        {
-            if (!fatTable.entries[i].is_empty)
-            {
-                lastOccupiedBlock = i;
-            }
-            if (fatTable.entries[i].is_empty || i == lastOccupiedBlock + 1)
-            {
-                int numConsecutiveEmptyBlocks = 1;
-                for (int j = i + 1; j < 256; j++)
-                {
-                    if (fatTable.entries[j].is_empty)
-                    {
-                        numConsecutiveEmptyBlocks++;
-                        if (numConsecutiveEmptyBlocks >= numBlocksRequired)
-                        {
-                            startingBlock = i;
-                            numBlocksRequired = numConsecutiveEmptyBlocks;
-                        }
-                    }
-                    else
-                    {
-                        break;
-                    }
-                }
-            }
-        }
-
-        if (verbose == 2)
+        status = appendFilesToTar(tarFilename, argc, argv, optind, jobs) != 0;
+        if (status == 0)
         {
-            printf("Ubicando archivo dentro de TAR...\n");
+            printf("Archivo(s) agregado(s) a %s\n", tarFilename);
         }
-        // Si se encontró un conjunto de bloques libres seguidos
-        if (startingBlock != -1 && numBlocksRequired != -1)
+    }
+    else if (pack)
+    {
+        // Compactar mueve los datos: se hace sobre la FAT en disco y se guarda al terminar
+        forgetCachedArchive(tarFilename, 1);
+        unsigned char keepOpen = keepArchivesOpen;
+        keepArchivesOpen = 0;
+        if (budgetNanos > 0 || budgetBytes > 0)
         {
-            // Iterar sobre los archivos adicionales para agregarlos al archivo TAR
-            for (int i = optind; i < argc; i++)
-            {
-                // Agregar el archivo al archivo TAR
-                writeFileToTar(argv[i], tarFile, &fatTable);
-            }
-
-            if (verbose == 2)
-            {
-                printf("Actualizando la estructura FAT...\n\n");
-            }
-            // Guardar la FAT table actualizada en el archivo TAR
-            fseek(tarFile, 0, SEEK_SET);
-            saveFatTableToFile(&fatTable, tarFile);
-
-            fclose(tarFile);
-            printf("Archivo(s) agregado(s) a %s\n", tarFilename);
+            packIncremental(tarFilename, budgetNanos, budgetBytes);
         }
         else
         {
-            printf("No se encontró un conjunto de bloques libres seguidos para almacenar el archivo.\n");
-            fclose(tarFile);
-            return 1;
+            packTar(tarFilename);
         }
+        keepArchivesOpen = keepOpen;
     }
-    else if (pack)
+    else if (verify)
+    {
+        // Un bloque corrupto tambien termina con error, para scripts y cron
+        status = verifyTar(tarFilename, jobs) != 0;
+    }
+    else if (commit)
+    {
+        commitTar(tarFilename);
+    }
+    else if (batch)
+    {
+        status = batchTar(tarFilename, batchFilename, jobs) != 0;
+    }
+    else if (merge)
     {
-        packTar(tarFilename);
+        // Si falla se descarta todo: se trabaja sobre la FAT en disco, no
+        // sobre la del servidor, que puede tener otros cambios sin guardar
+        forgetCachedArchive(tarFilename, 1);
+        unsigned char keepOpen = keepArchivesOpen;
+        keepArchivesOpen = 0;
+        status = mergeTars(tarFilename, argv + optind, argc - optind) != 0;
+        keepArchivesOpen = keepOpen;
     }
 
-    return 0;
+    if (stats)
+    {
+        writeStats();
+    }
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    return runCommand(argc, argv);
 }
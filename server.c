@@ -0,0 +1,442 @@
+#include "archive.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Servidor de TAR (--serve): un proceso que mantiene abiertos los TAR con su
+// FAT y mapa libre en memoria y atiende operaciones por un socket Unix. El
+// cliente (--connect) envia sus argumentos junto con stdin, stdout, stderr y
+// su directorio actual; el servidor ejecuta la operacion con esos descriptores
+// y devuelve el codigo de salida. Las operaciones se atienden de a una. La FAT
+// se escribe a disco SERVER_FLUSH_MS despues del primer cambio, con --commit
+// o al terminar el servidor (SIGINT, SIGTERM). Una conexion que no envia su
+// solicitud en SERVER_IDLE_MS se cierra para no detener a los demas clientes.
+
+#define SERVER_MAGIC "TREQ"
+#define SERVER_FLUSH_MS 1000     // Espera maxima antes de guardar una FAT modificada
+#define SERVER_MAX_REQUEST 65536 // Tamanno maximo de los argumentos enviados
+#define SERVER_FDS 4             // stdin, stdout, stderr y directorio actual
+#define SERVER_IDLE_MS 5000      // Espera maxima por la solicitud de un cliente
+
+typedef struct ServerRequest
+{
+    char magic[4];       // "TREQ"
+    unsigned int argc;   // Cantidad de argumentos
+    unsigned int length; // Bytes de los argumentos (separados por '\0')
+} ServerRequest;
+
+static volatile sig_atomic_t stopServer = 0;
+
+void handleStopSignal(int signal)
+{
+    (void)signal;
+    stopServer = 1;
+}
+
+int serverAddress(const char *socketPath, struct sockaddr_un *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address->sun_path))
+    {
+        fprintf(stderr, "ERROR: la ruta del socket %s es demasiado larga\n", socketPath);
+        return -1;
+    }
+    strcpy(address->sun_path, socketPath);
+    return 0;
+}
+
+int sendAll(int fd, const void *buffer, size_t length)
+{
+    const char *data = buffer;
+    while (length > 0)
+    {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return -1;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+int receiveAll(int fd, void *buffer, size_t length)
+{
+    char *data = buffer;
+    while (length > 0)
+    {
+        ssize_t received = recv(fd, data, length, 0);
+        if (received < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received <= 0)
+        {
+            return -1;
+        }
+        data += received;
+        length -= received;
+    }
+    return 0;
+}
+
+int receiveRequest(int client, ServerRequest *request, int fds[SERVER_FDS])
+{
+    // La cabecera viaja junto con los descriptores (SCM_RIGHTS)
+    union
+    {
+        char buffer[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {request, sizeof(*request)};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    int numFds = 0;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), numFds * sizeof(int));
+    }
+    if (received != sizeof(*request) || numFds != SERVER_FDS || (message.msg_flags & MSG_CTRUNC) ||
+        memcmp(request->magic, SERVER_MAGIC, 4) != 0 || request->argc == 0 ||
+        request->length > SERVER_MAX_REQUEST)
+    {
+        for (int i = 0; i < numFds; i++)
+        {
+            close(fds[i]);
+        }
+        // Una conexion cerrada sin datos es la prueba de otro --serve
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            fprintf(stderr, "ERROR: el cliente no envio la solicitud a tiempo\n");
+        }
+        else if (received != 0)
+        {
+            fprintf(stderr, "ERROR: solicitud invalida en el socket\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int runClientCommand(int fds[SERVER_FDS], int argc, char *argv[])
+{
+    // La operacion usa los descriptores y el directorio del cliente
+    fflush(stdout);
+    fflush(stderr);
+    int saved[3];
+    for (int i = 0; i < 3; i++)
+    {
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+    }
+    int cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int status = 1;
+    if (fchdir(fds[3]) == 0)
+    {
+        status = runCommand(argc, argv);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: no se pudo usar el directorio del cliente\n");
+    }
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdin);
+
+    if (cwd >= 0)
+    {
+        if (fchdir(cwd) != 0)
+        {
+            perror("fchdir");
+        }
+        close(cwd);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    return status;
+}
+
+void handleClient(int client)
+{
+    // Solo el mismo usuario puede operar sobre los TAR del servidor
+    struct ucred peer;
+    socklen_t peerLength = sizeof(peer);
+    if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) != 0 || peer.uid != getuid())
+    {
+        return;
+    }
+
+    // Un cliente que conecta y no envia nada no puede detener al servidor
+    struct timeval idle = {SERVER_IDLE_MS / 1000, SERVER_IDLE_MS % 1000 * 1000};
+    if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle)) != 0 ||
+        setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &idle, sizeof(idle)) != 0)
+    {
+        return;
+    }
+
+    ServerRequest request;
+    int fds[SERVER_FDS];
+    if (receiveRequest(client, &request, fds) != 0)
+    {
+        return;
+    }
+
+    char *arguments = malloc(request.length + 1);
+    char **argv = calloc(request.argc + 1, sizeof(char *));
+    int status = 1;
+    if (receiveAll(client, arguments, request.length) != 0)
+    {
+        fprintf(stderr, "ERROR: el cliente no envio sus argumentos completos\n");
+    }
+    else
+    {
+        arguments[request.length] = '\0';
+        unsigned int argc = 0;
+        for (char *arg = arguments; argc < request.argc && arg < arguments + request.length; arg += strlen(arg) + 1)
+        {
+            argv[argc++] = arg;
+        }
+        if (argc == request.argc)
+        {
+            status = runClientCommand(fds, argc, argv);
+        }
+    }
+    free(argv);
+    free(arguments);
+    for (int i = 0; i < SERVER_FDS; i++)
+    {
+        close(fds[i]);
+    }
+    sendAll(client, &status, sizeof(status));
+}
+
+int openServerSocket(const char *socketPath)
+{
+    struct sockaddr_un address;
+    if (serverAddress(socketPath, &address) != 0)
+    {
+        return -1;
+    }
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    // Un socket que ya acepta conexiones pertenece a otro servidor; si no, quedo de uno anterior
+    if (connect(server, (struct sockaddr *)&address, sizeof(address)) == 0)
+    {
+        fprintf(stderr, "ERROR: ya hay un servidor en %s\n", socketPath);
+        close(server);
+        return -1;
+    }
+    close(server);
+    struct stat st;
+    if (lstat(socketPath, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            fprintf(stderr, "ERROR: %s existe y no es un socket\n", socketPath);
+            return -1;
+        }
+        unlink(socketPath);
+    }
+
+    server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t mask = umask(077);
+    int bound = bind(server, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if (bound != 0 || listen(server, 16) != 0)
+    {
+        fprintf(stderr, "ERROR: no se pudo escuchar en %s: %s\n", socketPath, strerror(errno));
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+int serveArchives(const char *socketPath)
+{
+    int server = openServerSocket(socketPath);
+    if (server < 0)
+    {
+        return 1;
+    }
+
+    // Sin SA_RESTART: la senal interrumpe poll y el servidor termina guardando
+    struct sigaction action = {0};
+    action.sa_handler = handleStopSignal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    keepArchivesOpen = 1;
+    fprintf(stderr, "Servidor escuchando en %s\n", socketPath);
+
+    unsigned long long dirtySince = 0; // Primer cambio sin guardar (0 si no hay)
+    while (!stopServer)
+    {
+        int timeout = -1;
+        if (dirtySince != 0)
+        {
+            unsigned long long elapsed = (monotonicNanos() - dirtySince) / 1000000;
+            timeout = elapsed >= SERVER_FLUSH_MS ? 0 : SERVER_FLUSH_MS - elapsed;
+        }
+        struct pollfd pfd = {server, POLLIN, 0};
+        int ready = poll(&pfd, 1, timeout);
+        if (ready < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+
+        if (ready > 0)
+        {
+            int client = accept4(server, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0)
+            {
+                handleClient(client);
+                close(client);
+            }
+        }
+
+        // Guardado diferido: se agrupan los cambios de las operaciones cercanas
+        if (dirtySince != 0 && (monotonicNanos() - dirtySince) / 1000000 >= SERVER_FLUSH_MS)
+        {
+            flushCachedArchives();
+            dirtySince = 0;
+        }
+        if (dirtySince == 0 && hasUnsavedArchives())
+        {
+            dirtySince = monotonicNanos();
+        }
+    }
+
+    closeCachedArchives();
+    keepArchivesOpen = 0;
+    close(server);
+    unlink(socketPath);
+    fprintf(stderr, "Servidor detenido, cambios guardados\n");
+    return 0;
+}
+
+int runRemoteCommand(const char *socketPath, int argc, char *argv[])
+{
+    // Se envian los argumentos sin --connect; el servidor los interpreta igual que main
+    char **forwarded = malloc((argc + 1) * sizeof(char *));
+    int numForwarded = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--connect") == 0)
+        {
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "--connect=", 10) == 0)
+        {
+            continue;
+        }
+        forwarded[numForwarded++] = argv[i];
+    }
+    size_t length = 0;
+    for (int i = 0; i < numForwarded; i++)
+    {
+        length += strlen(forwarded[i]) + 1;
+    }
+    if (length > SERVER_MAX_REQUEST)
+    {
+        fprintf(stderr, "ERROR: demasiados argumentos para enviar al servidor\n");
+        free(forwarded);
+        return 1;
+    }
+    char *arguments = malloc(length);
+    char *position = arguments;
+    for (int i = 0; i < numForwarded; i++)
+    {
+        size_t argLength = strlen(forwarded[i]) + 1;
+        memcpy(position, forwarded[i], argLength);
+        position += argLength;
+    }
+
+    struct sockaddr_un address;
+    int client = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (serverAddress(socketPath, &address) != 0 ||
+        connect(client, (struct sockaddr *)&address, sizeof(address)) != 0)
+    {
+        fprintf(stderr, "ERROR: no se pudo conectar al servidor en %s\n", socketPath);
+        close(client);
+        free(arguments);
+        free(forwarded);
+        return 1;
+    }
+
+    int fds[SERVER_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+    ServerRequest request;
+    memcpy(request.magic, SERVER_MAGIC, 4);
+    request.argc = numForwarded;
+    request.length = length;
+
+    union
+    {
+        char buffer[CMSG_SPACE(SERVER_FDS * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message = {0};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(SERVER_FDS * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int status = 1;
+    fflush(stdout);
+    if (fds[3] >= 0 && sendmsg(client, &message, MSG_NOSIGNAL) == sizeof(request) &&
+        sendAll(client, arguments, length) == 0 && receiveAll(client, &status, sizeof(status)) == 0)
+    {
+        close(client);
+    }
+    else
+    {
+        fprintf(stderr, "ERROR: el servidor en %s no respondio\n", socketPath);
+        close(client);
+        status = 1;
+    }
+    if (fds[3] >= 0)
+    {
+        close(fds[3]);
+    }
+    free(arguments);
+    free(forwarded);
+    return status;
+}
@@ -0,0 +1,180 @@
+#include "archive.h"
+#include <sys/resource.h>
+
+// Estadisticas de --stats: tiempo por fase, llamadas al sistema del motor de
+// copia y rendimiento de cada archivo. Los hilos suman con operaciones
+// atomicas; sin --stats statStart devuelve 0 y nada se mide.
+
+unsigned char collectStats = 0; // Medir fases y llamadas (--stats)
+TarStats tarStats;
+
+static const char *phaseNames[STAT_PHASES] = {
+    "fat_load", "journal_replay", "allocate", "copy", "checksum", "fat_save", "journal_commit"};
+static const char *callNames[STAT_CALLS] = {
+    "copy_file_range", "sendfile", "splice", "pread", "pwrite", "fdatasync", "io_uring_enter", "ficlonerange"};
+
+unsigned long long monotonicNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void startStats(const char *operation)
+{
+    // El servidor mide cada operacion por separado
+    for (unsigned int i = 0; i < tarStats.numMembers; i++)
+    {
+        free(tarStats.members[i].filename);
+    }
+    free(tarStats.members);
+    memset(&tarStats, 0, sizeof(tarStats));
+    collectStats = 1;
+    tarStats.operation = operation;
+    tarStats.startNanos = monotonicNanos();
+    pthread_mutex_init(&tarStats.lock, NULL);
+}
+
+unsigned long long statStart()
+{
+    return collectStats ? monotonicNanos() : 0;
+}
+
+void statEnd(StatPhase phase, unsigned long long start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    __atomic_fetch_add(&tarStats.phaseNanos[phase], monotonicNanos() - start, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tarStats.phaseCount[phase], 1, __ATOMIC_RELAXED);
+}
+
+void statCall(StatCall call, long long bytes)
+{
+    if (!collectStats)
+    {
+        return;
+    }
+    __atomic_fetch_add(&tarStats.calls[call], 1, __ATOMIC_RELAXED);
+    if (bytes > 0)
+    {
+        __atomic_fetch_add(&tarStats.callBytes[call], bytes, __ATOMIC_RELAXED);
+    }
+}
+
+void statMember(const char *filename, unsigned long long bytes, unsigned long long start)
+{
+    if (start == 0)
+    {
+        return;
+    }
+    unsigned long long nanos = monotonicNanos() - start;
+    pthread_mutex_lock(&tarStats.lock);
+    if (tarStats.numMembers == tarStats.memberCapacity)
+    {
+        tarStats.memberCapacity = tarStats.memberCapacity ? tarStats.memberCapacity * 2 : 64;
+        tarStats.members = realloc(tarStats.members, tarStats.memberCapacity * sizeof(StatMember));
+    }
+    StatMember *member = &tarStats.members[tarStats.numMembers++];
+    member->filename = strdup(filename);
+    member->bytes = bytes;
+    member->nanos = nanos;
+    pthread_mutex_unlock(&tarStats.lock);
+}
+
+void readProcIo(unsigned long long values[4])
+{
+    // rchar, wchar, syscr y syscw de todo el proceso (incluye todos los hilos)
+    static const char *keys[4] = {"rchar:", "wchar:", "syscr:", "syscw:"};
+    char line[128];
+    memset(values, 0, 4 * sizeof(unsigned long long));
+    FILE *file = fopen("/proc/self/io", "r");
+    while (file != NULL && fgets(line, sizeof(line), file) != NULL)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            if (strncmp(line, keys[i], strlen(keys[i])) == 0)
+            {
+                values[i] = strtoull(line + strlen(keys[i]), NULL, 10);
+            }
+        }
+    }
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+}
+
+void printJsonString(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (; *text; text++)
+    {
+        if (*text == '"' || *text == '\\')
+        {
+            fputc('\\', out);
+        }
+        if ((unsigned char)*text < 0x20)
+        {
+            fprintf(out, "\\u%04x", *text);
+            continue;
+        }
+        fputc(*text, out);
+    }
+    fputc('"', out);
+}
+
+void printStats(FILE *out)
+{
+    double wall = (monotonicNanos() - tarStats.startNanos) / 1e9;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    unsigned long long io[4];
+    readProcIo(io);
+
+    fprintf(out, "{\n  \"operation\": ");
+    printJsonString(out, tarStats.operation ? tarStats.operation : "");
+    fprintf(out, ",\n  \"wall_seconds\": %.6f,\n", wall);
+    fprintf(out, "  \"cpu_user_seconds\": %.6f,\n  \"cpu_system_seconds\": %.6f,\n",
+            usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6, usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6);
+    fprintf(out, "  \"max_rss_kb\": %ld,\n  \"page_faults\": {\"minor\": %ld, \"major\": %ld},\n", usage.ru_maxrss, usage.ru_minflt, usage.ru_majflt);
+    fprintf(out, "  \"context_switches\": {\"voluntary\": %ld, \"involuntary\": %ld},\n", usage.ru_nvcsw, usage.ru_nivcsw);
+    fprintf(out, "  \"io\": {\"bytes_read\": %llu, \"bytes_written\": %llu, \"read_syscalls\": %llu, \"write_syscalls\": %llu},\n",
+            io[0], io[1], io[2], io[3]);
+
+    // Tiempo sumado de todos los hilos; journal_commit es parte de fat_save
+    fprintf(out, "  \"phases\": {");
+    for (int i = 0; i < STAT_PHASES; i++)
+    {
+        fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"seconds\": %.6f}", i > 0 ? "," : "",
+                phaseNames[i], tarStats.phaseCount[i], tarStats.phaseNanos[i] / 1e9);
+    }
+    fprintf(out, "\n  },\n  \"calls\": {");
+    for (int i = 0; i < STAT_CALLS; i++)
+    {
+        fprintf(out, "%s\n    \"%s\": {\"count\": %llu, \"bytes\": %llu}", i > 0 ? "," : "",
+                callNames[i], tarStats.calls[i], tarStats.callBytes[i]);
+    }
+
+    unsigned long long memberBytes = 0, memberNanos = 0;
+    for (unsigned int i = 0; i < tarStats.numMembers; i++)
+    {
+        memberBytes += tarStats.members[i].bytes;
+        memberNanos += tarStats.members[i].nanos;
+    }
+    fprintf(out, "\n  },\n  \"members_total\": {\"count\": %u, \"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.2f},\n",
+            tarStats.numMembers, memberBytes, memberNanos / 1e9,
+            memberNanos > 0 ? memberBytes / (memberNanos / 1e9) / (1024 * 1024) : 0.0);
+    fprintf(out, "  \"members\": [");
+    for (unsigned int i = 0; i < tarStats.numMembers; i++)
+    {
+        StatMember *member = &tarStats.members[i];
+        double seconds = member->nanos / 1e9;
+        fprintf(out, "%s\n    {\"name\": ", i > 0 ? "," : "");
+        printJsonString(out, member->filename);
+        fprintf(out, ", \"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.2f}",
+                member->bytes, seconds, seconds > 0 ? member->bytes / seconds / (1024 * 1024) : 0.0);
+    }
+    fprintf(out, "%s]\n}\n", tarStats.numMembers > 0 ? "\n  " : "");
+}
@@ -0,0 +1,395 @@
+#include "archive.h"
+
+// Motor de copia con io_uring usando las llamadas al sistema directamente
+// (sin liburing). Cada hilo tiene su propio anillo con URING_DEPTH buffers
+// registrados: se mantienen muchas lecturas y escrituras en vuelo y cada
+// buffer pasa de lectura a escritura sin copiar. Si el kernel no tiene
+// io_uring el anillo no se crea y el motor de copia usa el camino de siempre.
+
+unsigned char ioBackend = IO_SYNC; // Backend del motor de copia (--io)
+unsigned char ioSqPoll = 0;        // Hilo del kernel que consume la cola (--sqpoll)
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#define URING_DEPTH 32        // Operaciones en vuelo por anillo
+#define URING_CHUNK BLOCK_SIZE // Tamanno de cada buffer
+
+typedef struct UringSlot
+{
+    off_t offset;         // Posicion relativa al inicio de la copia
+    unsigned int length;  // Bytes leidos en el buffer
+    unsigned int written; // Bytes ya escritos
+    unsigned char writing; // La operacion en vuelo es una escritura
+    struct iovec io;      // Parte del buffer de la operacion en vuelo
+} UringSlot;
+
+struct IoRing
+{
+    int fd;                    // Descriptor del anillo
+    unsigned int *sqHead;      // Cola de envio
+    unsigned int *sqTail;
+    unsigned int *sqMask;
+    unsigned int *sqFlags;
+    unsigned int *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned int *cqHead;      // Cola de terminacion
+    unsigned int *cqTail;
+    unsigned int *cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;              // Mapeos del anillo (para munmap)
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned int toSubmit;     // Entradas en la cola sin pasar al kernel
+    unsigned char sqPoll;      // El kernel consume la cola por su cuenta
+    unsigned char registered;  // Los buffers estan registrados (READ_FIXED)
+    struct iovec iov[URING_DEPTH]; // Buffers de cada ranura (los que se registran)
+    UringSlot slots[URING_DEPTH];
+};
+
+int ioRingSetup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioRingEnter(IoRing *ring, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    statCall(CALL_URING_ENTER, 0);
+    return syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+void ioRingFree(IoRing *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    if (ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != ring->sqRing)
+    {
+        munmap(ring->cqRing, ring->cqRingSize);
+    }
+    if (ring->sqRing != NULL)
+    {
+        munmap(ring->sqRing, ring->sqRingSize);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        free(ring->iov[i].iov_base);
+    }
+    free(ring);
+}
+
+IoRing *ioRingCreate(int sqPoll)
+{
+    IoRing *ring = calloc(1, sizeof(IoRing));
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    if (sqPoll)
+    {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000;
+    }
+    ring->fd = ioRingSetup(URING_DEPTH, &params);
+    if (ring->fd < 0 && sqPoll)
+    {
+        // SQ polling puede requerir privilegios: seguir sin el
+        memset(&params, 0, sizeof(params));
+        ring->fd = ioRingSetup(URING_DEPTH, &params);
+    }
+    if (ring->fd < 0)
+    {
+        ring->fd = -1;
+        ioRingFree(ring);
+        return NULL;
+    }
+    ring->sqPoll = (params.flags & IORING_SETUP_SQPOLL) != 0;
+
+    // Mapear las dos colas (una sola region si el kernel lo permite) y las entradas
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cqRingSize > ring->sqRingSize)
+        {
+            ring->sqRingSize = ring->cqRingSize;
+        }
+        ring->cqRingSize = ring->sqRingSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+    {
+        ring->sqRing = NULL;
+        ioRingFree(ring);
+        return NULL;
+    }
+    ring->cqRing = ring->sqRing;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+        {
+            ring->cqRing = NULL;
+            ioRingFree(ring);
+            return NULL;
+        }
+    }
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        ioRingFree(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sqRing, *cq = ring->cqRing;
+    ring->sqHead = (unsigned int *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sqMask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sqFlags = (unsigned int *)(sq + params.sq_off.flags);
+    ring->sqArray = (unsigned int *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned int *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqMask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Buffers registrados: el kernel no tiene que fijar las paginas en cada
+    // operacion. Si el limite de memoria bloqueada no alcanza se usan sin registrar.
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        if (posix_memalign(&ring->iov[i].iov_base, 4096, URING_CHUNK) != 0)
+        {
+            ring->iov[i].iov_base = NULL;
+            ioRingFree(ring);
+            return NULL;
+        }
+        ring->iov[i].iov_len = URING_CHUNK;
+    }
+    ring->registered = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, ring->iov, URING_DEPTH) == 0;
+    return ring;
+}
+
+void ioRingQueue(IoRing *ring, int slot, int writing, int fd, unsigned int length, off_t offset)
+{
+    unsigned int tail = *ring->sqTail;
+    unsigned int index = tail & *ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    UringSlot *entry = &ring->slots[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    entry->io.iov_base = (char *)ring->iov[slot].iov_base + (writing ? entry->written : 0);
+    entry->io.iov_len = length;
+    entry->writing = writing;
+    if (ring->registered)
+    {
+        sqe->opcode = writing ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->addr = (unsigned long)entry->io.iov_base;
+        sqe->len = length;
+        sqe->buf_index = slot;
+    }
+    else
+    {
+        // readv/writev de un solo iovec, disponibles desde la primera version de io_uring
+        sqe->opcode = writing ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->addr = (unsigned long)&entry->io;
+        sqe->len = 1;
+    }
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->user_data = slot;
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->toSubmit++;
+}
+
+int ioRingSubmitAndWait(IoRing *ring)
+{
+    // Pasar la cola al kernel y esperar al menos una terminacion
+    unsigned int flags = IORING_ENTER_GETEVENTS;
+    unsigned int toSubmit = ring->toSubmit;
+    if (ring->sqPoll)
+    {
+        // El hilo del kernel toma la cola solo; hay que despertarlo si se durmio
+        toSubmit = 0;
+        if (__atomic_load_n(ring->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+        {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+    }
+    ring->toSubmit = 0;
+    while (ioRingEnter(ring, toSubmit, 1, flags) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return -1;
+        }
+        toSubmit = 0;
+    }
+    return 0;
+}
+off_t ioRingCopy(IoRing *ring, int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, ExtentCrc *check, unsigned long long position)
+{
+    // Cada ranura lee un trozo y, al terminar, escribe ese mismo buffer.
+    // Las lecturas terminan en cualquier orden, asi que una escritura puede
+    // pisar un trozo del origen que todavia se esta leyendo: no admite rangos
+    // que se solapan dentro del mismo archivo. -p y los demas movimientos
+    // copian siempre a bloques recien reservados, fuera del origen. Con check
+    // cada trozo leido (un bloque completo, position es multiplo de
+    // BLOCK_SIZE) pasa por checksumBytes antes de escribirse.
+    int freeSlots[URING_DEPTH];
+    int numFree = URING_DEPTH, inFlight = 0, error = 0;
+    for (int i = 0; i < URING_DEPTH; i++)
+    {
+        freeSlots[i] = URING_DEPTH - 1 - i;
+    }
+    off_t nextRead = 0, copied = 0;
+    int endOfFile = 0;
+
+    while (1)
+    {
+        while (numFree > 0 && !endOfFile && !error && nextRead < length)
+        {
+            int slot = freeSlots[--numFree];
+            unsigned int chunk = length - nextRead < URING_CHUNK ? length - nextRead : URING_CHUNK;
+            ring->slots[slot].offset = nextRead;
+            ring->slots[slot].length = chunk;
+            ring->slots[slot].written = 0;
+            ioRingQueue(ring, slot, 0, inFd, chunk, inOffset + nextRead);
+            nextRead += chunk;
+            inFlight++;
+        }
+        if (inFlight == 0)
+        {
+            break;
+        }
+        if (ioRingSubmitAndWait(ring) != 0)
+        {
+            // Sin poder esperar no se pueden liberar los buffers en vuelo
+            return -1;
+        }
+
+        unsigned int head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+            int slot = cqe->user_data;
+            int result = cqe->res;
+            head++;
+            UringSlot *entry = &ring->slots[slot];
+            inFlight--;
+            if (result < 0 || error)
+            {
+                error = error ? error : -result;
+                freeSlots[numFree++] = slot;
+                continue;
+            }
+            if (!entry->writing)
+            {
+                // Una lectura corta solo ocurre al final del archivo de origen
+                if ((unsigned int)result < entry->length)
+                {
+                    endOfFile = 1;
+                    entry->length = result;
+                }
+                if (result == 0)
+                {
+                    freeSlots[numFree++] = slot;
+                    continue;
+                }
+                if (check != NULL && checksumBytes(check, position + entry->offset, ring->iov[slot].iov_base, entry->length) != 0)
+                {
+                    error = EBADMSG;
+                    freeSlots[numFree++] = slot;
+                    continue;
+                }
+                ioRingQueue(ring, slot, 1, outFd, entry->length, outOffset + entry->offset);
+                inFlight++;
+            }
+            else
+            {
+                entry->written += result;
+                if (result == 0)
+                {
+                    error = EIO;
+                    freeSlots[numFree++] = slot;
+                }
+                else if (entry->written < entry->length)
+                {
+                    ioRingQueue(ring, slot, 1, outFd, entry->length - entry->written, outOffset + entry->offset + entry->written);
+                    inFlight++;
+                }
+                else
+                {
+                    copied += entry->length;
+                    freeSlots[numFree++] = slot;
+                }
+            }
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (error)
+    {
+        errno = error;
+        return -1;
+    }
+    return copied;
+}
+
+pthread_key_t ioRingKey;
+pthread_once_t ioRingOnce = PTHREAD_ONCE_INIT;
+
+void ioRingDestroy(void *ring)
+{
+    if (ring != (void *)-1)
+    {
+        ioRingFree(ring);
+    }
+}
+
+void initIoRingKey()
+{
+    pthread_key_create(&ioRingKey, ioRingDestroy);
+}
+
+IoRing *threadIoRing()
+{
+    // Un anillo por hilo, creado en la primera copia; (void *)-1 recuerda
+    // que el kernel no lo soporta para no intentarlo en cada archivo
+    pthread_once(&ioRingOnce, initIoRingKey);
+    IoRing *ring = pthread_getspecific(ioRingKey);
+    if (ring == NULL)
+    {
+        ring = ioRingCreate(ioSqPoll);
+        if (ring == NULL && verbose == 2)
+        {
+            fprintf(stderr, "io_uring no disponible (%s), se usa E/S bloqueante.\n", strerror(errno));
+        }
+        pthread_setspecific(ioRingKey, ring != NULL ? ring : (void *)-1);
+    }
+    return ring == (void *)-1 ? NULL : ring;
+}
+#else
+IoRing *threadIoRing()
+{
+    return NULL;
+}
+
+off_t ioRingCopy(IoRing *ring, int inFd, off_t inOffset, int outFd, off_t outOffset, off_t length, ExtentCrc *check, unsigned long long position)
+{
+    (void)ring, (void)inFd, (void)inOffset, (void)outFd, (void)outOffset, (void)length, (void)check, (void)position;
+    errno = ENOSYS;
+    return -1;
+}
+#endif
@@ -0,0 +1,346 @@
+#include "archive.h"
+#include <dirent.h>
+
+// Recorrido paralelo de directorios para -c y -r. Varios hilos toman
+// directorios de una pila compartida, leen sus entradas (getdents) y hacen
+// fstatat relativo al directorio abierto. Los archivos regulares salen en
+// lotes hacia el hilo principal, que los planifica mientras los hilos de
+// copia ya trabajan con los anteriores. Los enlaces simbolicos no se siguen.
+
+#define WALK_BATCH 256 // Archivos por lote entregado al hilo principal
+
+typedef struct WalkBatch
+{
+    WalkedFile files[WALK_BATCH]; // Archivos encontrados
+    unsigned int count;           // Archivos en el lote
+    struct WalkBatch *next;       // Siguiente lote en la cola
+} WalkBatch;
+
+struct FileWalk
+{
+    char **dirs;              // Directorios por leer (pila)
+    unsigned int numDirs;     // Directorios en la pila
+    unsigned int dirCapacity; // Capacidad de la pila
+    unsigned int active;      // Hilos leyendo un directorio
+    int done;                 // No quedan directorios ni hilos activos
+    unsigned int errors;      // Rutas que no se pudieron leer
+    WalkBatch *head;          // Lotes listos para planificar
+    WalkBatch *tail;          // Ultimo lote de la cola
+    WalkBatch *current;       // Lote que esta entregando nextWalkedFile
+    unsigned int position;    // Siguiente archivo de current
+    pthread_mutex_t lock;     // Protege todo lo anterior salvo current y position
+    pthread_cond_t dirReady;  // Hay directorios o el recorrido termino
+    pthread_cond_t filesReady; // Hay lotes o el recorrido termino
+    pthread_t *threads;       // Hilos del recorrido
+    int numThreads;           // Cantidad de hilos
+};
+
+const char *memberName(const char *path)
+{
+    // Nombre dentro del TAR: la ruta sin "/", "./" ni "../" al inicio
+    while (1)
+    {
+        if (path[0] == '/')
+        {
+            path++;
+        }
+        else if (path[0] == '.' && path[1] == '/')
+        {
+            path += 2;
+        }
+        else if (path[0] == '.' && path[1] == '.' && path[2] == '/')
+        {
+            path += 3;
+        }
+        else
+        {
+            return path;
+        }
+    }
+}
+
+int isSafeMemberName(const char *name)
+{
+    // Al extraer no se escribe fuera del directorio actual
+    if (name[0] == '\0' || name[0] == '/')
+    {
+        return 0;
+    }
+    for (const char *part = name; part != NULL; part = strchr(part, '/'))
+    {
+        part += *part == '/';
+        if (strncmp(part, "..", 2) == 0 && (part[2] == '/' || part[2] == '\0'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int createParentDirectories(const char *path)
+{
+    // mkdir -p de los directorios de la ruta
+    char *copy = strdup(path);
+    int result = 0;
+    for (char *slash = strchr(copy + 1, '/'); slash != NULL && result == 0; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(copy, 0755) != 0 && errno != EEXIST)
+        {
+            result = -1;
+        }
+        *slash = '/';
+    }
+    free(copy);
+    return result;
+}
+
+char *joinPath(const char *dir, const char *name)
+{
+    size_t dirLength = strlen(dir);
+    size_t nameLength = strlen(name);
+    int slash = dirLength > 0 && dir[dirLength - 1] != '/';
+    char *path = malloc(dirLength + slash + nameLength + 1);
+    memcpy(path, dir, dirLength);
+    path[dirLength] = '/';
+    memcpy(path + dirLength + slash, name, nameLength + 1);
+    return path;
+}
+
+void pushWalkDir(FileWalk *walk, char *dir)
+{
+    if (walk->numDirs == walk->dirCapacity)
+    {
+        walk->dirCapacity = walk->dirCapacity ? walk->dirCapacity * 2 : 64;
+        walk->dirs = realloc(walk->dirs, walk->dirCapacity * sizeof(char *));
+    }
+    walk->dirs[walk->numDirs++] = dir;
+}
+
+void queueWalkBatch(FileWalk *walk, WalkBatch *batch)
+{
+    batch->next = NULL;
+    if (walk->tail != NULL)
+    {
+        walk->tail->next = batch;
+    }
+    else
+    {
+        walk->head = batch;
+    }
+    walk->tail = batch;
+    pthread_cond_signal(&walk->filesReady);
+}
+
+void readWalkDir(FileWalk *walk, char *dir)
+{
+    DIR *stream = opendir(dir);
+    if (stream == NULL)
+    {
+        printf("ERROR: no se pudo leer el directorio %s\n", dir);
+        pthread_mutex_lock(&walk->lock);
+        walk->errors++;
+        pthread_mutex_unlock(&walk->lock);
+        return;
+    }
+
+    WalkBatch *batch = malloc(sizeof(WalkBatch));
+    batch->count = 0;
+    char **subdirs = NULL;
+    unsigned int numSubdirs = 0, subdirCapacity = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(stream)) != NULL)
+    {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        // d_type evita el fstatat de los subdirectorios y de lo que no se archiva
+        if (dirent->d_type != DT_DIR && dirent->d_type != DT_REG && dirent->d_type != DT_UNKNOWN)
+        {
+            continue;
+        }
+
+        WalkedFile *file = &batch->files[batch->count];
+        file->path = joinPath(dir, dirent->d_name);
+        if (dirent->d_type != DT_DIR &&
+            (fstatat(dirfd(stream), dirent->d_name, &file->st, AT_SYMLINK_NOFOLLOW) != 0 ||
+             !(S_ISREG(file->st.st_mode) || S_ISDIR(file->st.st_mode))))
+        {
+            free(file->path);
+            continue;
+        }
+        if (dirent->d_type == DT_DIR || S_ISDIR(file->st.st_mode))
+        {
+            if (numSubdirs == subdirCapacity)
+            {
+                subdirCapacity = subdirCapacity ? subdirCapacity * 2 : 16;
+                subdirs = realloc(subdirs, subdirCapacity * sizeof(char *));
+            }
+            subdirs[numSubdirs++] = file->path;
+            continue;
+        }
+
+        // Entregar por lotes para que la copia empiece sin esperar el directorio completo
+        if (++batch->count == WALK_BATCH)
+        {
+            pthread_mutex_lock(&walk->lock);
+            queueWalkBatch(walk, batch);
+            pthread_mutex_unlock(&walk->lock);
+            batch = malloc(sizeof(WalkBatch));
+            batch->count = 0;
+        }
+    }
+    closedir(stream);
+
+    pthread_mutex_lock(&walk->lock);
+    if (batch->count > 0)
+    {
+        queueWalkBatch(walk, batch);
+    }
+    else
+    {
+        free(batch);
+    }
+    for (unsigned int i = 0; i < numSubdirs; i++)
+    {
+        pushWalkDir(walk, subdirs[i]);
+    }
+    if (numSubdirs > 0)
+    {
+        pthread_cond_broadcast(&walk->dirReady);
+    }
+    pthread_mutex_unlock(&walk->lock);
+    free(subdirs);
+}
+
+void *walkWorker(void *arg)
+{
+    FileWalk *walk = arg;
+    pthread_mutex_lock(&walk->lock);
+    while (1)
+    {
+        while (walk->numDirs == 0 && walk->active > 0)
+        {
+            pthread_cond_wait(&walk->dirReady, &walk->lock);
+        }
+        if (walk->numDirs == 0)
+        {
+            break; // Nadie esta leyendo: ya no van a aparecer directorios
+        }
+        char *dir = walk->dirs[--walk->numDirs];
+        walk->active++;
+        pthread_mutex_unlock(&walk->lock);
+
+        readWalkDir(walk, dir);
+        free(dir);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->active--;
+        if (walk->numDirs == 0 && walk->active == 0)
+        {
+            walk->done = 1;
+            pthread_cond_broadcast(&walk->dirReady);
+            pthread_cond_broadcast(&walk->filesReady);
+        }
+    }
+    pthread_mutex_unlock(&walk->lock);
+    return NULL;
+}
+
+FileWalk *startFileWalk(char **paths, int numPaths, int threads)
+{
+    FileWalk *walk = calloc(1, sizeof(FileWalk));
+    pthread_mutex_init(&walk->lock, NULL);
+    pthread_cond_init(&walk->dirReady, NULL);
+    pthread_cond_init(&walk->filesReady, NULL);
+
+    // Los argumentos se revisan aqui para informar en orden los que no existen
+    WalkBatch *batch = NULL;
+    for (int i = 0; i < numPaths; i++)
+    {
+        struct stat st;
+        if (stat(paths[i], &st) != 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+        {
+            printf("ERROR: No se encontro el archivo %s\n", paths[i]);
+            walk->errors++;
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            pushWalkDir(walk, strdup(paths[i]));
+            continue;
+        }
+        if (batch == NULL || batch->count == WALK_BATCH)
+        {
+            batch = malloc(sizeof(WalkBatch));
+            batch->count = 0;
+            queueWalkBatch(walk, batch);
+        }
+        batch->files[batch->count].path = strdup(paths[i]);
+        batch->files[batch->count].st = st;
+        batch->count++;
+    }
+
+    if (walk->numDirs == 0)
+    {
+        walk->done = 1;
+        return walk;
+    }
+    walk->numThreads = threads;
+    walk->threads = startWorkers(walkWorker, walk, threads);
+    return walk;
+}
+
+int nextWalkedFile(FileWalk *walk, WalkedFile *file)
+{
+    // Devuelve 0 cuando el recorrido termino y no quedan archivos
+    while (walk->current == NULL || walk->position == walk->current->count)
+    {
+        free(walk->current);
+        walk->current = NULL;
+        pthread_mutex_lock(&walk->lock);
+        while (walk->head == NULL && !walk->done)
+        {
+            pthread_cond_wait(&walk->filesReady, &walk->lock);
+        }
+        walk->current = walk->head;
+        if (walk->head != NULL)
+        {
+            walk->head = walk->head->next;
+            if (walk->head == NULL)
+            {
+                walk->tail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&walk->lock);
+        walk->position = 0;
+        if (walk->current == NULL)
+        {
+            return 0;
+        }
+    }
+    *file = walk->current->files[walk->position++];
+    return 1;
+}
+
+unsigned int finishFileWalk(FileWalk *walk)
+{
+    // Devuelve la cantidad de rutas que no se pudieron leer
+    if (walk->threads != NULL)
+    {
+        joinWorkers(walk->threads, walk->numThreads);
+    }
+    WalkedFile file;
+    while (nextWalkedFile(walk, &file))
+    {
+        free(file.path);
+    }
+    free(walk->dirs);
+    pthread_cond_destroy(&walk->filesReady);
+    pthread_cond_destroy(&walk->dirReady);
+    pthread_mutex_destroy(&walk->lock);
+    unsigned int errors = walk->errors;
+    free(walk);
+    return errors;
+}